@@ -1,8 +1,21 @@
 #include "chai3d.h"
 #include <mutex>
+#include <atomic>
 #include <chrono>
 #include <vector>
+#include <memory>
 #include <deque>
+#include <cstdint>
+#include <cstddef>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <unordered_map>
+#include <map>
+#include <algorithm>
+#include <queue>
+#include <cstdio>
+#include <cstring>
 
 using namespace chai3d;
 using namespace std;
@@ -13,6 +26,33 @@ using namespace std;
 #include "GLUT/glut.h"
 #endif
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define USE_SSE_HIT_TEST
+#include <xmmintrin.h>
+#endif
+
+#if defined(LINUX)
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <GL/glx.h>
+#endif
+
+#if defined(MACOSX)
+#include <OpenGL/OpenGL.h>
+#include <ApplicationServices/ApplicationServices.h>
+#endif
+
+#include <sys/stat.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
 // GENERAL SETTINGS
 cStereoMode stereoMode = C_STEREO_DISABLED;
 bool fullscreen = false;
@@ -27,8 +67,6 @@ bool mirroredDisplay = false;
 cWorld* world;
 cCamera* camera;
 cHapticDeviceHandler* handler;
-cToolCursor* tool;
-cGenericHapticDevicePtr hapticDevice;
 bool simulationRunning = false;
 bool simulationFinished = true;
 cFrequencyCounter frequencyCounter;
@@ -37,6 +75,8 @@ cDirectionalLight* directionalLight;
 cPositionalLight* pointLight;
 cSpotLight* spotLight;
 
+void updateGlobalTransform(cGenericObject* node);
+
 void setupLights(cWorld* world) {
 	directionalLight = new cDirectionalLight(world);
 	world->addChild(directionalLight);
@@ -57,6 +97,7 @@ void setupLights(cWorld* world) {
 	pointLight->setAttConstant(1.0f);
 	pointLight->setAttLinear(0.1f);
 	pointLight->setAttQuadratic(0.01f);
+	pointLight->setGhostEnabled(true);  // moved by the render thread, see updateLights
 
 	// Spot light
 	spotLight = new cSpotLight(world);
@@ -77,6 +118,7 @@ void setupLights(cWorld* world) {
 void updateLights(double time) {
 	// Move the point light in a circular pattern
 	pointLight->setLocalPos(2.0 * cos(time), 2.0 * sin(time), 2.0);
+	updateGlobalTransform(pointLight);
 
 	// Change the color of the spot light over time
 	float r = (sin(time) + 1.0f) / 2.0f;
@@ -86,373 +128,4537 @@ void updateLights(double time) {
 
 int screenW, screenH, windowW, windowH, windowPosX, windowPosY;
 
-cMultiMesh* weapon_pistol = nullptr;
-cMultiMesh* weapon_dragunov = nullptr;
-cMultiMesh* weapon_rifle = nullptr;
-
 cMatrix3d pistolOrientation, dragunovOrientation, rifleOrientation;
 
-bool isPistolLoaded = true;
-bool isDragunovLoaded = false;
-bool isRifleLoaded = false;
-
 cLabel* weaponNameLabel;
 
-std::vector<cMesh*> blocks;
+double toolRadius = 0.001;
+double maxStiffness = 0.0;  // from the device specifications, set in main
 
-string resourceRoot;
+int blockGridSize = 5;  // obstacle field is blockGridSize x blockGridSize, see --blocks
 
-bool is_pressed;
-__int64 time_start;
-int elapsed_time;
+//------------------------------------------------------------------------------
+// OBSTACLE BROADPHASE
+//------------------------------------------------------------------------------
 
-cVector3d current_force;
-cVector3d current_torque;
-float deviation_angle;
+// Camera collision sphere; with the zero-size boxes from createBlocks this keeps
+// the 0.5 unit footprint the old point-in-box test assumed
+const double CAMERA_COLLISION_RADIUS = 0.25;
+const double BLOCK_SIZE = 0.0;  // edge length of the obstacle boxes
 
-__int64 coolOfftime = 0;
-bool sniperFiring = false;
-bool pistolFiring = false;
+struct Aabb {
+	cVector3d min;
+	cVector3d max;
+};
 
-cVector3d zero_vector(0, 0, 0);
+// Uniform grid over obstacle bounds. A block is listed in every cell its box
+// overlaps, so a query only looks at the blocks near its region. The field
+// is static: createBlocks fills the grid once and nothing moves a block
+// afterwards, so there is no incremental relink.
+class BlockGrid {
+private:
+	double cellSize;
+	std::unordered_map<long long, std::vector<int> > cells;
+	std::vector<Aabb> bounds;
+	std::vector<unsigned int> visited;  // last query that reported each block
+	unsigned int queryId;
+
+	static long long cellKey(int x, int y, int z) {
+		const long long mask = (1 << 21) - 1;
+		return ((x & mask) << 42) | ((y & mask) << 21) | (z & mask);
+	}
 
-std::mutex deviceMutex;
-std::mutex weaponMutex;
+	void cellRange(const Aabb& box, int lo[3], int hi[3]) const {
+		for (int k = 0; k < 3; k++) {
+			lo[k] = (int)floor(box.min(k) / cellSize);
+			hi[k] = (int)floor(box.max(k) / cellSize);
+		}
+	}
 
-volatile bool graphicsUpdateFlag = false;
+	void link(int id) {
+		int lo[3], hi[3];
+		cellRange(bounds[id], lo, hi);
+		for (int x = lo[0]; x <= hi[0]; x++)
+			for (int y = lo[1]; y <= hi[1]; y++)
+				for (int z = lo[2]; z <= hi[2]; z++) {
+					cells[cellKey(x, y, z)].push_back(id);
+				}
+	}
 
-cVector3d currentToolP;
-cVector3d lastToolP;
+	// Entry time of the segment from + t * delta into the box grown by radius,
+	// or -1 when it misses or starts inside (so the camera can always back out)
+	static double sweepEntry(const Aabb& box, double radius, const cVector3d& from, const cVector3d& delta, int& axis) {
+		double tEnter = 0.0, tExit = 1.0;
+		bool inside = true;
+		axis = -1;
+		for (int k = 0; k < 3; k++) {
+			double lo = box.min(k) - radius;
+			double hi = box.max(k) + radius;
+			if (from(k) < lo || from(k) > hi) inside = false;
+			if (fabs(delta(k)) < 1e-12) {
+				if (from(k) < lo || from(k) > hi) return -1.0;
+				continue;
+			}
+			double t1 = (lo - from(k)) / delta(k);
+			double t2 = (hi - from(k)) / delta(k);
+			if (t1 > t2) std::swap(t1, t2);
+			if (t1 > tEnter) { tEnter = t1; axis = k; }
+			tExit = cMin(tExit, t2);
+			if (tEnter > tExit) return -1.0;
+		}
+		return (inside || axis < 0) ? -1.0 : tEnter;
+	}
 
-cShapeLine* forceVector = nullptr;
-std::deque<cVector3d> forceHistory;
-const int FORCE_HISTORY_SIZE = 100;
-const double FORCE_SCALE = 0.1; // Adjust this to scale the force visualization
+public:
+	BlockGrid(double a_cellSize = 1.0) : cellSize(a_cellSize), queryId(0) {}
 
-// Add this function to initialize the force vector
-void initForceVisualization(cWorld* world) {
-	forceVector = new cShapeLine(cVector3d(0, 0, 0), cVector3d(0, 0, 0));
-	forceVector->setLineWidth(2.0);
-	forceVector->m_colorPointA.setRed();
-	forceVector->m_colorPointB.setRed();
-	world->addChild(forceVector);
-}
+	void clear() {
+		cells.clear();
+		bounds.clear();
+		visited.clear();
+	}
 
-// Add this function to update the force visualization
-void updateForceVisualization(const cVector3d& force, const cVector3d& position) {
-	cVector3d scaledForce = force * FORCE_SCALE;
-	forceVector->m_pointA = position;
-	forceVector->m_pointB = position + scaledForce;
+	int add(const Aabb& box) {
+		bounds.push_back(box);
+		visited.push_back(0);
+		int id = (int)bounds.size() - 1;
+		link(id);
+		return id;
+	}
 
-	forceHistory.push_front(scaledForce);
-	if (forceHistory.size() > FORCE_HISTORY_SIZE) {
-		forceHistory.pop_back();
+	const Aabb& getBounds(int id) const { return bounds[id]; }
+
+	// Collects every block whose cells overlap the region, each reported once
+	void query(const Aabb& region, std::vector<int>& result) {
+		result.clear();
+		queryId++;
+		int lo[3], hi[3];
+		cellRange(region, lo, hi);
+		for (int x = lo[0]; x <= hi[0]; x++)
+			for (int y = lo[1]; y <= hi[1]; y++)
+				for (int z = lo[2]; z <= hi[2]; z++) {
+					std::unordered_map<long long, std::vector<int> >::const_iterator it = cells.find(cellKey(x, y, z));
+					if (it == cells.end()) continue;
+					for (size_t i = 0; i < it->second.size(); i++) {
+						int id = it->second[i];
+						if (visited[id] != queryId) {
+							visited[id] = queryId;
+							result.push_back(id);
+						}
+					}
+				}
 	}
-}
 
-// Add this function to draw the force history
-void drawForceHistory(cGenericObject* camera) {
-	if (forceHistory.empty()) return;
+	// Moves a sphere from 'from' towards 'to', stopping at the first obstacle
+	// and sliding along it with the remaining motion
+	cVector3d sweepSphere(const cVector3d& from, const cVector3d& to, double radius) {
+		const int MAX_SLIDES = 3;
+		const double SKIN = 1e-4;
+		cVector3d pos = from;
+		cVector3d target = to;
+		std::vector<int> candidates;
+
+		for (int slide = 0; slide < MAX_SLIDES; slide++) {
+			cVector3d delta = target - pos;
+			if (delta.length() < 1e-9) break;
+
+			Aabb region;
+			for (int k = 0; k < 3; k++) {
+				region.min(k) = cMin(pos(k), target(k)) - radius;
+				region.max(k) = cMax(pos(k), target(k)) + radius;
+			}
+			query(region, candidates);
+
+			double tHit = 2.0;
+			int hitAxis = -1;
+			for (size_t i = 0; i < candidates.size(); i++) {
+				int axis;
+				double t = sweepEntry(bounds[candidates[i]], radius, pos, delta, axis);
+				if (t >= 0.0 && t < tHit) {
+					tHit = t;
+					hitAxis = axis;
+				}
+			}
 
-	cVector3d startPos = forceVector->m_pointA;
-	glDisable(GL_LIGHTING);
-	glBegin(GL_LINE_STRIP);
-	for (size_t i = 0; i < forceHistory.size(); ++i) {
-		float alpha = 1.0f - static_cast<float>(i) / FORCE_HISTORY_SIZE;
-		glColor4f(1.0f, 0.0f, 0.0f, alpha);
-		cVector3d point = startPos + forceHistory[i];
-		glVertex3d(point.x(), point.y(), point.z());
-	}
-	glEnd();
-	glEnable(GL_LIGHTING);
-}
+			if (hitAxis < 0) {
+				return target;
+			}
 
-const double CAMERA_SPEED = 0.1;
-bool moveForward = false, moveBackward = false, moveLeft = false, moveRight = false;
-const double WEAPON_ROTATION_SPEED = 0.002;
-bool rotateLeft = false, rotateRight = false;
-double currentRotationAngle = 0.0;
-const double MAX_ROTATION_ANGLE = cDegToRad(720); // Maximum rotation of 30 degrees in each direction
+			// Stop just short of the contact, then drop the blocked component
+			double travel = cMax(0.0, tHit - SKIN / delta.length());
+			pos = pos + delta * travel;
+			cVector3d remaining = delta * (1.0 - travel);
+			remaining(hitAxis) = 0.0;
+			target = pos + remaining;
+		}
+		return pos;
+	}
+};
 
-cShapeLine* bulletTraj;
+BlockGrid blockGrid;
 
-class CrosshairTarget {
+//------------------------------------------------------------------------------
+// INSTANCED OBSTACLES
+//------------------------------------------------------------------------------
+
+// Obstacle blocks as plain instance data: position, size and colour with the
+// distance fade in alpha. There is no scene node per block; the whole field is
+// drawn by one instanced call.
+struct BlockInstance {
+	float pos[3];
+	float size[3];
+	float color[4];
+};
+
+std::vector<BlockInstance> blocks;
+
+// Draws every block with one glDrawElementsInstanced call from a unit cube and
+// a per-instance buffer that is refreshed once per frame. Lives in the world
+// so it is rendered inside the camera's passes with the scene transforms.
+class InstancedBlockRenderer : public cGenericObject {
 private:
-	std::vector<cMesh*> crosshairParts;
-	cWorld* world;
-	cVector3d position;
-	const double MOVEMENT_THRESHOLD = 0.001; // Adjust this value as needed
-	const double SMOOTHING_FACTOR = 0.1; // Adjust for more or less smoothing
-	std::vector<cVector3d> initialOffsets;
+	GLuint program;
+	GLuint cubeVbo, cubeIbo, instanceVbo;
+	size_t instanceCapacity;
+	bool initialized;
+	bool instancing;  // false without instanced drawing or the shader; falls back to a draw per block
+	GLint positionAttrib, normalAttrib, offsetAttrib, sizeAttrib, colorAttrib;
+
+	static GLuint compileShader(GLenum type, const char* source) {
+		GLuint shader = glCreateShader(type);
+		glShaderSource(shader, 1, &source, nullptr);
+		glCompileShader(shader);
+		GLint ok = 0;
+		glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+		if (!ok) {
+			char log[512];
+			glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+			cout << "Warning - block shader: " << log << endl;
+			glDeleteShader(shader);
+			return 0;
+		}
+		return shader;
+	}
 
-public:
-	CrosshairTarget(cWorld* w) : world(w), position(0, 0, 0) {
-		createCrosshair();
-		storeInitialOffsets();
+	// glVertexAttribDivisor and glDrawElementsInstanced are core in GL 3.3;
+	// older contexts need both ARB extensions
+	static bool instancedDrawSupported() {
+#ifdef GLEW_VERSION
+		return GLEW_VERSION_3_3 || (GLEW_ARB_instanced_arrays && GLEW_ARB_draw_instanced);
+#else
+		int major = 0, minor = 0;
+		const char* version = (const char*)glGetString(GL_VERSION);
+		if (version != nullptr && sscanf(version, "%d.%d", &major, &minor) == 2
+			&& (major > 3 || (major == 3 && minor >= 3))) {
+			return true;
+		}
+		const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+		return extensions != nullptr
+			&& strstr(extensions, "GL_ARB_instanced_arrays") != nullptr
+			&& strstr(extensions, "GL_ARB_draw_instanced") != nullptr;
+#endif
 	}
 
-	void createCrosshair() {
-		cMaterial material;
-		material.setRed();
+	void initialize() {
+		initialized = true;
+
+		// unit cube centred on the origin, four vertices per face for flat normals
+		static const float FACE_NORMALS[6][3] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+		std::vector<float> vertices;
+		std::vector<unsigned short> indices;
+		for (int f = 0; f < 6; f++) {
+			const float* n = FACE_NORMALS[f];
+			int axis = (n[0] != 0) ? 0 : (n[1] != 0) ? 1 : 2;
+			int u = (axis + 1) % 3, v = (axis + 2) % 3;
+			unsigned short base = (unsigned short)(vertices.size() / 6);
+			for (int c = 0; c < 4; c++) {
+				float p[3];
+				p[axis] = 0.5f * n[axis];
+				p[u] = (c == 1 || c == 2) ? 0.5f : -0.5f;
+				p[v] = (c >= 2) ? 0.5f : -0.5f;
+				vertices.insert(vertices.end(), { p[0], p[1], p[2], n[0], n[1], n[2] });
+			}
+			// wind counter-clockwise seen from outside
+			bool flip = n[axis] < 0;
+			unsigned short quad[6] = { 0, 1, 2, 0, 2, 3 };
+			for (int k = 0; k < 6; k++) {
+				indices.push_back(base + (flip ? quad[5 - k] : quad[k]));
+			}
+		}
+		glGenBuffers(1, &cubeVbo);
+		glBindBuffer(GL_ARRAY_BUFFER, cubeVbo);
+		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), &vertices[0], GL_STATIC_DRAW);
+		glGenBuffers(1, &cubeIbo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cubeIbo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned short), &indices[0], GL_STATIC_DRAW);
+		glGenBuffers(1, &instanceVbo);
+
+		if (!instancedDrawSupported()) {
+			cout << "Warning - instanced drawing needs GL 3.3 or ARB_instanced_arrays, drawing blocks one by one" << endl;
+			return;
+		}
 
-		// Center block
-		cMesh* center = new cMesh();
-		world->addChild(center);
-		cCreateBox(center, 0.02, 0.02, 0.02);
-		center->setMaterial(material);
-		crosshairParts.push_back(center);
+		const char* vertexSource =
+			"#version 120\n"
+			"attribute vec3 position;\n"
+			"attribute vec3 normal;\n"
+			"attribute vec3 instanceOffset;\n"
+			"attribute vec3 instanceSize;\n"
+			"attribute vec4 instanceColor;\n"
+			"varying vec4 color;\n"
+			"void main() {\n"
+			"  vec3 n = normalize(gl_NormalMatrix * normal);\n"
+			"  float diffuse = max(dot(n, vec3(0.0, 0.0, 1.0)), 0.0);\n"
+			"  color = vec4(instanceColor.rgb * (0.35 + 0.65 * diffuse), instanceColor.a);\n"
+			"  gl_Position = gl_ModelViewProjectionMatrix * vec4(position * instanceSize + instanceOffset, 1.0);\n"
+			"}\n";
+		const char* fragmentSource =
+			"#version 120\n"
+			"varying vec4 color;\n"
+			"void main() { gl_FragColor = color; }\n";
+
+		GLuint vs = compileShader(GL_VERTEX_SHADER, vertexSource);
+		GLuint fs = compileShader(GL_FRAGMENT_SHADER, fragmentSource);
+		if (vs != 0 && fs != 0) {
+			program = glCreateProgram();
+			glAttachShader(program, vs);
+			glAttachShader(program, fs);
+			glLinkProgram(program);
+			GLint linked = 0;
+			glGetProgramiv(program, GL_LINK_STATUS, &linked);
+			instancing = linked != 0;
+			positionAttrib = glGetAttribLocation(program, "position");
+			normalAttrib = glGetAttribLocation(program, "normal");
+			offsetAttrib = glGetAttribLocation(program, "instanceOffset");
+			sizeAttrib = glGetAttribLocation(program, "instanceSize");
+			colorAttrib = glGetAttribLocation(program, "instanceColor");
+		}
+		if (vs != 0) glDeleteShader(vs);
+		if (fs != 0) glDeleteShader(fs);
+		if (!instancing) {
+			cout << "Warning - instanced block shader unavailable, drawing blocks one by one" << endl;
+		}
+	}
 
-		// Top block
-		cMesh* top = new cMesh();
-		world->addChild(top);
-		cCreateBox(top, 0.01, 0.01, 0.05);
-		top->setLocalPos(0.0, 0.0, 0.04);
-		top->setMaterial(material);
-		crosshairParts.push_back(top);
+	void drawInstanced() {
+		size_t count = blocks.size();
+		glBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+		if (count > instanceCapacity) {
+			instanceCapacity = count;
+			glBufferData(GL_ARRAY_BUFFER, count * sizeof(BlockInstance), &blocks[0], GL_STREAM_DRAW);
+		}
+		else {
+			glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(BlockInstance), &blocks[0]);
+		}
 
-		// Bottom block
-		cMesh* bottom = new cMesh();
-		world->addChild(bottom);
-		cCreateBox(bottom,0.01, 0.01, 0.05);
-		bottom->setLocalPos(0.0, 0.0, -0.04);
-		bottom->setMaterial(material);
-		crosshairParts.push_back(bottom);
+		glUseProgram(program);
+		const GLsizei stride = sizeof(BlockInstance);
+		glVertexAttribPointer(offsetAttrib, 3, GL_FLOAT, GL_FALSE, stride, (const void*)offsetof(BlockInstance, pos));
+		glVertexAttribPointer(sizeAttrib, 3, GL_FLOAT, GL_FALSE, stride, (const void*)offsetof(BlockInstance, size));
+		glVertexAttribPointer(colorAttrib, 4, GL_FLOAT, GL_FALSE, stride, (const void*)offsetof(BlockInstance, color));
+		GLint perInstance[3] = { offsetAttrib, sizeAttrib, colorAttrib };
+		for (int i = 0; i < 3; i++) {
+			glEnableVertexAttribArray(perInstance[i]);
+			glVertexAttribDivisor(perInstance[i], 1);
+		}
 
-		// Left block
-		cMesh* left = new cMesh();
-		world->addChild(left);
-		cCreateBox(left, 0.01, 0.05, 0.01);
-		left->setLocalPos(0.0, -0.04, 0.0);
-		left->setMaterial(material);
-		crosshairParts.push_back(left);
+		glBindBuffer(GL_ARRAY_BUFFER, cubeVbo);
+		glVertexAttribPointer(positionAttrib, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (const void*)0);
+		glVertexAttribPointer(normalAttrib, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (const void*)(3 * sizeof(float)));
+		glEnableVertexAttribArray(positionAttrib);
+		glEnableVertexAttribArray(normalAttrib);
 
-		// Right block
-		cMesh* right = new cMesh();
-		world->addChild(right);
-		cCreateBox(right, 0.01, 0.05, 0.01);
-		right->setLocalPos(0.0, 0.04, 0.0);
-		right->setMaterial(material);
-		crosshairParts.push_back(right);
-	}
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cubeIbo);
+		glDrawElementsInstanced(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT, (const void*)0, (GLsizei)count);
 
-	void storeInitialOffsets() {
-		initialOffsets.clear();
-		for (const auto& part : crosshairParts) {
-			initialOffsets.push_back(part->getLocalPos());
+		for (int i = 0; i < 3; i++) {
+			glVertexAttribDivisor(perInstance[i], 0);
+			glDisableVertexAttribArray(perInstance[i]);
 		}
+		glDisableVertexAttribArray(positionAttrib);
+		glDisableVertexAttribArray(normalAttrib);
+		glUseProgram(0);
 	}
 
-	void updatePosition(const cVector3d& targetPosition) {
-		cVector3d diff = targetPosition - position;
-		if (diff.length() > MOVEMENT_THRESHOLD) {
-			cVector3d newPosition = position + diff * SMOOTHING_FACTOR;
-			setPosition(newPosition);
+	// Fixed-function path for drivers without GLSL 1.20 or instanced drawing
+	void drawEach() {
+		glBindBuffer(GL_ARRAY_BUFFER, cubeVbo);
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glEnableClientState(GL_NORMAL_ARRAY);
+		glVertexPointer(3, GL_FLOAT, 6 * sizeof(float), (const void*)0);
+		glNormalPointer(GL_FLOAT, 6 * sizeof(float), (const void*)(3 * sizeof(float)));
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cubeIbo);
+		glEnable(GL_COLOR_MATERIAL);
+		for (size_t i = 0; i < blocks.size(); i++) {
+			const BlockInstance& b = blocks[i];
+			glPushMatrix();
+			glTranslatef(b.pos[0], b.pos[1], b.pos[2]);
+			glScalef(b.size[0], b.size[1], b.size[2]);
+			glColor4fv(b.color);
+			glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT, (const void*)0);
+			glPopMatrix();
 		}
+		glDisable(GL_COLOR_MATERIAL);
+		glDisableClientState(GL_NORMAL_ARRAY);
+		glDisableClientState(GL_VERTEX_ARRAY);
 	}
 
-	void setPosition(const cVector3d& newPosition) {
-		position = newPosition;
-		for (size_t i = 0; i < crosshairParts.size(); ++i) {
-			crosshairParts[i]->setLocalPos(position + initialOffsets[i]);
+protected:
+	virtual void render(cRenderOptions& a_options) {
+		// once per frame: in the last transparency pass, or the only pass
+		if (a_options.m_creating_shadow_map || a_options.m_render_opaque_objects_only
+			|| a_options.m_render_transparent_back_faces_only || blocks.empty()) {
+			return;
 		}
-	}
+		if (!initialized) initialize();
 
-	cVector3d getPosition() const {
-		return crosshairParts[0]->getGlobalPos();
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		if (instancing) {
+			drawInstanced();
+		}
+		else {
+			drawEach();
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		glDisable(GL_BLEND);
 	}
+
+public:
+	InstancedBlockRenderer() : program(0), cubeVbo(0), cubeIbo(0), instanceVbo(0), instanceCapacity(0),
+		initialized(false), instancing(false), positionAttrib(-1), normalAttrib(-1), offsetAttrib(-1), sizeAttrib(-1), colorAttrib(-1) {}
 };
 
-CrosshairTarget* crosshair;
+InstancedBlockRenderer* blockRenderer = nullptr;
 
-class DynamicTarget {
-private:
-	cMultiMesh* targetMesh;
-	cWorld* world;
-	double moveInterval;
-	double lastMoveTime;
-	double initialY;
+//------------------------------------------------------------------------------
+// TRANSFORM UPDATES
+//------------------------------------------------------------------------------
 
-public:
-	DynamicTarget(cWorld* w, double startY) : world(w), moveInterval(3.0), lastMoveTime(0.0), initialY(startY) {
-		createTargetShape();
-		moveTarget(); // Initial position
+// Recomputes the global frame of a node and everything below it from its
+// parent's current global frame
+void updateGlobalTransform(cGenericObject* node) {
+	cGenericObject* parent = node->getParent();
+	if (parent != nullptr) {
+		node->computeGlobalPositions(true, parent->getGlobalPos(), parent->getGlobalRot());
+	}
+	else {
+		node->computeGlobalPositions(true);
 	}
+}
 
-	void createTargetShape() {
-		targetMesh = new cMultiMesh();
-		world->addChild(targetMesh);
+// Global transforms maintained incrementally instead of walking the whole
+// world. Code that moves a node marks it dirty; update() recomputes each
+// dirty subtree once, skipping nodes under a dirty ancestor since its pass
+// covers them. Each tracker is used from one haptic thread only: every
+// station has one for its tool, and the first station's scene task has one
+// for the targets. Nodes the render thread moves call updateGlobalTransform
+// themselves.
+//
+// Every station's haptic thread walks the shared world for contact while the
+// other threads move their nodes. Anything moved after startup is therefore
+// a ghost (camera, point light, targets, tools, crosshairs, weapons, lines),
+// which the collision traversal skips along with its subtree, so it never
+// reads a frame another thread is writing.
+class TransformTracker {
+private:
+	std::vector<cGenericObject*> dirty;  // the dirty bits; a handful of movers, so a list
 
-		bool fileload;
-		fileload = targetMesh->loadFromFile(RESOURCE_PATH("../resources/FinalBaseMesh.obj")); // change accordingly
-		if (!fileload) {
-#if defined(_MSVC)
-			fileload = targetMesh->loadFromFile("../../../bin/resources/FinalBaseMesh.obj"); // change accordingly
-#endif
-		}
-		if (!fileload){
-			cout << "Error - Target model failed to load correctly." << endl;
-			delete targetMesh;
-			targetMesh = nullptr;
-			return;
+	bool isDirty(cGenericObject* node) const {
+		return std::find(dirty.begin(), dirty.end(), node) != dirty.end();
+	}
+
+	bool hasDirtyAncestor(cGenericObject* node) const {
+		for (cGenericObject* p = node->getParent(); p != nullptr; p = p->getParent()) {
+			if (isDirty(p)) return true;
 		}
+		return false;
+	}
 
-		// Scale and set material properties
-		targetMesh->scale(0.07);  // Adjust scale as needed
-		cMatrix3d rotMat;
-		rotMat.identity();
-		rotMat.rotateAboutGlobalAxisDeg(1, 0, 0, 90);
-		rotMat.rotateAboutGlobalAxisDeg(0, 0, 1, 90);
-		targetMesh->setLocalRot(rotMat);
-		cMaterial material;
-		material.setBlack();
-		targetMesh->setMaterial(material);
+public:
+	unsigned long long subtreesUpdated;
 
-		// Create a bounding box for the entire mesh
-		targetMesh->computeBoundaryBox(true);
+	TransformTracker() : subtreesUpdated(0) { dirty.reserve(64); }
 
-		targetMesh->setShowBoundaryBox(false);
+	void markDirty(cGenericObject* node) {
+		if (!isDirty(node)) dirty.push_back(node);
 	}
 
-	void update(double currentTime) {
-		if (currentTime - lastMoveTime >= moveInterval) {
-			moveTarget();
-			lastMoveTime = currentTime;
+	void update() {
+		for (size_t i = 0; i < dirty.size(); i++) {
+			if (!hasDirtyAncestor(dirty[i])) {
+				updateGlobalTransform(dirty[i]);
+				subtreesUpdated++;
+			}
 		}
+		dirty.clear();
 	}
+};
 
-	void moveTarget() {
-		// Generate random position within the specified bounds
-		double x = -4; // Fixed X position
-		double y = initialY + ((rand() % 601 - 300) / 100.0);  // Range: initialY - 5 to initialY + 5
-		double z = -0.5 + (rand() % 100) / 100.0; // Range: -0.5 to 0.5
-		targetMesh->setLocalPos(x, y, z);
-	}
+TransformTracker sceneTransforms;  // targets, moved by the scene task of the first station
 
+string resourceRoot;
 
-	cVector3d getPosition() const {
-		return targetMesh->getLocalPos();
-	}
+cVector3d current_force;
+cVector3d current_torque;
+float deviation_angle;
+
+__int64 coolOfftime = 0;
 
-	bool checkHit(const cVector3d& weaponPosition, const cVector3d& crosshairPosition) {
-		// Calculate ray direction
-		cVector3d rayDirection = crosshairPosition - weaponPosition;
-		rayDirection.normalize();
+cVector3d zero_vector(0, 0, 0);
 
-		// Get target's bounding box
-		cVector3d minBound, maxBound;
-		minBound = targetMesh->getBoundaryMin();
-		maxBound = targetMesh->getBoundaryMax();
+//------------------------------------------------------------------------------
+// HAPTIC / GRAPHICS STATE HANDOFF
+//------------------------------------------------------------------------------
 
-		// Transform bounding box to world coordinates
-		cTransform worldTransform = targetMesh->getGlobalTransform();
-		minBound = worldTransform * minBound;
-		maxBound = worldTransform * maxBound;
+// Wait-free single-producer / single-consumer triple buffer. The writer fills
+// its back slot and swaps it into the middle; the reader swaps the middle slot
+// into its front slot only when something new was published.
+template <typename T>
+class TripleBuffer {
+private:
+	static const unsigned int FRESH = 4;  // set on the middle index when it holds unread data
+	T slots[3];
+	std::atomic<unsigned int> middle;
+	unsigned int back;
+	unsigned int front;
 
-		// Check if the ray passes through the AABB
-		double t1 = (minBound.x() - weaponPosition.x()) / rayDirection.x();
-		double t2 = (maxBound.x() - weaponPosition.x()) / rayDirection.x();
-		double t3 = (minBound.y() - weaponPosition.y()) / rayDirection.y();
-		double t4 = (maxBound.y() - weaponPosition.y()) / rayDirection.y();
-		double t5 = (minBound.z() - weaponPosition.z()) / rayDirection.z();
-		double t6 = (maxBound.z() - weaponPosition.z()) / rayDirection.z();
+public:
+	TripleBuffer() : middle(1), back(0), front(2) {}
 
-		double tmin = std::max(std::max(std::min(t1, t2), std::min(t3, t4)), std::min(t5, t6));
-		double tmax = std::min(std::min(std::max(t1, t2), std::max(t3, t4)), std::max(t5, t6));
+	// Writer side
+	T& writeBuffer() { return slots[back]; }
 
-		// Ray intersection occurs when tmax > tmin and tmax > 0
-		return tmax > std::max(0.0, tmin);
+	void publish() {
+		unsigned int previous = middle.exchange(back | FRESH, std::memory_order_acq_rel);
+		back = previous & ~FRESH;
 	}
 
-	void moveOnHit(double currentTime) {
-		moveTarget();
-		lastMoveTime = currentTime;
+	// Reader side, returns true when a newer value was swapped in
+	bool update() {
+		if (!(middle.load(std::memory_order_acquire) & FRESH)) return false;
+		unsigned int previous = middle.exchange(front, std::memory_order_acq_rel);
+		front = previous & ~FRESH;
+		return true;
 	}
+
+	const T& readBuffer() const { return slots[front]; }
 };
 
-DynamicTarget* dynamicTarget1 = nullptr;
-//DynamicTarget* dynamicTarget2 = nullptr;
-//DynamicTarget* dynamicTarget3 = nullptr;
+// Bounded single-producer / single-consumer queue over storage allocated up
+// front. push() and pop() are wait-free; a full queue rejects the push.
+template <typename T>
+class SpscRing {
+private:
+	std::vector<T> slots;
+	size_t mask;
+	alignas(64) std::atomic<size_t> head;  // next slot to write, producer only
+	alignas(64) std::atomic<size_t> tail;  // next slot to read, consumer only
 
+public:
+	SpscRing() : mask(0), head(0), tail(0) {}
+
+	// Not thread safe; call before either side starts. Rounds up to a power of two.
+	void reserve(size_t capacity) {
+		size_t size = 1;
+		while (size < capacity) size <<= 1;
+		slots.assign(size, T());
+		mask = size - 1;
+		head = 0;
+		tail = 0;
+	}
 
-bool timeTrialActive = false;
-int timeTrialDuration = 30; // 30 seconds
-int score = 0;
-std::chrono::steady_clock::time_point timeTrialStart;
+	// Producer side
+	bool push(const T& value) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) > mask) return false;
+		slots[h & mask] = value;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
 
-void updateTimeTrial() {
-	if (timeTrialActive) {
-		auto currentTime = std::chrono::steady_clock::now();
-		int elapsedSeconds = std::chrono::duration_cast<std::chrono::seconds>(currentTime - timeTrialStart).count();
-		if (elapsedSeconds >= timeTrialDuration) {
-			timeTrialActive = false;
-			cout << "Time's up! Final score: " << score << endl;
-			score = 0;  // Reset score for the next trial
+	// Consumer side, copies out up to maxCount values
+	size_t pop(T* out, size_t maxCount) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		size_t count = cMin(head.load(std::memory_order_acquire) - t, maxCount);
+		for (size_t i = 0; i < count; i++) {
+			out[i] = slots[(t + i) & mask];
 		}
+		tail.store(t + count, std::memory_order_release);
+		return count;
 	}
+
+	size_t capacity() const { return slots.size(); }
+};
+
+enum WeaponType { WEAPON_PISTOL = 0, WEAPON_RIFLE = 1, WEAPON_DRAGUNOV = 2 };
+
+// Everything the renderer needs from one haptic tick
+struct HapticSnapshot {
+	unsigned long long generation = 0;
+	cVector3d toolPos;
+	cMatrix3d toolRot;
+	int activeWeapon = WEAPON_PISTOL;
+	cMatrix3d weaponRot;
+	cVector3d crosshairPos;
+	bool showTrajectory = false;
+	cVector3d trajectoryA;
+	cVector3d trajectoryB;
+	int score = 0;
+	unsigned int hits = 0;            // of this station so far, reported by the render thread
+	int lastHitRegion = 0;            // HitRegion of the latest of them
+	bool timeTrialActive = false;
+	int remainingTime = 0;
+	unsigned int timeTrialsFinished = 0;  // first station only
+	long long publishNs = 0;  // monotonic time of the publish, for the present latency
+};
+
+inline bool sameRotation(const cMatrix3d& a, const cMatrix3d& b) {
+	return a.getCol0().equals(b.getCol0()) && a.getCol1().equals(b.getCol1()) && a.getCol2().equals(b.getCol2());
 }
 
-cLabel* scoreTimeLabel;
+// True if a frame drawn from either snapshot would look the same
+inline bool sameDrawnState(const HapticSnapshot& a, const HapticSnapshot& b) {
+	return a.toolPos.equals(b.toolPos) && sameRotation(a.toolRot, b.toolRot)
+		&& a.activeWeapon == b.activeWeapon && sameRotation(a.weaponRot, b.weaponRot)
+		&& a.crosshairPos.equals(b.crosshairPos) && a.showTrajectory == b.showTrajectory
+		&& (!a.showTrajectory || (a.trajectoryA.equals(b.trajectoryA) && a.trajectoryB.equals(b.trajectoryB)))
+		&& a.score == b.score && a.timeTrialActive == b.timeTrialActive && a.remainingTime == b.remainingTime
+		&& a.hits == b.hits && a.timeTrialsFinished == b.timeTrialsFinished;
+}
 
-void updateBlockTransparency(cWorld* world, cToolCursor* tool)
-{
-	const double MIN_DISTANCE = 0.5; // Minimum distance before transparency starts
-	const double MAX_DISTANCE = 1.5; // Distance at which block becomes fully opaque
-	const double MIN_ALPHA = 0.1; // Minimum alpha (maximum transparency)
+// Camera pose published by the render thread for the haptic thread
+struct CameraPose {
+	cVector3d pos;
+	cVector3d look;
+};
 
-	cVector3d toolPos = tool->getDeviceGlobalPos();
+std::atomic<unsigned long long> publishedGeneration(0);  // bumped by every snapshot any station publishes, see publishHapticSnapshot
+std::atomic<bool> timeTrialRequested(false);
 
-	for (int i = 0; i < world->getNumChildren(); i++)
-	{
-		cGenericObject* obj = world->getChild(i);
-		cMesh* block = dynamic_cast<cMesh*>(obj);
+// Keyboard state as seen by the haptic thread, latched once at the start of
+// each tick so that a recording holds exactly what the tick used
+struct HapticInput {
+	bool rotateLeft = false;
+	bool rotateRight = false;
+	bool timeTrialRequest = false;  // kept until the scene task handles it
+};
 
-		if (block && block != tool->m_image) // Check if it's a block and not the weapon
-		{
-			cVector3d blockPos = block->getGlobalPos();
-			double distance = cDistance(blockPos, toolPos);
+// Game time of the haptic thread. Everything the simulation times (recoil,
+// target moves, the time trial) uses this clock rather than the wall clock,
+// and a replay sets it from the recording. Live, it is the scheduled time of
+// the tick on the monotonic clock, so it advances by exactly one period per
+// tick.
+long long hapticClockNs = 0;
+long long hapticClockStartNs = 0;
 
-			if (distance < MIN_DISTANCE)
-			{
-				block->setTransparencyLevel(MIN_ALPHA);
-			}
-			else if (distance < MAX_DISTANCE)
-			{
-				double alpha = MIN_ALPHA + (1.0 - MIN_ALPHA) * ((distance - MIN_DISTANCE) / (MAX_DISTANCE - MIN_DISTANCE));
-				block->setTransparencyLevel(alpha);
-			}
-			else
-			{
-				block->setTransparencyLevel(1.0); // Fully opaque
-			}
+// Worst-case duration of a haptic tick, written by the haptic thread only
+std::atomic<long long> hapticTickWorstUs(0);
+std::atomic<unsigned long long> hapticTickCount(0);
+int renderLoad = 0;          // extra renderView passes per frame (synthetic load)
+int latencyTestSeconds = 0;  // run the latency test for this long, then exit
 
-			block->setUseTransparency(true);
-		}
-	}
+//------------------------------------------------------------------------------
+// HAPTIC SCHEDULER
+//------------------------------------------------------------------------------
+
+inline long long monotonicNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-// DECLARED FUNCTIONS
-void resizeWindow(int w, int h);
+// Sleeps until an absolute time on the monotonic clock
+inline void sleepUntilNs(long long deadlineNs) {
+#if defined(LINUX)
+	struct timespec ts;
+	ts.tv_sec = deadlineNs / 1000000000LL;
+	ts.tv_nsec = deadlineNs % 1000000000LL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+#else
+	std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::nanoseconds(deadlineNs)));
+#endif
+}
+
+// Paces the haptic thread on absolute deadlines: sleeps for most of each period
+// and spins the last few microseconds, so timing errors never accumulate
+class HapticScheduler {
+private:
+	long long periodNs;
+	long long spinNs;
+	long long deadlineNs;
+
+public:
+	int rateHz;
+
+	// statistics
+	unsigned long long ticks;
+	unsigned long long overruns;   // ticks whose work ran past the next deadline
+	long long maxJitterNs;         // worst wake-up lateness
+	double sumJitterNs;
+
+	HapticScheduler() : periodNs(1000000), spinNs(50000), deadlineNs(0), rateHz(1000),
+		ticks(0), overruns(0), maxJitterNs(0), sumJitterNs(0.0) {}
+
+	void setRate(int a_rateHz) {
+		rateHz = a_rateHz;
+		periodNs = 1000000000LL / rateHz;
+		spinNs = cMin(50000LL, periodNs / 4);
+	}
+
+	long long getPeriodNs() const { return periodNs; }
+
+	// Optional real-time setup, called from the haptic thread itself
+	void configureThread(bool realtime, int cpu, bool lockMemory) {
+#if defined(LINUX)
+		if (lockMemory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+			cout << "Warning - mlockall failed (errno " << errno << ")" << endl;
+		}
+		if (cpu >= 0) {
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(cpu, &cpus);
+			if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+				cout << "Warning - could not pin haptic thread to CPU " << cpu << endl;
+			}
+		}
+		if (realtime) {
+			struct sched_param param;
+			param.sched_priority = 80;
+			if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+				cout << "Warning - SCHED_FIFO not permitted, haptic thread stays at normal priority" << endl;
+			}
+		}
+#else
+		if (realtime || cpu >= 0 || lockMemory) {
+			cout << "Warning - real-time scheduling options are only supported on Linux" << endl;
+		}
+#endif
+	}
+
+	void start() {
+		deadlineNs = monotonicNs() + periodNs;
+	}
+
+	void resetStats() {
+		ticks = 0;
+		overruns = 0;
+		maxJitterNs = 0;
+		sumJitterNs = 0.0;
+	}
+
+	// Blocks until the next tick is due and returns the time it was due at.
+	// Deadlines are exact multiples of the period, free of wake-up jitter.
+	long long waitForNextTick() {
+		long long now = monotonicNs();
+		if (now > deadlineNs) {
+			// Last tick overran; drop the missed ticks but keep the original phase
+			overruns++;
+			deadlineNs += ((now - deadlineNs) / periodNs + 1) * periodNs;
+		}
+
+		if (now < deadlineNs - spinNs) {
+			sleepUntilNs(deadlineNs - spinNs);
+		}
+		while ((now = monotonicNs()) < deadlineNs) {}
+
+		long long jitter = now - deadlineNs;
+		maxJitterNs = cMax(maxJitterNs, jitter);
+		sumJitterNs += jitter;
+		ticks++;
+
+		long long tickNs = deadlineNs;
+		deadlineNs += periodNs;
+		return tickNs;
+	}
+
+	void printReport() const {
+		cout << "Haptic scheduler: " << ticks << " ticks at " << rateHz << " Hz, jitter mean "
+			<< (ticks > 0 ? sumJitterNs / ticks / 1000.0 : 0.0) << " us, max " << maxJitterNs / 1000.0
+			<< " us, " << overruns << " overruns" << endl;
+	}
+};
+
+bool hapticRealtime = false;      // SCHED_FIFO, see --rt-fifo
+int hapticCpu = -1;               // CPU to pin the first haptic thread to, see --cpu
+bool hapticLockMemory = false;    // mlockall, see --mlock
+
+// Runs registered subsystems at their own rates from a driving loop and keeps
+// time budget statistics for each. A rate of 0 runs the task on every call.
+class TaskScheduler {
+private:
+	struct Task {
+		string name;
+		int rateHz;
+		long long periodNs;
+		long long budgetNs;
+		std::function<void(double)> fn;
+		long long nextDueNs;
+
+		unsigned long long runs;
+		unsigned long long overBudget;
+		long long maxNs;
+		double totalNs;
+	};
+	std::vector<Task> tasks;
+
+public:
+	void addTask(const string& name, int rateHz, long long budgetUs, std::function<void(double)> fn) {
+		Task task;
+		task.name = name;
+		task.rateHz = rateHz;
+		task.periodNs = (rateHz > 0) ? 1000000000LL / rateHz : 0;
+		task.budgetNs = budgetUs * 1000;
+		task.fn = fn;
+		task.nextDueNs = 0;
+		task.runs = 0;
+		task.overBudget = 0;
+		task.maxNs = 0;
+		task.totalNs = 0.0;
+		tasks.push_back(task);
+	}
+
+	// Runs every task that is due at nowNs; currentTime is passed through in seconds
+	void run(long long nowNs, double currentTime) {
+		for (size_t i = 0; i < tasks.size(); i++) {
+			Task& task = tasks[i];
+			if (task.periodNs > 0) {
+				if (nowNs < task.nextDueNs) continue;
+				task.nextDueNs = (task.nextDueNs == 0 || nowNs - task.nextDueNs >= task.periodNs)
+					? nowNs + task.periodNs : task.nextDueNs + task.periodNs;
+			}
+
+			long long start = monotonicNs();
+			task.fn(currentTime);
+			long long spent = monotonicNs() - start;
+
+			task.runs++;
+			task.totalNs += spent;
+			task.maxNs = cMax(task.maxNs, spent);
+			if (spent > task.budgetNs) task.overBudget++;
+		}
+	}
+
+	void printReport(const string& title) const {
+		for (size_t i = 0; i < tasks.size(); i++) {
+			const Task& task = tasks[i];
+			cout << title << " task '" << task.name << "' (" << (task.rateHz > 0 ? cStr(task.rateHz) + " Hz" : string("every tick"))
+				<< "): " << task.runs << " runs, mean " << (task.runs > 0 ? task.totalNs / task.runs / 1000.0 : 0.0)
+				<< " us, max " << task.maxNs / 1000.0 << " us, " << task.overBudget << " over the "
+				<< task.budgetNs / 1000 << " us budget" << endl;
+		}
+	}
+};
+
+TaskScheduler frameTasks;   // driven by the render thread, once per frame
+
+//------------------------------------------------------------------------------
+// SIMULATED HAPTIC DEVICE
+//------------------------------------------------------------------------------
+
+// Stand-in for the Falcon, selected with --sim-device. A scripted or
+// procedural hand target pulls a grip mass through a spring and damper; the
+// forces the application sends push on the same mass, so recoil shows up in
+// the reported position just as it does on the real device. The grip is
+// stepped at a fixed sample rate and read back sample-and-hold.
+class SimulatedHapticDevice : public cGenericHapticDevice {
+private:
+	struct ScriptPoint {
+		double time;
+		cVector3d pos;
+		unsigned int buttons;
+	};
+
+	std::vector<ScriptPoint> script;
+	int sampleRateHz;
+	long long sampleNs;
+	long long startNs;
+	long long lastSampleNs;
+
+	// grip state
+	cVector3d pos, vel;
+	cVector3d appliedForce;
+	std::mutex forceLock;  // forces may come from the force thread, see --force-rate
+	unsigned int buttons;
+
+	double mass;       // kg, grip plus hand
+	double stiffness;  // N/m, how firmly the hand holds the grip on its path
+	double damping;    // N s/m
+
+	// Hand target and buttons at time t, looping over the script if one is loaded
+	void sampleTarget(double t, cVector3d& target, unsigned int& switches) const {
+		if (!script.empty()) {
+			double length = script.back().time;
+			if (length > 0.0) t = fmod(t, length);
+			size_t i = 1;
+			while (i < script.size() && script[i].time < t) i++;
+			if (i >= script.size()) {
+				target = script.back().pos;
+				switches = script.back().buttons;
+				return;
+			}
+			const ScriptPoint& a = script[i - 1];
+			const ScriptPoint& b = script[i];
+			double s = (b.time > a.time) ? (t - a.time) / (b.time - a.time) : 1.0;
+			target = a.pos + (b.pos - a.pos) * cClamp(s, 0.0, 1.0);
+			switches = a.buttons;
+			return;
+		}
+
+		// Slow figure-eight sweep over the workspace
+		target.set(0.01 * sin(0.5 * t), 0.03 * sin(0.7 * t), 0.02 * sin(1.4 * t));
+
+		// Trigger held for 150 ms every second; every 5 s one of the weapon
+		// buttons is tapped, cycling pistol, rifle, sniper
+		switches = (fmod(t, 1.0) < 0.15) ? 1u : 0u;
+		double cycle = fmod(t, 15.0);
+		for (int w = 0; w < 3; w++) {
+			if (cycle >= 5.0 * w + 4.5 && cycle < 5.0 * w + 4.55) {
+				switches |= 1u << (w + 1);
+			}
+		}
+	}
+
+	// Advances the grip to the current time in whole samples
+	void advance() {
+		long long now = monotonicNs();
+		if (now - lastSampleNs > 1000000000LL) {
+			// after a long stall, resume from now rather than replaying it
+			lastSampleNs = now - sampleNs;
+		}
+		while (lastSampleNs + sampleNs <= now) {
+			lastSampleNs += sampleNs;
+			double t = (lastSampleNs - startNs) / 1e9;
+			double dt = sampleNs / 1e9;
+
+			cVector3d target;
+			sampleTarget(t, target, buttons);
+			cVector3d applied;
+			{
+				std::lock_guard<std::mutex> lock(forceLock);
+				applied = appliedForce;
+			}
+			cVector3d force = (target - pos) * stiffness - vel * damping + applied;
+			vel += force * (dt / mass);
+			pos += vel * dt;
+		}
+	}
+
+public:
+	SimulatedHapticDevice(int rateHz) : sampleRateHz(rateHz), startNs(0), lastSampleNs(0), buttons(0),
+		mass(0.15), stiffness(400.0), damping(8.0) {
+		sampleNs = 1000000000LL / cMax(1, rateHz);
+
+		m_specifications.m_model = C_HAPTIC_DEVICE_VIRTUAL;
+		m_specifications.m_modelName = "Simulated Falcon";
+		m_specifications.m_manufacturerName = "none";
+		m_specifications.m_maxLinearForce = 8.0;
+		m_specifications.m_maxAngularTorque = 0.0;
+		m_specifications.m_maxGripperForce = 0.0;
+		m_specifications.m_maxLinearStiffness = 3000.0;
+		m_specifications.m_maxAngularStiffness = 0.0;
+		m_specifications.m_maxGripperLinearStiffness = 0.0;
+		m_specifications.m_maxLinearDamping = 20.0;
+		m_specifications.m_maxAngularDamping = 0.0;
+		m_specifications.m_maxGripperAngularDamping = 0.0;
+		m_specifications.m_workspaceRadius = 0.04;
+		m_specifications.m_gripperMaxAngleRad = 0.0;
+		m_specifications.m_sensedPosition = true;
+		m_specifications.m_sensedRotation = false;
+		m_specifications.m_sensedGripper = false;
+		m_specifications.m_actuatedPosition = true;
+		m_specifications.m_actuatedRotation = false;
+		m_specifications.m_actuatedGripper = false;
+		m_specifications.m_leftHand = true;
+		m_specifications.m_rightHand = true;
+		m_deviceAvailable = true;
+	}
+
+	// Script lines are "time x y z buttons" (seconds, metres, switch bitmask);
+	// '#' starts a comment. The script loops once it reaches its last point.
+	bool loadScript(const string& path) {
+		FILE* f = fopen(path.c_str(), "r");
+		if (f == nullptr) return false;
+		char line[256];
+		while (fgets(line, sizeof(line), f)) {
+			ScriptPoint p;
+			double x, y, z;
+			if (line[0] == '#') continue;
+			if (sscanf(line, "%lf %lf %lf %lf %u", &p.time, &x, &y, &z, &p.buttons) == 5) {
+				p.pos.set(x, y, z);
+				script.push_back(p);
+			}
+		}
+		fclose(f);
+		return !script.empty();
+	}
+
+	virtual bool open() {
+		startNs = lastSampleNs = monotonicNs();
+		cVector3d target;
+		sampleTarget(0.0, target, buttons);
+		pos = target;
+		vel.zero();
+		appliedForce.zero();
+		m_deviceReady = true;
+		return true;
+	}
+
+	virtual bool close() {
+		m_deviceReady = false;
+		return true;
+	}
+
+	virtual bool calibrate(bool a_forceCalibration = false) { return true; }
+
+	virtual bool getPosition(cVector3d& a_position) {
+		advance();
+		a_position = pos;
+		return true;
+	}
+
+	virtual bool getRotation(cMatrix3d& a_rotation) {
+		a_rotation.identity();
+		return true;
+	}
+
+	virtual bool getLinearVelocity(cVector3d& a_linearVelocity) {
+		advance();
+		a_linearVelocity = vel;
+		return true;
+	}
+
+	virtual bool getUserSwitches(unsigned int& a_userSwitches) {
+		advance();
+		a_userSwitches = buttons;
+		return true;
+	}
+
+	virtual bool setForceAndTorqueAndGripperForce(const cVector3d& a_force, const cVector3d& a_torque, double a_gripperForce) {
+		// clamp like the real device does
+		double magnitude = a_force.length();
+		double limit = m_specifications.m_maxLinearForce;
+		std::lock_guard<std::mutex> lock(forceLock);
+		appliedForce = (magnitude > limit) ? a_force * (limit / magnitude) : a_force;
+		return true;
+	}
+
+	// Appends a point to the script; times must increase
+	void addScriptPoint(double time, const cVector3d& position, unsigned int switches) {
+		ScriptPoint p;
+		p.time = time;
+		p.pos = position;
+		p.buttons = switches;
+		script.push_back(p);
+	}
+
+	int getSampleRate() const { return sampleRateHz; }
+};
+
+bool simulatedDevice = false;   // see --sim-device
+int simulatedDeviceRateHz = 1000;
+string simulatedDeviceScript;
+
+//------------------------------------------------------------------------------
+// HAPTIC BENCHMARK
+//------------------------------------------------------------------------------
+
+// Per-tick wake-up periods and work times for one benchmark run. Storage is
+// reserved up front so recording on the haptic thread never allocates.
+class TickRecorder {
+private:
+	std::vector<int> periodsNs;
+	std::vector<int> workNs;
+	size_t count;
+	long long lastStartNs;
+
+	static double percentileUs(std::vector<int> values, double p) {
+		if (values.empty()) return 0.0;
+		size_t i = cMin(values.size() - 1, (size_t)(p * values.size()));
+		std::nth_element(values.begin(), values.begin() + i, values.end());
+		return values[i] / 1000.0;
+	}
+
+public:
+	bool enabled;
+
+	TickRecorder() : count(0), lastStartNs(0), enabled(false) {}
+
+	void reset(size_t capacity) {
+		periodsNs.assign(capacity, 0);
+		workNs.assign(capacity, 0);
+		count = 0;
+		lastStartNs = 0;
+	}
+
+	void record(long long startNs, long long endNs) {
+		if (lastStartNs != 0 && count < periodsNs.size()) {
+			periodsNs[count] = (int)(startNs - lastStartNs);
+			workNs[count] = (int)(endNs - startNs);
+			count++;
+		}
+		lastStartNs = startNs;
+	}
+
+	size_t size() const { return count; }
+
+	// "p50", "p99", "p999" and "max" in microseconds, as a JSON object
+	string summaryJson(bool period) const {
+		std::vector<int> values(period ? periodsNs.begin() : workNs.begin(),
+			(period ? periodsNs.begin() : workNs.begin()) + count);
+		char text[160];
+		snprintf(text, sizeof(text), "{\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+			percentileUs(values, 0.5), percentileUs(values, 0.99), percentileUs(values, 0.999),
+			values.empty() ? 0.0 : *std::max_element(values.begin(), values.end()) / 1000.0);
+		return text;
+	}
+};
+
+enum BenchPattern { BENCH_IDLE, BENCH_TAP_TRIGGER, BENCH_HOLD_TRIGGER, BENCH_SLOW_TRIGGER, BENCH_SWITCHING };
+
+struct BenchScenario {
+	const char* name;
+	int weapon;
+	int pattern;
+	bool render;
+};
+
+const BenchScenario BENCH_SCENARIOS[] = {
+	{ "idle", WEAPON_PISTOL, BENCH_IDLE, false },
+	{ "pistol_fire", WEAPON_PISTOL, BENCH_TAP_TRIGGER, false },
+	{ "ak47_fire", WEAPON_RIFLE, BENCH_HOLD_TRIGGER, false },
+	{ "sniper_fire", WEAPON_DRAGUNOV, BENCH_SLOW_TRIGGER, false },
+	{ "weapon_switching", WEAPON_PISTOL, BENCH_SWITCHING, false },
+	{ "idle_render", WEAPON_PISTOL, BENCH_IDLE, true },
+	{ "ak47_fire_render", WEAPON_RIFLE, BENCH_HOLD_TRIGGER, true },
+};
+const int BENCH_SCENARIO_COUNT = sizeof(BENCH_SCENARIOS) / sizeof(BENCH_SCENARIOS[0]);
+
+TickRecorder tickRecorder;
+int benchSeconds = 0;         // per scenario, see --bench
+string benchOutputPath;       // see --bench-out
+bool headless = false;        // no window or GL at all, see --no-render
+bool renderEnabled = true;    // false when headless and during non-rendering bench scenarios
+std::atomic<long long> hapticThreadCpuNs(0);  // CPU time of the last haptic thread run
+
+// CPU time used by the calling thread, or -1 where that is not available
+inline long long threadCpuNs() {
+#if defined(LINUX)
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+		return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	}
+#endif
+	return -1;
+}
+
+
+//------------------------------------------------------------------------------
+// HAPTIC STAGE TIMING
+//------------------------------------------------------------------------------
+
+inline int highestBit(uint64_t v) {
+#if defined(_MSC_VER) && defined(_M_X64)
+	unsigned long i;
+	_BitScanReverse64(&i, v);
+	return (int)i;
+#elif defined(_MSC_VER)
+	int i = 0;
+	while (v >>= 1) i++;
+	return i;
+#else
+	return 63 - __builtin_clzll(v);
+#endif
+}
+
+// Log-linear histogram of durations: each power of two of nanoseconds is split
+// into four linear buckets, so any value is within 25% of its bucket. Only one
+// thread records into a histogram, which lets it bump the counters with plain
+// relaxed stores; readers on other threads see a consistent enough copy
+// without ever making the recording thread wait.
+class StageHistogram {
+public:
+	static const int SUB_BITS = 2;
+	static const int SUBS = 1 << SUB_BITS;
+	static const int BUCKETS = 32 * SUBS;  // up to about 4 s
+
+	struct Snapshot {
+		uint64_t counts[BUCKETS];
+		uint64_t total;
+
+		// Counts recorded since an earlier snapshot
+		Snapshot since(const Snapshot& earlier) const {
+			Snapshot d;
+			for (int i = 0; i < BUCKETS; i++) d.counts[i] = counts[i] - earlier.counts[i];
+			d.total = total - earlier.total;
+			return d;
+		}
+
+		// Microseconds at the middle of the bucket holding the p-quantile
+		double percentileUs(double p) const {
+			if (total == 0) return 0.0;
+			uint64_t rank = (uint64_t)(p * (total - 1)) + 1;
+			uint64_t seen = 0;
+			for (int i = 0; i < BUCKETS; i++) {
+				seen += counts[i];
+				if (seen >= rank) return 0.5 * (bucketLowNs(i) + bucketLowNs(i + 1)) / 1000.0;
+			}
+			return bucketLowNs(BUCKETS) / 1000.0;
+		}
+
+		// Upper edge of the highest non-empty bucket, in microseconds
+		double maxUs() const {
+			for (int i = BUCKETS - 1; i >= 0; i--) {
+				if (counts[i] != 0) return bucketLowNs(i + 1) / 1000.0;
+			}
+			return 0.0;
+		}
+	};
+
+	StageHistogram() : total(0) {
+		for (int i = 0; i < BUCKETS; i++) counts[i] = 0;
+	}
+
+	static int bucketOf(uint64_t ns) {
+		if (ns < (uint64_t)SUBS) return (int)ns;
+		int msb = highestBit(ns);
+		int index = ((msb - SUB_BITS + 1) << SUB_BITS) + (int)((ns >> (msb - SUB_BITS)) & (SUBS - 1));
+		return cMin(index, BUCKETS - 1);
+	}
+
+	static double bucketLowNs(int index) {
+		if (index < SUBS) return index;
+		int exponent = index >> SUB_BITS;
+		return (double)(SUBS + (index & (SUBS - 1))) * (double)(1ULL << (exponent - 1));
+	}
+
+	// Recording thread only
+	void record(long long ns) {
+		int b = bucketOf(ns > 0 ? (uint64_t)ns : 0);
+		counts[b].store(counts[b].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		total.store(total.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// Any thread
+	void read(Snapshot& out) const {
+		out.total = total.load(std::memory_order_acquire);
+		uint64_t sum = 0;
+		for (int i = 0; i < BUCKETS; i++) {
+			out.counts[i] = counts[i].load(std::memory_order_relaxed);
+			sum += out.counts[i];
+		}
+		// buckets bumped after the total was read are counted as well
+		out.total = cMax(out.total, sum);
+	}
+
+private:
+	std::atomic<uint64_t> counts[BUCKETS];
+	std::atomic<uint64_t> total;
+};
+
+// Timed stages. Everything but the block fade runs on the haptic thread of the
+// first station (the histograms take one writer each); the fade runs with the
+// other cosmetic effects once per rendered frame.
+enum HapticStage {
+	STAGE_TICK,             // whole haptic tick, including the stages below
+	STAGE_GLOBAL_POSITIONS, // transforms.update and sceneTransforms.update (dirty subtrees)
+	STAGE_DEVICE_READ,      // tool->updateFromDevice
+	STAGE_WEAPON_POSE,      // updateWeaponPositionAndOrientation
+	STAGE_RECOIL,           // apply_*_force
+	STAGE_HIT_TEST,         // findShotHit
+	STAGE_INTERACTION,      // tool->computeInteractionForces
+	STAGE_PUBLISH,          // publishHapticSnapshot
+	STAGE_SCENE,            // sceneTick: scene graph, targets, time trial
+	STAGE_BLOCK_FADE,       // updateBlockTransparency (render thread)
+	STAGE_COUNT
+};
+
+const char* const STAGE_NAMES[STAGE_COUNT] = {
+	"tick", "global positions", "device read", "weapon pose", "recoil",
+	"hit test", "interaction forces", "publish", "scene", "block fade (frame)"
+};
+
+StageHistogram stageHistograms[STAGE_COUNT];
+bool stageTimingEnabled = true;  // see --no-stage-timing
+thread_local bool stageTimingThread = true;  // cleared on the haptic threads of further stations
+
+// On-screen overlay, toggled with 'h'; shows the last refresh interval only
+cLabel* stageLabels[STAGE_COUNT];
+bool stageOverlayVisible = false;
+const long long STAGE_OVERLAY_REFRESH_NS = 250000000LL;
+
+// Records the time until the end of the enclosing scope into one stage
+class ScopedStageTimer {
+private:
+	StageHistogram* histogram;
+	long long startNs;
+
+public:
+	explicit ScopedStageTimer(int stage)
+		: histogram(stageTimingEnabled && stageTimingThread ? &stageHistograms[stage] : nullptr),
+		startNs(histogram != nullptr ? monotonicNs() : 0) {}
+
+	~ScopedStageTimer() {
+		if (histogram != nullptr) {
+			histogram->record(monotonicNs() - startNs);
+		}
+	}
+};
+
+void readStageHistograms(StageHistogram::Snapshot* out) {
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		stageHistograms[i].read(out[i]);
+	}
+}
+
+// Lifetime percentiles of every stage that recorded anything
+void printStageReport() {
+	static StageHistogram::Snapshot snapshots[STAGE_COUNT];
+	readStageHistograms(snapshots);
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		const StageHistogram::Snapshot& s = snapshots[i];
+		if (s.total == 0) continue;
+		printf("Stage %-20s %10llu samples  p50 %8.2f us  p99 %8.2f us  p99.9 %8.2f us  max %8.2f us\n",
+			STAGE_NAMES[i], (unsigned long long)s.total, s.percentileUs(0.5), s.percentileUs(0.99),
+			s.percentileUs(0.999), s.maxUs());
+	}
+}
+
+//------------------------------------------------------------------------------
+// FRAME PACING
+//------------------------------------------------------------------------------
+
+// Paces the GLUT render loop. The timer wakes once per display interval and
+// posts a redraw only if the haptic thread published a newer snapshot or
+// something else on screen changed. With vsync the swap holds frames to the
+// display rate, so the render thread never blocks in glFinish.
+class FramePacer {
+public:
+	long long intervalNs;
+	long long nextFrameNs;
+	unsigned long long drawnGeneration;  // snapshot generation of the last drawn frame
+	bool redrawRequested;                // input, resize or overlay changes
+	bool vsync;
+	unsigned long long framesDrawn;
+	unsigned long long framesSkipped;
+	long long lastPresentNs;
+	StageHistogram frameTime;       // between consecutive swaps
+	StageHistogram presentLatency;  // haptic publish to swap of the frame showing it
+
+	FramePacer() : intervalNs(1000000000LL / 60), nextFrameNs(0), drawnGeneration(0), redrawRequested(true),
+		vsync(true), framesDrawn(0), framesSkipped(0), lastPresentNs(0) {}
+
+	void setRate(int hz) {
+		intervalNs = 1000000000LL / cMax(hz, 1);
+	}
+
+	int rateHz() const { return (int)(1000000000LL / intervalNs); }
+
+	void requestRedraw() { redrawRequested = true; }
+
+	// Whole milliseconds until the next frame is due; a late frame restarts
+	// the schedule instead of drawing a burst to catch up
+	int delayMs(long long nowNs) {
+		nextFrameNs += intervalNs;
+		if (nextFrameNs < nowNs) {
+			nextFrameNs = nowNs + intervalNs;
+		}
+		return (int)((nextFrameNs - nowNs) / 1000000LL);
+	}
+
+	// Called by the timer: true if the frame has anything new to show
+	bool frameDue(unsigned long long generation) {
+		if (generation != drawnGeneration || redrawRequested) {
+			return true;
+		}
+		framesSkipped++;
+		return false;
+	}
+
+	// Called right after the swap of a drawn frame
+	void presented(unsigned long long generation, long long publishNs) {
+		long long nowNs = monotonicNs();
+		if (lastPresentNs != 0) {
+			frameTime.record(nowNs - lastPresentNs);
+		}
+		if (publishNs != 0) {
+			presentLatency.record(nowNs - publishNs);
+		}
+		lastPresentNs = nowNs;
+		drawnGeneration = generation;
+		redrawRequested = false;
+		framesDrawn++;
+	}
+
+	void printReport() const {
+		StageHistogram::Snapshot frames, latency;
+		frameTime.read(frames);
+		presentLatency.read(latency);
+		printf("Frames: %llu drawn, %llu skipped, target %d Hz%s, frame time p50 %.2f ms p99 %.2f ms max %.2f ms, "
+			"present latency p50 %.2f ms p99 %.2f ms max %.2f ms\n",
+			framesDrawn, framesSkipped, rateHz(), vsync ? " (vsync)" : "",
+			frames.percentileUs(0.5) / 1000.0, frames.percentileUs(0.99) / 1000.0, frames.maxUs() / 1000.0,
+			latency.percentileUs(0.5) / 1000.0, latency.percentileUs(0.99) / 1000.0, latency.maxUs() / 1000.0);
+	}
+};
+
+FramePacer framePacer;
+int frameRateHz = 0;  // see --fps; 0 uses the display refresh rate
+cLabel* frameLabel = nullptr;
+
+// Refresh rate of the display, or 60 Hz where it cannot be queried. Needs
+// the window's context to be current on Linux.
+int displayRefreshHz() {
+#if defined(_WIN32)
+	DEVMODE mode;
+	memset(&mode, 0, sizeof(mode));
+	mode.dmSize = sizeof(mode);
+	if (EnumDisplaySettings(NULL, ENUM_CURRENT_SETTINGS, &mode) && mode.dmDisplayFrequency > 1) {
+		return (int)mode.dmDisplayFrequency;
+	}
+#elif defined(LINUX)
+	// GLX_OML_sync_control gives the rate of the screen the window is on
+	Display* display = glXGetCurrentDisplay();
+	GLXDrawable drawable = glXGetCurrentDrawable();
+	const char* extensions = (display != NULL) ? glXQueryExtensionsString(display, DefaultScreen(display)) : NULL;
+	if (drawable != 0 && extensions != NULL && strstr(extensions, "GLX_OML_sync_control") != NULL) {
+		typedef Bool(*GetMscRateProc)(Display*, GLXDrawable, int32_t*, int32_t*);
+		GetMscRateProc getMscRate = (GetMscRateProc)glXGetProcAddressARB((const GLubyte*)"glXGetMscRateOML");
+		int32_t numerator = 0, denominator = 0;
+		if (getMscRate != NULL && getMscRate(display, drawable, &numerator, &denominator)
+			&& denominator > 0 && numerator > denominator) {
+			return (int)((double)numerator / denominator + 0.5);
+		}
+	}
+#elif defined(MACOSX)
+	CGDisplayModeRef mode = CGDisplayCopyDisplayMode(CGMainDisplayID());
+	if (mode != NULL) {
+		double rate = CGDisplayModeGetRefreshRate(mode);
+		CGDisplayModeRelease(mode);
+		if (rate > 1.0) {
+			return (int)(rate + 0.5);
+		}
+	}
+#endif
+	return 60;
+}
+
+// Syncs buffer swaps of the current context to the display, or turns it off.
+// Returns false if the platform offers no swap control.
+bool setSwapInterval(int interval) {
+#if defined(_WIN32)
+	typedef BOOL(WINAPI *SwapIntervalProc)(int);
+	SwapIntervalProc swapInterval = (SwapIntervalProc)wglGetProcAddress("wglSwapIntervalEXT");
+	return swapInterval != NULL && swapInterval(interval);
+#elif defined(LINUX)
+	typedef int(*SwapIntervalProc)(int);
+	SwapIntervalProc swapInterval = (SwapIntervalProc)glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalSGI");
+	return swapInterval != NULL && interval > 0 && swapInterval(interval) == 0;
+#elif defined(MACOSX)
+	GLint value = interval;
+	return CGLSetParameter(CGLGetCurrentContext(), kCGLCPSwapInterval, &value) == kCGLNoError;
+#else
+	return false;
+#endif
+}
+
+//------------------------------------------------------------------------------
+// SESSION RECORDER
+//------------------------------------------------------------------------------
+
+// Binary session file written with --record:
+//   SessionFileHeader
+//   chunks of SessionChunkHeader + up to SESSION_CHUNK_TICKS SessionTickRecords
+//   SessionIndexEntry for every chunk, then SessionFileFooter
+// The chunk headers let a reader walk the file even if the footer is missing
+// (a crash); the trailing index lets it seek straight to a tick. Every input
+// the haptic thread consumes is stored exactly, so --replay can run the same
+// ticks again and compare their output.
+const char SESSION_MAGIC[8] = { 'H', 'R', 'S', 'E', 'S', 'S', '0', '1' };
+const uint32_t SESSION_CHUNK_MAGIC = 0x4b4e4843;  // "CHNK"
+const uint32_t SESSION_INDEX_MAGIC = 0x58444e49;  // "INDX"
+const uint32_t SESSION_VERSION = 2;
+const int SESSION_CHUNK_TICKS = 1024;
+
+struct SessionFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	uint32_t hapticRateHz;
+	uint16_t targetCount;
+	uint16_t blockGridSize;
+	uint64_t seed;          // sessionSeed, for the recoil and target generators
+	int64_t startTimeUnix;  // wall clock at the start, seconds
+	double workspaceRadius;     // of the recorded device, sets the tool scale
+	double maxLinearStiffness;
+};
+
+struct SessionChunkHeader {
+	uint32_t magic;
+	uint32_t count;
+	uint64_t firstTick;
+};
+
+struct SessionIndexEntry {
+	uint64_t firstTick;
+	uint64_t offset;  // of the chunk header
+};
+
+struct SessionFileFooter {
+	uint32_t magic;
+	uint32_t chunkCount;
+	uint64_t indexOffset;
+	uint64_t tickCount;
+	uint64_t droppedTicks;
+};
+
+enum SessionTickFlags {
+	// outputs of the tick
+	SESSION_TRIGGER_EDGE = 1,
+	SESSION_HIT = 2,
+	// keyboard inputs seen by the tick
+	SESSION_ROTATE_LEFT = 4,
+	SESSION_ROTATE_RIGHT = 8,
+	SESSION_TIME_TRIAL_REQUEST = 16
+};
+const uint8_t SESSION_OUTPUT_FLAGS = SESSION_TRIGGER_EDGE | SESSION_HIT;
+
+// One haptic tick. Inputs are kept in full precision so a replay feeds the
+// tick bit-identical values; outputs are floats, which is enough to compare
+// them and to analyse a session.
+struct SessionTickRecord {
+	uint64_t tick;
+	int64_t timeNs;          // haptic clock, see hapticClockNs
+	double devicePos[3];     // raw device position, as read by the tool
+	double cameraPos[3];     // camera pose used by the tick
+	double cameraLook[3];
+	float force[3];
+	float torque[3];
+	float crosshairPos[3];
+	uint8_t buttons;         // bit n = user switch n
+	uint8_t weapon;          // WeaponType
+	uint8_t flags;           // SessionTickFlags
+	uint8_t hitRegion;       // HitRegion, when SESSION_HIT is set
+	int16_t hitTarget;       // target index, when SESSION_HIT is set
+	int16_t score;
+	uint32_t reserved;
+};
+
+inline void storeVector(float* out, const cVector3d& v) {
+	out[0] = (float)v.x();
+	out[1] = (float)v.y();
+	out[2] = (float)v.z();
+}
+
+inline void storeVector(double* out, const cVector3d& v) {
+	out[0] = v.x();
+	out[1] = v.y();
+	out[2] = v.z();
+}
+
+// The haptic thread only copies records into a preallocated ring; a writer
+// thread drains it into the file. If the writer falls a full ring behind,
+// ticks are dropped and counted rather than stalling the haptic loop.
+class SessionRecorder {
+private:
+	SpscRing<SessionTickRecord> ring;
+	std::thread writer;
+	std::atomic<bool> running;
+	std::atomic<unsigned long long> dropped;
+	FILE* file;
+	uint64_t nextTick;
+	uint64_t written;
+	std::vector<SessionIndexEntry> index;
+
+	void writeChunk(const SessionTickRecord* records, size_t count) {
+		SessionIndexEntry entry;
+		entry.firstTick = records[0].tick;
+		entry.offset = (uint64_t)ftell(file);
+		index.push_back(entry);
+
+		SessionChunkHeader chunk;
+		chunk.magic = SESSION_CHUNK_MAGIC;
+		chunk.count = (uint32_t)count;
+		chunk.firstTick = records[0].tick;
+		fwrite(&chunk, sizeof(chunk), 1, file);
+		fwrite(records, sizeof(SessionTickRecord), count, file);
+		written += count;
+	}
+
+	void writerLoop() {
+		std::vector<SessionTickRecord> chunk(SESSION_CHUNK_TICKS);
+		size_t filled = 0;
+		for (;;) {
+			// read the flag first so nothing pushed before stop() is missed
+			bool stopping = !running.load(std::memory_order_acquire);
+			size_t count = ring.pop(&chunk[filled], SESSION_CHUNK_TICKS - filled);
+			filled += count;
+			if (filled == (size_t)SESSION_CHUNK_TICKS) {
+				writeChunk(&chunk[0], filled);
+				filled = 0;
+			}
+			else if (count == 0) {
+				if (stopping) break;
+				cSleepMs(5);
+			}
+		}
+		if (filled > 0) {
+			writeChunk(&chunk[0], filled);
+		}
+
+		SessionFileFooter footer;
+		footer.magic = SESSION_INDEX_MAGIC;
+		footer.chunkCount = (uint32_t)index.size();
+		footer.indexOffset = (uint64_t)ftell(file);
+		footer.tickCount = written;
+		footer.droppedTicks = dropped.load();
+		if (!index.empty()) {
+			fwrite(&index[0], sizeof(SessionIndexEntry), index.size(), file);
+		}
+		fwrite(&footer, sizeof(footer), 1, file);
+	}
+
+public:
+	SessionRecorder() : running(false), dropped(0), file(nullptr), nextTick(0), written(0) {}
+
+	// ringTicks is how far the writer may fall behind before ticks are dropped
+	bool start(const string& path, int rateHz, uint64_t seed, int targets, int blocks, const cHapticDeviceInfo& device, size_t ringTicks) {
+		file = fopen(path.c_str(), "wb");
+		if (file == nullptr) {
+			cout << "Error - could not create session file " << path << endl;
+			return false;
+		}
+		setvbuf(file, nullptr, _IOFBF, 1 << 20);
+
+		SessionFileHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, SESSION_MAGIC, sizeof(header.magic));
+		header.version = SESSION_VERSION;
+		header.recordSize = sizeof(SessionTickRecord);
+		header.hapticRateHz = (uint32_t)rateHz;
+		header.targetCount = (uint16_t)targets;
+		header.blockGridSize = (uint16_t)blocks;
+		header.seed = seed;
+		header.startTimeUnix = (int64_t)time(nullptr);
+		header.workspaceRadius = device.m_workspaceRadius;
+		header.maxLinearStiffness = device.m_maxLinearStiffness;
+		fwrite(&header, sizeof(header), 1, file);
+
+		ring.reserve(ringTicks);
+		index.reserve(1024);
+		dropped = 0;
+		nextTick = 0;
+		written = 0;
+		running = true;
+		writer = std::thread(&SessionRecorder::writerLoop, this);
+		return true;
+	}
+
+	bool isRecording() const { return running.load(std::memory_order_relaxed); }
+
+	// Haptic thread. Fills in the tick number, never blocks.
+	void record(SessionTickRecord& r) {
+		r.tick = nextTick++;
+		if (!ring.push(r)) {
+			dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		}
+	}
+
+	// Call once the haptic thread has stopped
+	void stop() {
+		if (!running) return;
+		running = false;
+		writer.join();
+		fclose(file);
+		file = nullptr;
+		cout << "Session recorded: " << written << " ticks in " << index.size() << " chunks, "
+			<< dropped.load() << " dropped" << endl;
+	}
+};
+
+SessionRecorder sessionRecorder;
+string sessionRecordPath;  // see --record
+
+// Sits between the tool and the real device while recording and keeps the
+// position and switches exactly as the tool and the tick read them
+class SessionTapDevice : public cGenericHapticDevice {
+private:
+	cGenericHapticDevicePtr device;
+
+public:
+	cVector3d lastPosition;
+
+	SessionTapDevice(cGenericHapticDevicePtr inner) : device(inner) {
+		m_specifications = inner->getSpecifications();
+		m_deviceAvailable = true;
+	}
+
+	virtual bool open() { m_deviceReady = device->open(); return m_deviceReady; }
+	virtual bool close() { m_deviceReady = false; return device->close(); }
+	virtual bool calibrate(bool a_forceCalibration = false) { return device->calibrate(a_forceCalibration); }
+
+	virtual bool getPosition(cVector3d& a_position) {
+		bool ok = device->getPosition(a_position);
+		lastPosition = a_position;
+		return ok;
+	}
+
+	virtual bool getRotation(cMatrix3d& a_rotation) { return device->getRotation(a_rotation); }
+	virtual bool getLinearVelocity(cVector3d& a_linearVelocity) { return device->getLinearVelocity(a_linearVelocity); }
+	virtual bool getUserSwitches(unsigned int& a_userSwitches) { return device->getUserSwitches(a_userSwitches); }
+
+	virtual bool setForceAndTorqueAndGripperForce(const cVector3d& a_force, const cVector3d& a_torque, double a_gripperForce) {
+		return device->setForceAndTorqueAndGripperForce(a_force, a_torque, a_gripperForce);
+	}
+};
+
+std::shared_ptr<SessionTapDevice> sessionTap;
+
+//------------------------------------------------------------------------------
+// SESSION REPLAY
+//------------------------------------------------------------------------------
+
+// Stands in for the device during --replay and hands the tool the recorded
+// position and switches of the tick being replayed. Rotation and velocity
+// stay at rest, like on the Falcon.
+class ReplayHapticDevice : public cGenericHapticDevice {
+private:
+	cVector3d pos;
+	unsigned int buttons;
+
+public:
+	ReplayHapticDevice(const SessionFileHeader& header) : buttons(0) {
+		m_specifications.m_model = C_HAPTIC_DEVICE_VIRTUAL;
+		m_specifications.m_modelName = "Session replay";
+		m_specifications.m_manufacturerName = "none";
+		m_specifications.m_maxLinearForce = 8.0;
+		m_specifications.m_maxLinearStiffness = header.maxLinearStiffness;
+		m_specifications.m_workspaceRadius = header.workspaceRadius;
+		m_specifications.m_sensedPosition = true;
+		m_specifications.m_actuatedPosition = true;
+		m_specifications.m_leftHand = true;
+		m_specifications.m_rightHand = true;
+		m_deviceAvailable = true;
+	}
+
+	void setSample(const SessionTickRecord& r) {
+		pos.set(r.devicePos[0], r.devicePos[1], r.devicePos[2]);
+		buttons = r.buttons;
+	}
+
+	virtual bool open() { m_deviceReady = true; return true; }
+	virtual bool close() { m_deviceReady = false; return true; }
+	virtual bool calibrate(bool a_forceCalibration = false) { return true; }
+
+	virtual bool getPosition(cVector3d& a_position) {
+		a_position = pos;
+		return true;
+	}
+
+	virtual bool getRotation(cMatrix3d& a_rotation) {
+		a_rotation.identity();
+		return true;
+	}
+
+	virtual bool getLinearVelocity(cVector3d& a_linearVelocity) {
+		a_linearVelocity.zero();
+		return true;
+	}
+
+	virtual bool getUserSwitches(unsigned int& a_userSwitches) {
+		a_userSwitches = buttons;
+		return true;
+	}
+
+	virtual bool setForceAndTorqueAndGripperForce(const cVector3d& a_force, const cVector3d& a_torque, double a_gripperForce) {
+		return true;
+	}
+};
+
+// Reads a whole session; chunks are walked one by one, so a file cut off by
+// a crash replays up to its last complete chunk. A session that dropped
+// ticks while recording is refused: the ticks after a gap ran on scene state
+// the replay never reaches, so it could not reproduce them.
+bool readSession(const string& path, SessionFileHeader& header, std::vector<SessionTickRecord>& records) {
+	FILE* f = fopen(path.c_str(), "rb");
+	if (f == nullptr) return false;
+	bool ok = fread(&header, sizeof(header), 1, f) == 1
+		&& memcmp(header.magic, SESSION_MAGIC, sizeof(header.magic)) == 0
+		&& header.version == SESSION_VERSION
+		&& header.recordSize == sizeof(SessionTickRecord);
+
+	SessionChunkHeader chunk;
+	while (ok && fread(&chunk, sizeof(chunk), 1, f) == 1 && chunk.magic == SESSION_CHUNK_MAGIC) {
+		size_t start = records.size();
+		records.resize(start + chunk.count);
+		if (fread(&records[start], sizeof(SessionTickRecord), chunk.count, f) != chunk.count) {
+			records.resize(start);
+			break;
+		}
+	}
+
+	// the footer is missing after a crash; the tick numbers still show gaps
+	SessionFileFooter footer;
+	bool hasFooter = ok && fseek(f, -(long)sizeof(footer), SEEK_END) == 0
+		&& fread(&footer, sizeof(footer), 1, f) == 1 && footer.magic == SESSION_INDEX_MAGIC;
+	fclose(f);
+	if (!ok || records.empty()) return false;
+
+	uint64_t missing = records[0].tick;
+	for (size_t i = 1; i < records.size(); i++) {
+		if (records[i].tick <= records[i - 1].tick) {
+			cout << "Error - session " << path << " has tick " << records[i].tick << " out of order" << endl;
+			return false;
+		}
+		missing += records[i].tick - records[i - 1].tick - 1;
+	}
+	uint64_t dropped = hasFooter ? footer.droppedTicks : 0;
+	if (missing > 0 || dropped > 0) {
+		cout << "Error - session " << path << " dropped " << cMax(missing, dropped)
+			<< " ticks while recording and cannot be replayed exactly" << endl;
+		return false;
+	}
+	return true;
+}
+
+// Output of one tick compared bit for bit against the recording
+bool sameTickOutput(const SessionTickRecord& a, const SessionTickRecord& b) {
+	return memcmp(a.force, b.force, sizeof(a.force)) == 0
+		&& memcmp(a.torque, b.torque, sizeof(a.torque)) == 0
+		&& memcmp(a.crosshairPos, b.crosshairPos, sizeof(a.crosshairPos)) == 0
+		&& a.weapon == b.weapon
+		&& (a.flags & SESSION_OUTPUT_FLAGS) == (b.flags & SESSION_OUTPUT_FLAGS)
+		&& a.hitRegion == b.hitRegion
+		&& a.hitTarget == b.hitTarget
+		&& a.score == b.score;
+}
+
+string replayPath;             // see --replay
+bool replayRealtime = false;   // see --replay-realtime
+SessionFileHeader replayHeader;
+std::vector<SessionTickRecord> replayRecords;
+std::shared_ptr<ReplayHapticDevice> replayDevice;
+SessionTickRecord replayOutput;   // filled by the replayed tick
+unsigned long long replayMismatches = 0;
+
+//------------------------------------------------------------------------------
+// RECOIL ENVELOPES
+//------------------------------------------------------------------------------
+
+const int HAPTIC_RATE_HZ = 1000;
+int hapticRateHz = HAPTIC_RATE_HZ;  // 1, 2 or 4 kHz, see --haptic-rate
+
+// Small xorshift64* generator; much cheaper than rand() and seedable per session
+class FastRng {
+private:
+	uint64_t state;
+
+public:
+	explicit FastRng(uint64_t seed = 1) { setSeed(seed); }
+
+	void setSeed(uint64_t seed) {
+		// splitmix64 scramble so that small or sequential seeds still give well mixed states
+		uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		state = z ^ (z >> 31);
+		if (state == 0) state = 0x9E3779B97F4A7C15ULL;
+	}
+
+	uint64_t next() {
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 0x2545F4914F6CDD1DULL;
+	}
+
+	// Uniform integer in [0, n)
+	int nextInt(int n) {
+		return (int)((next() >> 32) % (uint64_t)n);
+	}
+};
+
+// Physical parameters of a weapon's recoil impulse
+struct RecoilParams {
+	float mf;                // mass of firearm
+	float vf;                // velocity of firearm
+	float mb;                // mass of bullet
+	float barrel_length;     // barrel length
+	float tr;                // recoil time
+	float force_gain;        // multiplier applied to vf / tr
+	float h_axis;            // height of the bore axis above the grip
+	int recoil_duration;     // ms
+	int recovery_duration;   // ms
+	float decay;             // exponential decay rate of each phase
+	float recovery_gain;     // fraction of the initial force pulled back during recovery
+	int cyclic_rpm;          // rounds per minute in automatic fire, 0 for one shot per pull
+};
+
+const RecoilParams PISTOL_RECOIL = { 1.1f, 3.978f, 0.015f, 0.127f, 0.003f, 0.2f, 0.0678f, 50, 100, 5.0f, 0.3f, 0 };
+// recoil + recovery fill one round of the cyclic rate: 60 + 40 ms at 600 rpm
+const RecoilParams RIFLE_RECOIL = { 3.9f, 2.2688f, 0.0079f, 0.415f, 0.06f, 0.15f * 100.0f, 0.065f, 60, 40, 0.0f, 0.0f, 600 };
+const RecoilParams SNIPER_RECOIL = { 4.3f, 3.265f, 0.0113f, 0.62f, 0.005f, 0.15f * 5.0f, 0.045f, 120, 300, 3.0f, 0.2f, 0 };
+
+// Force and torque magnitudes of one shot, sampled once per haptic tick
+struct RecoilEnvelope {
+	int rateHz;
+	int recoilTicks;
+	std::vector<float> force;
+	std::vector<float> torque;
+
+	int totalTicks() const { return (int)force.size(); }
+};
+
+RecoilEnvelope pistolEnvelope;
+RecoilEnvelope rifleEnvelope;
+RecoilEnvelope sniperEnvelope;
+
+RecoilEnvelope bakeRecoilEnvelope(const RecoilParams& p, int rateHz) {
+	float force = p.force_gain * (p.vf / p.tr);
+	float moment_of_inertia = (p.h_axis * p.h_axis) * p.mf;
+	float deviation_angle = (p.h_axis * p.mb * p.barrel_length) / moment_of_inertia;
+
+	RecoilEnvelope envelope;
+	envelope.rateHz = rateHz;
+	envelope.recoilTicks = p.recoil_duration * rateHz / 1000;
+	int totalTicks = (p.recoil_duration + p.recovery_duration) * rateHz / 1000;
+	if (p.cyclic_rpm > 0) {
+		// a round of automatic fire never outlasts the cyclic period
+		totalTicks = cMin(totalTicks, (int)(60000LL * rateHz / ((long long)p.cyclic_rpm * 1000)));
+	}
+	envelope.force.resize(totalTicks);
+	envelope.torque.resize(totalTicks);
+
+	for (int i = 0; i < totalTicks; i++) {
+		float t = i * 1000.0f / rateHz;
+		float gain;
+		if (i < envelope.recoilTicks) {
+			// Recoil phase
+			gain = exp(-p.decay * t / p.recoil_duration);
+		}
+		else {
+			// Recovery phase, pulls back against the initial impulse
+			gain = -p.recovery_gain * exp(-p.decay * (t - p.recoil_duration) / p.recovery_duration);
+		}
+		envelope.force[i] = force * gain;
+		envelope.torque[i] = p.h_axis * force * gain * deviation_angle;
+	}
+	return envelope;
+}
+
+void bakeRecoilEnvelopes(int rateHz) {
+	pistolEnvelope = bakeRecoilEnvelope(PISTOL_RECOIL, rateHz);
+	rifleEnvelope = bakeRecoilEnvelope(RIFLE_RECOIL, rateHz);
+	sniperEnvelope = bakeRecoilEnvelope(SNIPER_RECOIL, rateHz);
+}
+
+inline int recoilTick(const RecoilEnvelope& envelope, long long elapsedUs) {
+	return (int)(elapsedUs * envelope.rateHz / 1000000);
+}
+
+// Automatic fire at a cyclic rate. Round n of a burst starts exactly n
+// periods after the trigger pull, so the rate holds over any burst length
+// instead of slipping by part of a tick every round.
+struct CyclicFire {
+	long long periodUs = 1;
+	long long round = 0;
+
+	void begin(int roundsPerMinute) {
+		periodUs = (roundsPerMinute > 0) ? 60000000LL / roundsPerMinute : 1;
+		round = 0;
+	}
+
+	// Time into the current round; true when that round has just started
+	bool advance(long long elapsedUs, long long& roundElapsedUs) {
+		long long current = elapsedUs / periodUs;
+		roundElapsedUs = elapsedUs - current * periodUs;
+		if (current == round) return false;
+		round = current;
+		return true;
+	}
+};
+
+// Randomized parts of a shot, drawn once per trigger edge so a shot keeps its direction
+struct RecoilShot {
+	cVector3d direction;
+	int horizontalSign;
+};
+
+FastRng targetRng;
+uint64_t sessionSeed = 0;  // seeds the target and recoil generators, stored in session recordings
+
+//------------------------------------------------------------------------------
+// FORCE THREAD
+//------------------------------------------------------------------------------
+
+// With --force-rate, recoil forces are written by a small thread of their own
+// at 4 to 10 kHz. It does nothing but interpolate the active envelope and send
+// the result to the device, so the onset of a shot no longer waits for the
+// haptic tick and its scene work. The haptic thread decides when shots start
+// and stop and posts them through a lock-free mailbox. The force thread also
+// does all reads of that device and hands them back the same way, so the
+// device is only ever called from one thread. Only the first station's
+// device is driven this way; further stations write their own.
+struct RecoilCommand {
+	const RecoilEnvelope* envelope = nullptr;  // nullptr: no force
+	long long startNs = 0;                     // shot start on the monotonic clock
+	cVector3d direction;
+};
+
+// Everything the tool and the tick read from the device
+struct DeviceSample {
+	cVector3d position;
+	cMatrix3d rotation;
+	cVector3d linearVelocity;
+	unsigned int switches = 0;
+};
+
+// With the force thread, the first station's device is only called from
+// that thread: it writes the forces and reads position, rotation, velocity
+// and switches once per force tick into a triple buffer. The tool and the
+// haptic tick read the latest sample through this stand-in, so neither
+// thread ever waits on the other.
+class ForceThreadDevice : public cGenericHapticDevice {
+private:
+	cGenericHapticDevicePtr device;
+	TripleBuffer<DeviceSample> samples;
+
+public:
+	ForceThreadDevice(cGenericHapticDevicePtr inner) : device(inner) {
+		m_specifications = inner->getSpecifications();
+		m_deviceAvailable = true;
+	}
+
+	// open, close and calibrate run while the force thread is stopped
+	virtual bool open() {
+		m_deviceReady = device->open();
+		if (m_deviceReady) {
+			poll();
+		}
+		return m_deviceReady;
+	}
+
+	virtual bool close() { m_deviceReady = false; return device->close(); }
+	virtual bool calibrate(bool a_forceCalibration = false) { return device->calibrate(a_forceCalibration); }
+
+	// Force thread (or open(), before it starts)
+	void poll() {
+		DeviceSample& sample = samples.writeBuffer();
+		device->getPosition(sample.position);
+		device->getRotation(sample.rotation);
+		device->getLinearVelocity(sample.linearVelocity);
+		device->getUserSwitches(sample.switches);
+		samples.publish();
+	}
+
+	void writeForce(const cVector3d& force, const cVector3d& torque) {
+		device->setForceAndTorque(force, torque);
+	}
+
+	// Haptic thread
+	virtual bool getPosition(cVector3d& a_position) {
+		samples.update();
+		a_position = samples.readBuffer().position;
+		return true;
+	}
+
+	virtual bool getRotation(cMatrix3d& a_rotation) {
+		samples.update();
+		a_rotation = samples.readBuffer().rotation;
+		return true;
+	}
+
+	virtual bool getLinearVelocity(cVector3d& a_linearVelocity) {
+		samples.update();
+		a_linearVelocity = samples.readBuffer().linearVelocity;
+		return true;
+	}
+
+	virtual bool getUserSwitches(unsigned int& a_userSwitches) {
+		samples.update();
+		a_userSwitches = samples.readBuffer().switches;
+		return true;
+	}
+
+	// forces reach the device from the force thread only
+	virtual bool setForceAndTorqueAndGripperForce(const cVector3d& a_force, const cVector3d& a_torque, double a_gripperForce) {
+		return true;
+	}
+};
+
+int forceRateHz = 0;  // 0: the haptic thread writes forces, see --force-rate
+TripleBuffer<RecoilCommand> recoilMailbox;
+RecoilCommand postedRecoil;  // last command posted, haptic thread only
+std::shared_ptr<ForceThreadDevice> forceDevice;  // wraps the first station's device with --force-rate
+HapticScheduler forceScheduler;
+std::atomic<bool> forceThreadRunning(false);
+std::atomic<bool> forceThreadFinished(true);
+
+// Haptic thread: posts a shot, or stops the force with a null envelope. Only
+// changes reach the mailbox, so it sees a few writes per shot.
+void postRecoil(const RecoilEnvelope* envelope, long long startUs, const cVector3d& direction) {
+	if (!forceThreadRunning) return;
+	long long startNs = hapticClockStartNs + startUs * 1000;
+	if (envelope == postedRecoil.envelope && (envelope == nullptr ||
+		(startNs == postedRecoil.startNs && direction.equals(postedRecoil.direction)))) {
+		return;
+	}
+	postedRecoil.envelope = envelope;
+	postedRecoil.startNs = startNs;
+	postedRecoil.direction = direction;
+	recoilMailbox.writeBuffer() = postedRecoil;
+	recoilMailbox.publish();
+}
+
+// Envelope value at a fractional sample position, linearly interpolated
+inline float sampleEnvelope(const std::vector<float>& samples, double position) {
+	int i = (int)position;
+	float f = (float)(position - i);
+	float next = (i + 1 < (int)samples.size()) ? samples[i + 1] : 0.0f;
+	return samples[i] + (next - samples[i]) * f;
+}
+
+void updateForces(void) {
+	forceScheduler.configureThread(hapticRealtime, -1, false);
+	forceScheduler.start();
+	bool wasActive = false;
+
+	while (forceThreadRunning) {
+		long long nowNs = forceScheduler.waitForNextTick();
+		forceDevice->poll();
+		recoilMailbox.update();
+		const RecoilCommand& command = recoilMailbox.readBuffer();
+
+		const RecoilEnvelope* envelope = command.envelope;
+		double position = (envelope != nullptr) ? (nowNs - command.startNs) * 1e-9 * envelope->rateHz : -1.0;
+		if (envelope != nullptr && position >= 0.0 && position < envelope->totalTicks()) {
+			cVector3d force = command.direction * sampleEnvelope(envelope->force, position);
+			cVector3d torque = command.direction * sampleEnvelope(envelope->torque, position);
+			forceDevice->writeForce(force, torque);
+			wasActive = true;
+		}
+		else if (wasActive) {
+			forceDevice->writeForce(cVector3d(0, 0, 0), cVector3d(0, 0, 0));
+			wasActive = false;
+		}
+	}
+
+	forceDevice->writeForce(cVector3d(0, 0, 0), cVector3d(0, 0, 0));
+	forceThreadFinished = true;
+}
+
+//------------------------------------------------------------------------------
+
+// Recent force samples for the on-screen trace, written once per tick by the
+// haptic thread and read once per frame by the renderer. The writer never
+// waits: it overwrites the oldest sample and then advances the count, and a
+// reader drops whatever the writer may have overwritten while it was copying,
+// including the slot of a write that has started but not yet been counted.
+class ForceHistoryRing {
+private:
+	std::unique_ptr<std::atomic<float>[]> samples;  // x, y, z per sample
+	size_t capacity;
+	std::atomic<unsigned long long> written;
+
+public:
+	ForceHistoryRing() : capacity(0), written(0) {}
+
+	// Not thread safe; call before the haptic thread starts
+	void reserve(size_t n) {
+		samples.reset(n > 0 ? new std::atomic<float>[3 * n] : nullptr);
+		capacity = n;
+		written = 0;
+	}
+
+	size_t getCapacity() const { return capacity; }
+
+	// Haptic thread
+	void push(const cVector3d& v) {
+		unsigned long long n = written.load(std::memory_order_relaxed);
+		std::atomic<float>* slot = &samples[3 * (n % capacity)];
+		slot[0].store((float)v.x(), std::memory_order_relaxed);
+		slot[1].store((float)v.y(), std::memory_order_relaxed);
+		slot[2].store((float)v.z(), std::memory_order_relaxed);
+		written.store(n + 1, std::memory_order_release);
+	}
+
+	// Any thread: copies up to capacity samples into out as x, y, z floats,
+	// newest first, and returns how many are valid
+	size_t readLatest(float* out) const {
+		unsigned long long end = written.load(std::memory_order_acquire);
+		size_t count = (size_t)cMin((unsigned long long)capacity, end);
+		for (size_t i = 0; i < count; i++) {
+			const std::atomic<float>* slot = &samples[3 * ((end - 1 - i) % capacity)];
+			out[3 * i + 0] = slot[0].load(std::memory_order_relaxed);
+			out[3 * i + 1] = slot[1].load(std::memory_order_relaxed);
+			out[3 * i + 2] = slot[2].load(std::memory_order_relaxed);
+		}
+		// samples the writer reached during the copy may be torn, and so may
+		// the slot of sample `seen`, which it can be writing right now
+		std::atomic_thread_fence(std::memory_order_acquire);
+		unsigned long long seen = written.load(std::memory_order_relaxed);
+		unsigned long long firstIntact = (seen + 1 > capacity) ? seen + 1 - capacity : 0;
+		unsigned long long oldest = end - count;
+		size_t dropped = (firstIntact > oldest) ? (size_t)(firstIntact - oldest) : 0;
+		return (dropped >= count) ? 0 : count - dropped;
+	}
+};
+
+int forceHistorySamples = 0;  // 0 disables the trace, see --force-history
+ForceHistoryRing forceHistory;
+const double FORCE_SCALE = 0.1; // Adjust this to scale the force visualization
+
+cShapeLine* forceVector = nullptr;
+
+// Render thread state of the trace: positions are re-uploaded every frame into
+// a buffer sized once for the whole history, colours never change
+std::vector<float> forceHistoryScratch;
+GLuint forceHistoryVbo = 0;
+GLuint forceHistoryColorVbo = 0;
+
+void initForceVisualization(cWorld* world) {
+	forceHistory.reserve(forceHistorySamples);
+	forceHistoryScratch.assign(3 * forceHistorySamples, 0.0f);
+
+	forceVector = new cShapeLine(cVector3d(0, 0, 0), cVector3d(0, 0, 0));
+	forceVector->setLineWidth(2.0);
+	forceVector->m_colorPointA.setRed();
+	forceVector->m_colorPointB.setRed();
+	forceVector->setGhostEnabled(true);
+	world->addChild(forceVector);
+}
+
+// Draws the trace of recent force vectors from position, newest first, fading
+// out with age, in one draw call
+void drawForceHistory(const cVector3d& position) {
+	if (forceHistorySamples == 0) return;
+
+	size_t count = forceHistory.readLatest(&forceHistoryScratch[0]);
+	if (count == 0) return;
+
+	// current force as a line from the weapon
+	cVector3d latest(forceHistoryScratch[0], forceHistoryScratch[1], forceHistoryScratch[2]);
+	forceVector->m_pointA = position;
+	forceVector->m_pointB = position + latest;
+	if (count < 2) return;
+
+	if (forceHistoryVbo == 0) {
+		std::vector<float> colors(4 * forceHistorySamples);
+		for (int i = 0; i < forceHistorySamples; i++) {
+			colors[4 * i + 0] = 1.0f;
+			colors[4 * i + 1] = 0.0f;
+			colors[4 * i + 2] = 0.0f;
+			colors[4 * i + 3] = 1.0f - (float)i / forceHistorySamples;
+		}
+		glGenBuffers(1, &forceHistoryColorVbo);
+		glBindBuffer(GL_ARRAY_BUFFER, forceHistoryColorVbo);
+		glBufferData(GL_ARRAY_BUFFER, colors.size() * sizeof(float), &colors[0], GL_STATIC_DRAW);
+		glGenBuffers(1, &forceHistoryVbo);
+		glBindBuffer(GL_ARRAY_BUFFER, forceHistoryVbo);
+		glBufferData(GL_ARRAY_BUFFER, forceHistoryScratch.size() * sizeof(float), nullptr, GL_STREAM_DRAW);
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, forceHistoryVbo);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, 3 * count * sizeof(float), &forceHistoryScratch[0]);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 0, nullptr);
+	glBindBuffer(GL_ARRAY_BUFFER, forceHistoryColorVbo);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glColorPointer(4, GL_FLOAT, 0, nullptr);
+
+	glDisable(GL_LIGHTING);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glPushMatrix();
+	glTranslated(position.x(), position.y(), position.z());
+	glDrawArrays(GL_LINE_STRIP, 0, (GLsizei)count);
+	glPopMatrix();
+	glDisable(GL_BLEND);
+	glEnable(GL_LIGHTING);
+
+	glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+const double CAMERA_SPEED = 0.1;
+bool moveForward = false, moveBackward = false, moveLeft = false, moveRight = false;
+const double WEAPON_ROTATION_SPEED = 0.002;
+bool rotateLeft = false, rotateRight = false;
+const double MAX_ROTATION_ANGLE = cDegToRad(720); // Maximum rotation of 30 degrees in each direction
+
+class CrosshairTarget {
+private:
+	std::vector<cMesh*> crosshairParts;
+	cWorld* world;
+	cVector3d position;
+	const double MOVEMENT_THRESHOLD = 0.001; // Adjust this value as needed
+	const double SMOOTHING_FACTOR = 0.1; // Adjust for more or less smoothing
+	std::vector<cVector3d> initialOffsets;
+
+public:
+	CrosshairTarget(cWorld* w) : world(w), position(0, 0, 0) {
+		createCrosshair();
+		storeInitialOffsets();
+	}
+
+	void createCrosshair() {
+		cMaterial material;
+		material.setRed();
+
+		// Center block
+		cMesh* center = new cMesh();
+		world->addChild(center);
+		cCreateBox(center, 0.02, 0.02, 0.02);
+		center->setMaterial(material);
+		crosshairParts.push_back(center);
+
+		// Top block
+		cMesh* top = new cMesh();
+		world->addChild(top);
+		cCreateBox(top, 0.01, 0.01, 0.05);
+		top->setLocalPos(0.0, 0.0, 0.04);
+		top->setMaterial(material);
+		crosshairParts.push_back(top);
+
+		// Bottom block
+		cMesh* bottom = new cMesh();
+		world->addChild(bottom);
+		cCreateBox(bottom,0.01, 0.01, 0.05);
+		bottom->setLocalPos(0.0, 0.0, -0.04);
+		bottom->setMaterial(material);
+		crosshairParts.push_back(bottom);
+
+		// Left block
+		cMesh* left = new cMesh();
+		world->addChild(left);
+		cCreateBox(left, 0.01, 0.05, 0.01);
+		left->setLocalPos(0.0, -0.04, 0.0);
+		left->setMaterial(material);
+		crosshairParts.push_back(left);
+
+		// Right block
+		cMesh* right = new cMesh();
+		world->addChild(right);
+		cCreateBox(right, 0.01, 0.05, 0.01);
+		right->setLocalPos(0.0, 0.04, 0.0);
+		right->setMaterial(material);
+		crosshairParts.push_back(right);
+
+		// moved by the render thread, so kept out of contact
+		for (size_t i = 0; i < crosshairParts.size(); i++) {
+			crosshairParts[i]->setGhostEnabled(true);
+		}
+	}
+
+	void storeInitialOffsets() {
+		initialOffsets.clear();
+		for (const auto& part : crosshairParts) {
+			initialOffsets.push_back(part->getLocalPos());
+		}
+	}
+
+	void updatePosition(const cVector3d& targetPosition) {
+		cVector3d diff = targetPosition - position;
+		if (diff.length() > MOVEMENT_THRESHOLD) {
+			cVector3d newPosition = position + diff * SMOOTHING_FACTOR;
+			setPosition(newPosition);
+		}
+	}
+
+	void setPosition(const cVector3d& newPosition) {
+		position = newPosition;
+		for (size_t i = 0; i < crosshairParts.size(); ++i) {
+			crosshairParts[i]->setLocalPos(position + initialOffsets[i]);
+			updateGlobalTransform(crosshairParts[i]);
+		}
+	}
+
+	cVector3d getPosition() const {
+		return crosshairParts[0]->getGlobalPos();
+	}
+};
+
+//------------------------------------------------------------------------------
+// MESH CACHE
+//------------------------------------------------------------------------------
+
+// Binary copy of a parsed OBJ, written next to it as <file>.cache on first
+// load. It holds flat vertex and index arrays, per-mesh materials and the
+// model bounds, and is read back through a memory mapping with no parsing.
+// A model that is optimized after parsing is cached in its optimized form.
+const uint32_t MESH_CACHE_MAGIC = 0x43524D48;  // "HMRC"
+const uint32_t MESH_CACHE_VERSION = 2;
+const uint32_t MESH_CACHE_OPTIMIZED = 1;        // header.reserved of a cache holding optimizeModel(model, true) output
+
+struct MeshCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t sourceSize;
+	int64_t sourceMtime;
+	uint64_t sourceHash;    // FNV-1a of the source file
+	uint32_t meshCount;
+	uint32_t reserved;
+	float boundsMin[3];
+	float boundsMax[3];
+};
+
+// Followed by positions (3 floats), normals (3 floats), texture coordinates
+// (2 floats) per vertex, then 3 indices per triangle
+struct MeshCacheEntry {
+	uint32_t vertexCount;
+	uint32_t triangleCount;
+	float ambient[4];
+	float diffuse[4];
+	float specular[4];
+	float emission[4];
+	float shininess;
+};
+
+// Read-only mapping of a whole file
+class MappedFile {
+private:
+#if defined(_WIN32)
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+	const unsigned char* bytes;
+	size_t length;
+
+public:
+#if defined(_WIN32)
+	MappedFile() : file(INVALID_HANDLE_VALUE), mapping(NULL), bytes(nullptr), length(0) {}
+#else
+	MappedFile() : fd(-1), bytes(nullptr), length(0) {}
+#endif
+	~MappedFile() { close(); }
+
+	bool open(const string& path) {
+		close();
+#if defined(_WIN32)
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) { close(); return false; }
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping == NULL) { close(); return false; }
+		bytes = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (bytes == nullptr) { close(); return false; }
+		length = (size_t)size.QuadPart;
+#else
+		fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0) { close(); return false; }
+		void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) { close(); return false; }
+		bytes = (const unsigned char*)p;
+		length = (size_t)st.st_size;
+#endif
+		return true;
+	}
+
+	void close() {
+#if defined(_WIN32)
+		if (bytes != nullptr) UnmapViewOfFile(bytes);
+		if (mapping != NULL) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (bytes != nullptr) munmap((void*)bytes, length);
+		if (fd >= 0) ::close(fd);
+		fd = -1;
+#endif
+		bytes = nullptr;
+		length = 0;
+	}
+
+	const unsigned char* data() const { return bytes; }
+	size_t size() const { return length; }
+};
+
+uint64_t fnv1a64(const unsigned char* data, size_t length) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+bool getFileStamp(const string& path, uint64_t& size, int64_t& mtime) {
+#if defined(_WIN32)
+	struct _stat64 st;
+	if (_stat64(path.c_str(), &st) != 0) return false;
+#else
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0) return false;
+#endif
+	size = (uint64_t)st.st_size;
+	mtime = (int64_t)st.st_mtime;
+	return true;
+}
+
+// Hash of the source file, or 0 if it cannot be read
+uint64_t hashFile(const string& path) {
+	MappedFile source;
+	if (!source.open(path)) return 0;
+	return fnv1a64(source.data(), source.size());
+}
+
+inline void storeColor(float* out, const cColorf& c) {
+	out[0] = c.getR(); out[1] = c.getG(); out[2] = c.getB(); out[3] = c.getA();
+}
+
+bool writeMeshCache(cMultiMesh* model, const string& cachePath, const MeshCacheHeader& stamp) {
+	MeshCacheHeader header = stamp;
+	header.magic = MESH_CACHE_MAGIC;
+	header.version = MESH_CACHE_VERSION;
+	header.meshCount = (uint32_t)model->getNumMeshes();
+	model->computeBoundaryBox(true);
+	for (int k = 0; k < 3; k++) {
+		header.boundsMin[k] = (float)model->getBoundaryMin()(k);
+		header.boundsMax[k] = (float)model->getBoundaryMax()(k);
+	}
+
+	// Write beside the final name and rename, so a half-written cache is never read
+	string tempPath = cachePath + ".tmp";
+	FILE* f = fopen(tempPath.c_str(), "wb");
+	if (f == nullptr) return false;
+
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	std::vector<float> floats;
+	std::vector<uint32_t> indices;
+	for (int m = 0; ok && m < model->getNumMeshes(); m++) {
+		cMesh* mesh = model->getMesh(m);
+		MeshCacheEntry entry;
+		entry.vertexCount = mesh->getNumVertices();
+		entry.triangleCount = mesh->getNumTriangles();
+		storeColor(entry.ambient, mesh->m_material->m_ambient);
+		storeColor(entry.diffuse, mesh->m_material->m_diffuse);
+		storeColor(entry.specular, mesh->m_material->m_specular);
+		storeColor(entry.emission, mesh->m_material->m_emission);
+		entry.shininess = (float)mesh->m_material->getShininess();
+
+		floats.clear();
+		floats.reserve(entry.vertexCount * 8);
+		for (unsigned int i = 0; i < entry.vertexCount; i++) {
+			cVector3d p = mesh->m_vertices->getLocalPos(i);
+			floats.push_back((float)p.x()); floats.push_back((float)p.y()); floats.push_back((float)p.z());
+		}
+		for (unsigned int i = 0; i < entry.vertexCount; i++) {
+			cVector3d n = mesh->m_vertices->getNormal(i);
+			floats.push_back((float)n.x()); floats.push_back((float)n.y()); floats.push_back((float)n.z());
+		}
+		for (unsigned int i = 0; i < entry.vertexCount; i++) {
+			cVector3d t = mesh->m_vertices->getTexCoord(i);
+			floats.push_back((float)t.x()); floats.push_back((float)t.y());
+		}
+		indices.clear();
+		indices.reserve(entry.triangleCount * 3);
+		for (unsigned int i = 0; i < entry.triangleCount; i++) {
+			indices.push_back(mesh->m_triangles->getVertexIndex0(i));
+			indices.push_back(mesh->m_triangles->getVertexIndex1(i));
+			indices.push_back(mesh->m_triangles->getVertexIndex2(i));
+		}
+
+		ok = fwrite(&entry, sizeof(entry), 1, f) == 1
+			&& (floats.empty() || fwrite(&floats[0], sizeof(float), floats.size(), f) == floats.size())
+			&& (indices.empty() || fwrite(&indices[0], sizeof(uint32_t), indices.size(), f) == indices.size());
+	}
+	ok = (fclose(f) == 0) && ok;
+
+	if (ok) {
+		remove(cachePath.c_str());
+		ok = rename(tempPath.c_str(), cachePath.c_str()) == 0;
+	}
+	if (!ok) {
+		remove(tempPath.c_str());
+	}
+	return ok;
+}
+
+// Fills an empty model from a mapped cache file. Fails without touching the
+// model if the file is truncated.
+bool readMeshCache(cMultiMesh* model, const MappedFile& cache) {
+	const unsigned char* p = cache.data();
+	const unsigned char* end = p + cache.size();
+	const MeshCacheHeader* header = (const MeshCacheHeader*)p;
+	p += sizeof(MeshCacheHeader);
+
+	// Validate every block before creating any mesh
+	const unsigned char* scan = p;
+	for (uint32_t m = 0; m < header->meshCount; m++) {
+		if ((size_t)(end - scan) < sizeof(MeshCacheEntry)) return false;
+		const MeshCacheEntry* entry = (const MeshCacheEntry*)scan;
+		size_t payload = (size_t)entry->vertexCount * 8 * sizeof(float) + (size_t)entry->triangleCount * 3 * sizeof(uint32_t);
+		scan += sizeof(MeshCacheEntry);
+		if ((size_t)(end - scan) < payload) return false;
+		scan += payload;
+	}
+
+	for (uint32_t m = 0; m < header->meshCount; m++) {
+		const MeshCacheEntry* entry = (const MeshCacheEntry*)p;
+		p += sizeof(MeshCacheEntry);
+		const float* positions = (const float*)p;
+		const float* normals = positions + entry->vertexCount * 3;
+		const float* texCoords = normals + entry->vertexCount * 3;
+		const uint32_t* indices = (const uint32_t*)(texCoords + entry->vertexCount * 2);
+		p = (const unsigned char*)(indices + entry->triangleCount * 3);
+
+		cMesh* mesh = model->newMesh();
+		for (uint32_t i = 0; i < entry->vertexCount; i++) {
+			mesh->newVertex(cVector3d(positions[3 * i], positions[3 * i + 1], positions[3 * i + 2]),
+				cVector3d(normals[3 * i], normals[3 * i + 1], normals[3 * i + 2]),
+				cVector3d(texCoords[2 * i], texCoords[2 * i + 1], 0.0));
+		}
+		for (uint32_t i = 0; i < entry->triangleCount; i++) {
+			mesh->newTriangle(indices[3 * i], indices[3 * i + 1], indices[3 * i + 2]);
+		}
+
+		mesh->m_material->m_ambient.set(entry->ambient[0], entry->ambient[1], entry->ambient[2], entry->ambient[3]);
+		mesh->m_material->m_diffuse.set(entry->diffuse[0], entry->diffuse[1], entry->diffuse[2], entry->diffuse[3]);
+		mesh->m_material->m_specular.set(entry->specular[0], entry->specular[1], entry->specular[2], entry->specular[3]);
+		mesh->m_material->m_emission.set(entry->emission[0], entry->emission[1], entry->emission[2], entry->emission[3]);
+		mesh->m_material->setShininess((unsigned int)entry->shininess);
+	}
+	model->computeBoundaryBox(true);
+	return true;
+}
+
+enum MeshLoadSource { MESH_LOAD_FAILED, MESH_LOAD_OBJ, MESH_LOAD_CACHE };
+
+// True if an open cache was built from the source described by stamp. The
+// cache matches when the source size and mtime match, or when only the mtime
+// changed but the content hash still matches (a touched file); restamp is set
+// in that case. stamp.reserved must match too (the LOD ratio for LOD caches).
+bool meshCacheMatches(const MappedFile& cache, const string& path, MeshCacheHeader& stamp, bool& restamp) {
+	restamp = false;
+	if (cache.size() < sizeof(MeshCacheHeader)) return false;
+	const MeshCacheHeader* header = (const MeshCacheHeader*)cache.data();
+	if (header->magic != MESH_CACHE_MAGIC || header->version != MESH_CACHE_VERSION
+		|| header->sourceSize != stamp.sourceSize || header->reserved != stamp.reserved) {
+		return false;
+	}
+	if (header->sourceMtime == stamp.sourceMtime) return true;
+	if (stamp.sourceHash == 0) {
+		stamp.sourceHash = hashFile(path);
+	}
+	restamp = stamp.sourceHash == header->sourceHash;
+	return restamp;
+}
+
+// Same content, new mtime: record it so the next launch skips the hash
+void restampMeshCache(MappedFile& cache, const string& cachePath, const MeshCacheHeader& stamp) {
+	MeshCacheHeader updated = *(const MeshCacheHeader*)cache.data();
+	updated.sourceMtime = stamp.sourceMtime;
+	cache.close();
+	FILE* f = fopen(cachePath.c_str(), "r+b");
+	if (f != nullptr) {
+		fwrite(&updated, sizeof(updated), 1, f);
+		fclose(f);
+	}
+}
+
+// Loads an OBJ through its binary cache; a stale or missing cache is rebuilt
+// from the parsed OBJ. prepare runs on a freshly parsed model before it is
+// cached, and variant (stored in header.reserved) names what it did, so a
+// cache hit skips it.
+MeshLoadSource loadMeshCached(cMultiMesh* model, const string& path, uint32_t variant = 0,
+	const std::function<void(cMultiMesh*)>& prepare = nullptr) {
+	MeshCacheHeader stamp;
+	memset(&stamp, 0, sizeof(stamp));
+	stamp.reserved = variant;
+	if (!getFileStamp(path, stamp.sourceSize, stamp.sourceMtime)) {
+		if (!model->loadFromFile(path)) return MESH_LOAD_FAILED;
+		if (prepare) prepare(model);
+		return MESH_LOAD_OBJ;
+	}
+
+	string cachePath = path + ".cache";
+	MappedFile cache;
+	bool restamp;
+	if (cache.open(cachePath) && meshCacheMatches(cache, path, stamp, restamp) && readMeshCache(model, cache)) {
+		if (restamp) {
+			restampMeshCache(cache, cachePath, stamp);
+		}
+		return MESH_LOAD_CACHE;
+	}
+	cache.close();
+
+	if (!model->loadFromFile(path)) {
+		return MESH_LOAD_FAILED;
+	}
+	if (prepare) {
+		prepare(model);
+	}
+	if (stamp.sourceHash == 0) {
+		stamp.sourceHash = hashFile(path);
+	}
+	if (!writeMeshCache(model, cachePath, stamp)) {
+		cout << "Warning - could not write mesh cache " << cachePath << endl;
+	}
+	return MESH_LOAD_OBJ;
+}
+
+//------------------------------------------------------------------------------
+// MESH OPTIMIZER
+//------------------------------------------------------------------------------
+
+// Post-load pass over a model: submeshes that share a material are merged
+// into one mesh, identical vertices are welded, and triangles are reordered
+// for the post-transform vertex cache (Forsyth's linear-speed ordering), with
+// vertices renumbered in first-use order to match.
+struct MeshOptimizeStats {
+	unsigned int vertices[2];   // before, after
+	unsigned int indices[2];
+	unsigned int drawCalls[2];  // non-empty meshes
+	double acmr[2];             // average cache misses per triangle, 32-entry FIFO
+	double ms;
+};
+
+// Flat copy of a group of submeshes being merged
+struct MeshBuffer {
+	std::vector<cVector3d> positions;
+	std::vector<cVector3d> normals;
+	std::vector<cVector3d> texCoords;
+	std::vector<unsigned int> indices;
+	cMesh* material;  // first mesh of the group, its material is kept
+};
+
+const int VERTEX_CACHE_SIZE = 32;
+
+// Misses per triangle of a FIFO vertex cache; 3.0 is the worst, about 0.5 is
+// the best a regular grid can do
+double averageCacheMissRatio(const std::vector<unsigned int>& indices) {
+	if (indices.empty()) return 0.0;
+	int fifo[VERTEX_CACHE_SIZE];
+	for (int i = 0; i < VERTEX_CACHE_SIZE; i++) fifo[i] = -1;
+	int head = 0;
+	unsigned int misses = 0;
+	for (size_t i = 0; i < indices.size(); i++) {
+		bool hit = false;
+		for (int k = 0; k < VERTEX_CACHE_SIZE && !hit; k++) hit = fifo[k] == (int)indices[i];
+		if (!hit) {
+			fifo[head] = (int)indices[i];
+			head = (head + 1) % VERTEX_CACHE_SIZE;
+			misses++;
+		}
+	}
+	return misses / (indices.size() / 3.0);
+}
+
+bool sameMaterial(cMesh* a, cMesh* b) {
+	const cMaterial& x = *a->m_material;
+	const cMaterial& y = *b->m_material;
+	const cColorf* cx[4] = { &x.m_ambient, &x.m_diffuse, &x.m_specular, &x.m_emission };
+	const cColorf* cy[4] = { &y.m_ambient, &y.m_diffuse, &y.m_specular, &y.m_emission };
+	for (int i = 0; i < 4; i++) {
+		if (cx[i]->getR() != cy[i]->getR() || cx[i]->getG() != cy[i]->getG()
+			|| cx[i]->getB() != cy[i]->getB() || cx[i]->getA() != cy[i]->getA()) {
+			return false;
+		}
+	}
+	return x.getShininess() == y.getShininess() && a->m_texture == b->m_texture;
+}
+
+// Keeps the first copy of every vertex whose position, normal and texture
+// coordinate are all bit-identical
+void weldVertices(MeshBuffer& mesh) {
+	struct Key {
+		double v[8];
+		bool operator==(const Key& other) const { return memcmp(v, other.v, sizeof(v)) == 0; }
+	};
+	struct KeyHash {
+		size_t operator()(const Key& key) const { return (size_t)fnv1a64((const unsigned char*)key.v, sizeof(key.v)); }
+	};
+
+	std::unordered_map<Key, unsigned int, KeyHash> unique;
+	std::vector<unsigned int> remap(mesh.positions.size());
+	MeshBuffer welded;
+	for (size_t i = 0; i < mesh.positions.size(); i++) {
+		Key key;
+		const cVector3d& p = mesh.positions[i];
+		const cVector3d& n = mesh.normals[i];
+		const cVector3d& t = mesh.texCoords[i];
+		double values[8] = { p.x(), p.y(), p.z(), n.x(), n.y(), n.z(), t.x(), t.y() };
+		memcpy(key.v, values, sizeof(values));
+		std::pair<std::unordered_map<Key, unsigned int, KeyHash>::iterator, bool> inserted =
+			unique.insert(std::make_pair(key, (unsigned int)welded.positions.size()));
+		if (inserted.second) {
+			welded.positions.push_back(p);
+			welded.normals.push_back(n);
+			welded.texCoords.push_back(t);
+		}
+		remap[i] = inserted.first->second;
+	}
+	for (size_t i = 0; i < mesh.indices.size(); i++) {
+		mesh.indices[i] = remap[mesh.indices[i]];
+	}
+	mesh.positions.swap(welded.positions);
+	mesh.normals.swap(welded.normals);
+	mesh.texCoords.swap(welded.texCoords);
+}
+
+// Vertex score from Forsyth, "Linear-Speed Vertex Cache Optimisation": the
+// three most recent vertices score a flat 0.75 so the next triangle does not
+// simply reuse the last one's edge, older entries decay with their position,
+// and vertices with few triangles left get a boost so they are finished off.
+float forsythVertexScore(int cachePosition, int remaining) {
+	if (remaining == 0) return -1.0f;
+	float score = 0.0f;
+	if (cachePosition >= 0) {
+		if (cachePosition < 3) {
+			score = 0.75f;
+		}
+		else {
+			float scaled = 1.0f - (cachePosition - 3) / (float)(VERTEX_CACHE_SIZE - 3);
+			score = powf(scaled, 1.5f);
+		}
+	}
+	return score + 2.0f / sqrtf((float)remaining);
+}
+
+void reorderForVertexCache(MeshBuffer& mesh) {
+	const size_t vertexCount = mesh.positions.size();
+	const size_t triangleCount = mesh.indices.size() / 3;
+	if (triangleCount == 0) return;
+
+	// triangles of each vertex, as offsets into one array
+	std::vector<unsigned int> remaining(vertexCount, 0);
+	for (size_t i = 0; i < mesh.indices.size(); i++) remaining[mesh.indices[i]]++;
+	std::vector<unsigned int> firstFace(vertexCount + 1, 0);
+	for (size_t v = 0; v < vertexCount; v++) firstFace[v + 1] = firstFace[v] + remaining[v];
+	std::vector<unsigned int> faceList(mesh.indices.size());
+	std::vector<unsigned int> filled(vertexCount, 0);
+	for (size_t t = 0; t < triangleCount; t++) {
+		for (int k = 0; k < 3; k++) {
+			unsigned int v = mesh.indices[3 * t + k];
+			faceList[firstFace[v] + filled[v]++] = (unsigned int)t;
+		}
+	}
+
+	std::vector<int> cachePosition(vertexCount, -1);
+	std::vector<float> vertexScore(vertexCount);
+	for (size_t v = 0; v < vertexCount; v++) vertexScore[v] = forsythVertexScore(-1, remaining[v]);
+	std::vector<float> faceScore(triangleCount);
+	std::vector<bool> emitted(triangleCount, false);
+	for (size_t t = 0; t < triangleCount; t++) {
+		faceScore[t] = vertexScore[mesh.indices[3 * t]] + vertexScore[mesh.indices[3 * t + 1]] + vertexScore[mesh.indices[3 * t + 2]];
+	}
+
+	std::vector<unsigned int> cache;  // most recent first
+	std::vector<unsigned int> ordered;
+	ordered.reserve(mesh.indices.size());
+	size_t scanFrom = 0;
+	int best = -1;
+	for (size_t n = 0; n < triangleCount; n++) {
+		// nothing in the cache to continue from: take the best unused triangle
+		if (best < 0) {
+			float bestScore = -1.0f;
+			for (size_t t = scanFrom; t < triangleCount; t++) {
+				if (!emitted[t] && faceScore[t] > bestScore) {
+					bestScore = faceScore[t];
+					best = (int)t;
+				}
+			}
+			while (scanFrom < triangleCount && emitted[scanFrom]) scanFrom++;
+		}
+
+		emitted[best] = true;
+		std::vector<unsigned int> next;
+		next.reserve(VERTEX_CACHE_SIZE + 3);
+		for (int k = 0; k < 3; k++) {
+			unsigned int v = mesh.indices[3 * best + k];
+			ordered.push_back(v);
+			next.push_back(v);
+			// drop the triangle from the vertex's list
+			unsigned int* faces = &faceList[firstFace[v]];
+			for (unsigned int i = 0; i < remaining[v]; i++) {
+				if (faces[i] == (unsigned int)best) {
+					faces[i] = faces[remaining[v] - 1];
+					break;
+				}
+			}
+			remaining[v]--;
+		}
+		for (size_t i = 0; i < cache.size(); i++) {
+			unsigned int v = cache[i];
+			if (v != next[0] && v != next[1] && v != next[2]) next.push_back(v);
+		}
+
+		// rescore what is in the cache and what fell out of it
+		for (size_t i = 0; i < next.size(); i++) {
+			cachePosition[next[i]] = (i < (size_t)VERTEX_CACHE_SIZE) ? (int)i : -1;
+		}
+		for (size_t i = 0; i < next.size(); i++) {
+			unsigned int v = next[i];
+			float score = forsythVertexScore(cachePosition[v], remaining[v]);
+			float delta = score - vertexScore[v];
+			vertexScore[v] = score;
+			for (unsigned int f = 0; f < remaining[v]; f++) {
+				faceScore[faceList[firstFace[v] + f]] += delta;
+			}
+		}
+		if (next.size() > (size_t)VERTEX_CACHE_SIZE) next.resize(VERTEX_CACHE_SIZE);
+		cache.swap(next);
+
+		// continue with the best triangle touching the cache
+		best = -1;
+		float bestScore = -1.0f;
+		for (size_t i = 0; i < cache.size(); i++) {
+			unsigned int v = cache[i];
+			for (unsigned int f = 0; f < remaining[v]; f++) {
+				unsigned int t = faceList[firstFace[v] + f];
+				if (faceScore[t] > bestScore) {
+					bestScore = faceScore[t];
+					best = (int)t;
+				}
+			}
+		}
+	}
+
+	// renumber vertices in the order the triangles first use them
+	std::vector<int> remap(vertexCount, -1);
+	MeshBuffer sorted;
+	for (size_t i = 0; i < ordered.size(); i++) {
+		unsigned int v = ordered[i];
+		if (remap[v] < 0) {
+			remap[v] = (int)sorted.positions.size();
+			sorted.positions.push_back(mesh.positions[v]);
+			sorted.normals.push_back(mesh.normals[v]);
+			sorted.texCoords.push_back(mesh.texCoords[v]);
+		}
+		ordered[i] = (unsigned int)remap[v];
+	}
+	mesh.positions.swap(sorted.positions);
+	mesh.normals.swap(sorted.normals);
+	mesh.texCoords.swap(sorted.texCoords);
+	mesh.indices.swap(ordered);
+}
+
+// Rebuilds the meshes of a model in place. With sharedMaterial every
+// submesh is merged into one, for models that get a single material and
+// texture afterwards (the weapons); otherwise only submeshes with equal
+// material and texture are merged.
+MeshOptimizeStats optimizeModel(cMultiMesh* model, bool sharedMaterial) {
+	MeshOptimizeStats stats;
+	memset(&stats, 0, sizeof(stats));
+	long long startNs = monotonicNs();
+
+	std::vector<MeshBuffer> groups;
+	std::vector<unsigned int> allIndices;
+	for (int m = 0; m < model->getNumMeshes(); m++) {
+		cMesh* mesh = model->getMesh(m);
+		unsigned int vertexCount = mesh->getNumVertices();
+		unsigned int triangleCount = mesh->getNumTriangles();
+		if (triangleCount == 0) continue;
+
+		stats.vertices[0] += vertexCount;
+		stats.indices[0] += triangleCount * 3;
+		stats.drawCalls[0]++;
+
+		size_t g = 0;
+		while (g < groups.size() && !(sharedMaterial || sameMaterial(groups[g].material, mesh))) g++;
+		if (g == groups.size()) {
+			groups.push_back(MeshBuffer());
+			groups.back().material = mesh;
+		}
+		MeshBuffer& group = groups[g];
+		unsigned int base = (unsigned int)group.positions.size();
+		for (unsigned int i = 0; i < vertexCount; i++) {
+			group.positions.push_back(mesh->m_vertices->getLocalPos(i));
+			group.normals.push_back(mesh->m_vertices->getNormal(i));
+			group.texCoords.push_back(mesh->m_vertices->getTexCoord(i));
+		}
+		for (unsigned int i = 0; i < triangleCount; i++) {
+			unsigned int tri[3] = { mesh->m_triangles->getVertexIndex0(i), mesh->m_triangles->getVertexIndex1(i),
+				mesh->m_triangles->getVertexIndex2(i) };
+			for (int k = 0; k < 3; k++) {
+				group.indices.push_back(base + tri[k]);
+				allIndices.push_back(stats.vertices[0] - vertexCount + tri[k]);
+			}
+		}
+	}
+	stats.acmr[0] = averageCacheMissRatio(allIndices);
+
+	// materials are copied out before the old meshes go away
+	std::vector<cMaterialPtr> materials;
+	std::vector<cTexture1dPtr> textures;
+	for (size_t g = 0; g < groups.size(); g++) {
+		materials.push_back(groups[g].material->m_material);
+		textures.push_back(groups[g].material->m_texture);
+	}
+	model->deleteAllMeshes();
+
+	allIndices.clear();
+	for (size_t g = 0; g < groups.size(); g++) {
+		MeshBuffer& group = groups[g];
+		weldVertices(group);
+		reorderForVertexCache(group);
+
+		cMesh* mesh = model->newMesh();
+		for (size_t i = 0; i < group.positions.size(); i++) {
+			mesh->newVertex(group.positions[i], group.normals[i], group.texCoords[i]);
+		}
+		for (size_t i = 0; i < group.indices.size(); i += 3) {
+			mesh->newTriangle(group.indices[i], group.indices[i + 1], group.indices[i + 2]);
+		}
+		mesh->m_material = materials[g];
+		if (textures[g]) {
+			mesh->setTexture(textures[g]);
+		}
+
+		for (size_t i = 0; i < group.indices.size(); i++) {
+			allIndices.push_back(stats.vertices[1] + group.indices[i]);
+		}
+		stats.vertices[1] += (unsigned int)group.positions.size();
+		stats.indices[1] += (unsigned int)group.indices.size();
+		stats.drawCalls[1]++;
+	}
+	stats.acmr[1] = averageCacheMissRatio(allIndices);
+	model->computeBoundaryBox(true);
+
+	stats.ms = (monotonicNs() - startNs) / 1e6;
+	return stats;
+}
+
+void printMeshOptimizeReport(const string& name, const MeshOptimizeStats& stats) {
+	if (stats.drawCalls[0] == 0) {
+		printf("Mesh optimizer %s: loaded optimized from the mesh cache\n", name.c_str());
+		return;
+	}
+	printf("Mesh optimizer %s: vertices %u -> %u, indices %u -> %u, draw calls %u -> %u, ACMR %.2f -> %.2f (%.1f ms)\n",
+		name.c_str(), stats.vertices[0], stats.vertices[1], stats.indices[0], stats.indices[1],
+		stats.drawCalls[0], stats.drawCalls[1], stats.acmr[0], stats.acmr[1], stats.ms);
+}
+
+MeshOptimizeStats weaponMeshStats[3];  // indexed by WeaponType, printed once the scene is built
+
+bool meshCacheReport = false;  // see --mesh-cache-report
+
+// Times a cold OBJ parse against the cached path for every model the game loads
+void printMeshCacheReport() {
+	// the weapons are cached optimized, as loadWeaponModel stores them
+	const char* assets[] = { "../resources/1911.obj", "../resources/dragunov.obj",
+		"../resources/ak47.obj", "../resources/FinalBaseMesh.obj" };
+	const bool optimized[] = { true, true, true, false };
+	auto optimize = [](cMultiMesh* model) { optimizeModel(model, true); };
+
+	cout << "Mesh cache report" << endl;
+	cout << "  model                               triangles     obj ms   cache ms" << endl;
+	for (size_t i = 0; i < sizeof(assets) / sizeof(assets[0]); i++) {
+		string path = RESOURCE_PATH(assets[i]);
+
+		cMultiMesh* cold = new cMultiMesh();
+		long long start = monotonicNs();
+		bool parsed = cold->loadFromFile(path);
+		double objMs = (monotonicNs() - start) / 1e6;
+		unsigned int triangles = cold->getNumTriangles();
+		delete cold;
+		if (!parsed) {
+			printf("  %-34s   not found\n", assets[i]);
+			continue;
+		}
+
+		// First call makes sure the cache exists, the second one is timed
+		cMultiMesh* warm = new cMultiMesh();
+		uint32_t variant = optimized[i] ? MESH_CACHE_OPTIMIZED : 0;
+		std::function<void(cMultiMesh*)> prepare = optimized[i] ? optimize : std::function<void(cMultiMesh*)>();
+		loadMeshCached(warm, path, variant, prepare);
+		delete warm;
+		warm = new cMultiMesh();
+		start = monotonicNs();
+		MeshLoadSource source = loadMeshCached(warm, path, variant, prepare);
+		double cacheMs = (monotonicNs() - start) / 1e6;
+		delete warm;
+
+		printf("  %-34s %11u %10.2f %10.2f%s\n", assets[i], triangles, objMs, cacheMs,
+			(source == MESH_LOAD_CACHE) ? "" : "  (cache not used)");
+	}
+}
+
+//------------------------------------------------------------------------------
+// MESH LOD
+//------------------------------------------------------------------------------
+
+// Quadric error metric of one vertex: the sum of squared distances to the
+// planes of its faces, as the upper half of a symmetric 4x4 matrix
+struct Quadric {
+	double q[10];  // aa ab ac ad bb bc bd cc cd dd
+
+	Quadric() { for (int i = 0; i < 10; i++) q[i] = 0.0; }
+
+	void addPlane(const cVector3d& n, double d, double weight) {
+		double a = n.x(), b = n.y(), c = n.z();
+		q[0] += weight * a * a; q[1] += weight * a * b; q[2] += weight * a * c; q[3] += weight * a * d;
+		q[4] += weight * b * b; q[5] += weight * b * c; q[6] += weight * b * d;
+		q[7] += weight * c * c; q[8] += weight * c * d;
+		q[9] += weight * d * d;
+	}
+
+	void add(const Quadric& other) {
+		for (int i = 0; i < 10; i++) q[i] += other.q[i];
+	}
+
+	double error(const cVector3d& p) const {
+		double x = p.x(), y = p.y(), z = p.z();
+		return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x
+			+ q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y
+			+ q[7] * z * z + 2 * q[8] * z
+			+ q[9];
+	}
+};
+
+// Builds a reduced copy of a mesh with about ratio of its triangles by greedy
+// edge collapse, cheapest quadric error first. A collapse moves one end of the
+// edge onto the other, so surviving vertices keep their own normal and texture
+// coordinate. Vertices on open edges (mesh borders and texture seams, where
+// welding leaves split vertices) never move, and collapses that would flip a
+// face are skipped, so a mesh may stop above the requested size.
+void simplifyMesh(cMesh* source, cMesh* target, double ratio) {
+	const unsigned int vertexCount = source->getNumVertices();
+	const unsigned int triangleCount = source->getNumTriangles();
+
+	std::vector<cVector3d> positions(vertexCount);
+	for (unsigned int i = 0; i < vertexCount; i++) {
+		positions[i] = source->m_vertices->getLocalPos(i);
+	}
+	std::vector<unsigned int> tris(triangleCount * 3);
+	for (unsigned int i = 0; i < triangleCount; i++) {
+		tris[3 * i] = source->m_triangles->getVertexIndex0(i);
+		tris[3 * i + 1] = source->m_triangles->getVertexIndex1(i);
+		tris[3 * i + 2] = source->m_triangles->getVertexIndex2(i);
+	}
+
+	// face quadrics, vertex to face lists and open edges
+	std::vector<Quadric> quadrics(vertexCount);
+	std::vector<std::vector<unsigned int> > faces(vertexCount);
+	std::unordered_map<uint64_t, int> edgeUse;
+	for (unsigned int t = 0; t < triangleCount; t++) {
+		const unsigned int* v = &tris[3 * t];
+		cVector3d n = cCross(positions[v[1]] - positions[v[0]], positions[v[2]] - positions[v[0]]);
+		double area = n.length();
+		if (area > 0.0) {
+			n /= area;
+			for (int k = 0; k < 3; k++) {
+				quadrics[v[k]].addPlane(n, -cDot(n, positions[v[0]]), area);
+			}
+		}
+		for (int k = 0; k < 3; k++) {
+			faces[v[k]].push_back(t);
+			unsigned int a = cMin(v[k], v[(k + 1) % 3]), b = cMax(v[k], v[(k + 1) % 3]);
+			edgeUse[((uint64_t)a << 32) | b]++;
+		}
+	}
+	std::vector<bool> locked(vertexCount, false);
+	for (std::unordered_map<uint64_t, int>::iterator it = edgeUse.begin(); it != edgeUse.end(); ++it) {
+		if (it->second == 1) {
+			locked[(unsigned int)(it->first >> 32)] = true;
+			locked[(unsigned int)(it->first & 0xFFFFFFFFu)] = true;
+		}
+	}
+
+	// candidate collapses; entries go stale when either vertex changes
+	struct Collapse {
+		double cost;
+		unsigned int from, to;
+		unsigned int fromStamp, toStamp;
+		bool operator<(const Collapse& other) const { return cost > other.cost; }
+	};
+	std::vector<unsigned int> stamps(vertexCount, 0);
+	std::vector<bool> removed(vertexCount, false);
+	std::vector<bool> deadFace(triangleCount, false);
+	std::priority_queue<Collapse> heap;
+	auto consider = [&](unsigned int from, unsigned int to) {
+		if (locked[from]) return;
+		Quadric merged = quadrics[from];
+		merged.add(quadrics[to]);
+		Collapse c = { merged.error(positions[to]), from, to, stamps[from], stamps[to] };
+		heap.push(c);
+	};
+	for (std::unordered_map<uint64_t, int>::iterator it = edgeUse.begin(); it != edgeUse.end(); ++it) {
+		unsigned int a = (unsigned int)(it->first >> 32), b = (unsigned int)(it->first & 0xFFFFFFFFu);
+		consider(a, b);
+		consider(b, a);
+	}
+
+	unsigned int liveFaces = triangleCount;
+	unsigned int targetFaces = (unsigned int)(triangleCount * ratio);
+	while (liveFaces > targetFaces && !heap.empty()) {
+		Collapse c = heap.top();
+		heap.pop();
+		if (removed[c.from] || removed[c.to] || stamps[c.from] != c.fromStamp || stamps[c.to] != c.toStamp) {
+			continue;
+		}
+
+		// reject collapses that turn a remaining face over
+		bool flips = false;
+		for (size_t i = 0; i < faces[c.from].size() && !flips; i++) {
+			unsigned int t = faces[c.from][i];
+			unsigned int* v = &tris[3 * t];
+			if (deadFace[t] || v[0] == c.to || v[1] == c.to || v[2] == c.to) continue;
+			cVector3d p[3], moved[3];
+			for (int k = 0; k < 3; k++) {
+				p[k] = positions[v[k]];
+				moved[k] = (v[k] == c.from) ? positions[c.to] : p[k];
+			}
+			cVector3d before = cCross(p[1] - p[0], p[2] - p[0]);
+			cVector3d after = cCross(moved[1] - moved[0], moved[2] - moved[0]);
+			flips = cDot(before, after) <= 0.0;
+		}
+		if (flips) continue;
+
+		for (size_t i = 0; i < faces[c.from].size(); i++) {
+			unsigned int t = faces[c.from][i];
+			unsigned int* v = &tris[3 * t];
+			if (deadFace[t]) continue;
+			if (v[0] == c.to || v[1] == c.to || v[2] == c.to) {
+				deadFace[t] = true;
+				liveFaces--;
+				continue;
+			}
+			for (int k = 0; k < 3; k++) {
+				if (v[k] == c.from) v[k] = c.to;
+			}
+			faces[c.to].push_back(t);
+		}
+		removed[c.from] = true;
+		quadrics[c.to].add(quadrics[c.from]);
+		stamps[c.to]++;
+
+		for (size_t i = 0; i < faces[c.to].size(); i++) {
+			unsigned int t = faces[c.to][i];
+			if (deadFace[t]) continue;
+			for (int k = 0; k < 3; k++) {
+				unsigned int w = tris[3 * t + k];
+				if (w != c.to) {
+					consider(w, c.to);
+					consider(c.to, w);
+				}
+			}
+		}
+	}
+
+	// copy the surviving faces and the vertices they use
+	std::vector<int> remap(vertexCount, -1);
+	for (unsigned int t = 0; t < triangleCount; t++) {
+		if (deadFace[t]) continue;
+		unsigned int index[3];
+		for (int k = 0; k < 3; k++) {
+			unsigned int v = tris[3 * t + k];
+			if (remap[v] < 0) {
+				remap[v] = target->newVertex(positions[v], source->m_vertices->getNormal(v), source->m_vertices->getTexCoord(v));
+			}
+			index[k] = (unsigned int)remap[v];
+		}
+		target->newTriangle(index[0], index[1], index[2]);
+	}
+
+	target->m_material->m_ambient = source->m_material->m_ambient;
+	target->m_material->m_diffuse = source->m_material->m_diffuse;
+	target->m_material->m_specular = source->m_material->m_specular;
+	target->m_material->m_emission = source->m_material->m_emission;
+	target->m_material->setShininess(source->m_material->getShininess());
+}
+
+// Reduced versions of a weapon model, finest first. Level 0 is the loaded
+// model itself; the others are drawn in its place when it is small on screen.
+const int WEAPON_LOD_COUNT = 3;
+const double WEAPON_LOD_RATIOS[WEAPON_LOD_COUNT] = { 1.0, 0.4, 0.15 };
+// Level k is used below this projected height in pixels (level 0 has none)
+const double WEAPON_LOD_PIXELS[WEAPON_LOD_COUNT] = { 0.0, 240.0, 90.0 };
+// Band around each threshold the projected size must cross before switching
+const double WEAPON_LOD_HYSTERESIS = 0.15;
+// Bumped when the model the levels are reduced from changes shape (2: optimized)
+const uint32_t WEAPON_LOD_REVISION = 2;
+
+struct WeaponLods {
+	cMultiMesh* levels[WEAPON_LOD_COUNT];
+	int current;
+	double radius;  // bounding sphere radius of the scaled model
+
+	WeaponLods() : current(0), radius(0.0) {
+		for (int i = 0; i < WEAPON_LOD_COUNT; i++) levels[i] = nullptr;
+	}
+
+	// Moves at most as far as the size allows, crossing each threshold by
+	// the hysteresis band so a weapon at the boundary does not flicker
+	int select(double pixels) {
+		while (current + 1 < WEAPON_LOD_COUNT && levels[current + 1] != nullptr
+			&& pixels < WEAPON_LOD_PIXELS[current + 1] * (1.0 - WEAPON_LOD_HYSTERESIS)) {
+			current++;
+		}
+		while (current > 0 && pixels > WEAPON_LOD_PIXELS[current] * (1.0 + WEAPON_LOD_HYSTERESIS)) {
+			current--;
+		}
+		return current;
+	}
+};
+
+WeaponLods weaponLods[3];  // indexed by WeaponType
+double lodScale = 1.0;     // see --lod-scale
+
+// Loads LOD level of an OBJ from <file>.lod<level>.cache, or simplifies the
+// full model and writes that cache. LOD caches share the mesh cache format
+// and freshness rules, with the ratio and revision in the header so a new
+// ratio or reduction rebuilds.
+MeshLoadSource loadLodCached(cMultiMesh* lod, cMultiMesh* full, const string& path, int level) {
+	MeshCacheHeader stamp;
+	memset(&stamp, 0, sizeof(stamp));
+	stamp.reserved = (uint32_t)(WEAPON_LOD_RATIOS[level] * 1000.0 + 0.5) | (WEAPON_LOD_REVISION << 16);
+	bool stamped = getFileStamp(path, stamp.sourceSize, stamp.sourceMtime);
+
+	string cachePath = path + ".lod" + std::to_string(level) + ".cache";
+	MappedFile cache;
+	bool restamp;
+	if (stamped && cache.open(cachePath) && meshCacheMatches(cache, path, stamp, restamp) && readMeshCache(lod, cache)) {
+		if (restamp) {
+			restampMeshCache(cache, cachePath, stamp);
+		}
+		return MESH_LOAD_CACHE;
+	}
+	cache.close();
+
+	for (int m = 0; m < full->getNumMeshes(); m++) {
+		simplifyMesh(full->getMesh(m), lod->newMesh(), WEAPON_LOD_RATIOS[level]);
+	}
+	lod->computeBoundaryBox(true);
+	if (stamped) {
+		if (stamp.sourceHash == 0) {
+			stamp.sourceHash = hashFile(path);
+		}
+		if (!writeMeshCache(lod, cachePath, stamp)) {
+			cout << "Warning - could not write mesh cache " << cachePath << endl;
+		}
+	}
+	return MESH_LOAD_OBJ;
+}
+
+//------------------------------------------------------------------------------
+// COLLISION PROXIES
+//------------------------------------------------------------------------------
+
+// Weapon models and their scale, indexed by WeaponType
+struct WeaponModelFile {
+	const char* file;
+	double scale;
+};
+const WeaponModelFile WEAPON_MODELS[3] = { { "1911.obj", 0.01 }, { "ak47.obj", 0.3 }, { "dragunov.obj", 0.007 } };
+
+// Boxes per proxy; weapons are long and thin, so slabs along the barrel fit well
+const int WEAPON_PROXY_BOXES = 6;
+
+cMultiMesh* weaponProxies[3] = { nullptr, nullptr, nullptr };  // indexed by WeaponType, --contact-bench only
+int contactBenchTicks = 0;  // see --contact-bench
+
+// Coarse stand-in for a model in haptic contact: the model is cut into slabs
+// along its longest axis and each slab is covered by the box around its
+// vertices, giving 12 triangles per box instead of the full surface. Built
+// in the model's frame, so it takes the model's pose directly. The weapons
+// are display-only in play, so only --contact-bench builds and uses these.
+cMultiMesh* buildCollisionProxy(cMultiMesh* model, int boxCount) {
+	cMultiMesh* proxy = new cMultiMesh();
+	cMesh* boxes = proxy->newMesh();
+
+	model->computeBoundaryBox(true);
+	cVector3d lo = model->getBoundaryMin();
+	cVector3d hi = model->getBoundaryMax();
+	cVector3d extent = hi - lo;
+	int axis = 0;
+	for (int k = 1; k < 3; k++) {
+		if (extent(k) > extent(axis)) axis = k;
+	}
+
+	std::vector<cVector3d> slabMin(boxCount, cVector3d(1e30, 1e30, 1e30));
+	std::vector<cVector3d> slabMax(boxCount, cVector3d(-1e30, -1e30, -1e30));
+	for (int m = 0; m < model->getNumMeshes(); m++) {
+		cMesh* mesh = model->getMesh(m);
+		for (unsigned int i = 0; i < mesh->getNumVertices(); i++) {
+			cVector3d p = mesh->m_vertices->getLocalPos(i);
+			int slab = (extent(axis) > 0.0) ? (int)((p(axis) - lo(axis)) / extent(axis) * boxCount) : 0;
+			slab = cClamp(slab, 0, boxCount - 1);
+			for (int k = 0; k < 3; k++) {
+				slabMin[slab](k) = cMin(slabMin[slab](k), p(k));
+				slabMax[slab](k) = cMax(slabMax[slab](k), p(k));
+			}
+		}
+	}
+
+	// flat slabs still get some thickness so the proxy algorithm has a volume
+	double minSize = 1e-3 * extent.length();
+	for (int b = 0; b < boxCount; b++) {
+		if (slabMin[b](0) > slabMax[b](0)) continue;
+		cVector3d size = slabMax[b] - slabMin[b];
+		for (int k = 0; k < 3; k++) size(k) = cMax(size(k), minSize);
+		cCreateBox(boxes, size(0), size(1), size(2), 0.5 * (slabMin[b] + slabMax[b]));
+	}
+	proxy->computeBoundaryBox(true);
+	return proxy;
+}
+
+//------------------------------------------------------------------------------
+// TEXTURE CACHE
+//------------------------------------------------------------------------------
+
+#ifndef GL_TEXTURE_MAX_LEVEL
+#define GL_TEXTURE_MAX_LEVEL 0x813D
+#endif
+
+// Decoded images are downscaled to at most maxTextureSize on a side, given a
+// full RGBA8 mip chain, and stored as <image>.texcache; later runs map that
+// file and upload the levels directly
+const uint32_t TEXTURE_CACHE_MAGIC = 0x58545248;  // "HRTX"
+const uint32_t TEXTURE_CACHE_VERSION = 1;
+
+int maxTextureSize = 2048;  // see --max-texture-size
+
+struct TextureCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t sourceSize;
+	int64_t sourceMtime;
+	uint64_t sourceHash;
+	uint32_t maxSize;     // limit the chain was built with
+	uint32_t levelCount;
+	uint32_t width;       // level 0
+	uint32_t height;
+};
+
+inline int mipDimension(int size, int level) {
+	return cMax(1, size >> level);
+}
+
+inline size_t mipChainBytes(int width, int height, int levels) {
+	size_t bytes = 0;
+	for (int i = 0; i < levels; i++) {
+		bytes += (size_t)mipDimension(width, i) * mipDimension(height, i) * 4;
+	}
+	return bytes;
+}
+
+inline int mipLevelCount(int width, int height) {
+	int levels = 1;
+	while ((width >> levels) > 0 || (height >> levels) > 0) levels++;
+	return levels;
+}
+
+// 2x2 box filter from an RGBA8 image to one of half its size; odd edges
+// repeat their last row or column
+void halveRgba(const unsigned char* src, int width, int height, unsigned char* dst) {
+	int w = cMax(1, width / 2), h = cMax(1, height / 2);
+	for (int y = 0; y < h; y++) {
+		int y0 = cMin(2 * y, height - 1), y1 = cMin(2 * y + 1, height - 1);
+		for (int x = 0; x < w; x++) {
+			int x0 = cMin(2 * x, width - 1), x1 = cMin(2 * x + 1, width - 1);
+			const unsigned char* a = src + (y0 * width + x0) * 4;
+			const unsigned char* b = src + (y0 * width + x1) * 4;
+			const unsigned char* c = src + (y1 * width + x0) * 4;
+			const unsigned char* d = src + (y1 * width + x1) * 4;
+			unsigned char* out = dst + (y * w + x) * 4;
+			for (int k = 0; k < 4; k++) {
+				out[k] = (unsigned char)((a[k] + b[k] + c[k] + d[k] + 2) / 4);
+			}
+		}
+	}
+}
+
+// 2D texture that uploads a prebuilt mip chain instead of building one on
+// the GPU or with gluBuild2DMipmaps
+class MipChainTexture : public cTexture2d {
+public:
+	int width, height, levelCount;
+	const unsigned char* pixels;            // all levels, largest first
+	std::shared_ptr<MappedFile> mapping;    // cache file backing pixels, or
+	std::vector<unsigned char> storage;     // levels built this run
+
+	MipChainTexture() : width(0), height(0), levelCount(0), pixels(nullptr) {}
+
+	size_t gpuBytes() const { return mipChainBytes(width, height, levelCount); }
+
+	// CHAI3D expects an image on every texture, but update() uploads from
+	// pixels, so a 1x1 stand-in keeps no CPU copy of level 0. Filtering and
+	// wrap go through the setters so renderInitialize() applies ours
+	void attachBaseImage() {
+		cImagePtr base = cImage::create();
+		base->allocate(1, 1, GL_RGBA, GL_UNSIGNED_BYTE);
+		setImage(base);
+		setUseMipmaps(false);
+		setMinFunction(GL_LINEAR_MIPMAP_LINEAR);
+		setMagFunction(GL_LINEAR);
+		setWrapModeS(GL_REPEAT);
+		setWrapModeT(GL_REPEAT);
+	}
+
+protected:
+	virtual void update(cRenderOptions& a_options) {
+		if (m_textureID == 0) {
+			glGenTextures(1, &m_textureID);
+		}
+		glBindTexture(GL_TEXTURE_2D, m_textureID);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+		const unsigned char* level = pixels;
+		for (int i = 0; i < levelCount; i++) {
+			int w = mipDimension(width, i), h = mipDimension(height, i);
+			glTexImage2D(GL_TEXTURE_2D, i, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, level);
+			level += (size_t)w * h * 4;
+		}
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
+	}
+};
+
+typedef std::shared_ptr<MipChainTexture> MipChainTexturePtr;
+
+struct TextureLoadStats {
+	string name;
+	int sourceWidth, sourceHeight;
+	int width, height, levels;
+	size_t gpuBytes;
+	double ms;
+	bool fromCache;
+};
+
+std::mutex textureStatsMutex;
+std::vector<TextureLoadStats> textureStats;
+
+// Decodes the source and builds the downscaled chain into texture->storage
+bool buildMipChain(MipChainTexture* texture, const string& path, int maxSize, int& sourceWidth, int& sourceHeight) {
+	cImagePtr image = cImage::create();
+	if (!image->loadFromFile(path) || !image->convert(GL_RGBA)) return false;
+	sourceWidth = image->getWidth();
+	sourceHeight = image->getHeight();
+	if (sourceWidth == 0 || sourceHeight == 0) return false;
+
+	// Halve until the image fits the size limit
+	std::vector<unsigned char> current(image->getData(), image->getData() + (size_t)sourceWidth * sourceHeight * 4);
+	int w = sourceWidth, h = sourceHeight;
+	while (w > maxSize || h > maxSize) {
+		std::vector<unsigned char> half((size_t)cMax(1, w / 2) * cMax(1, h / 2) * 4);
+		halveRgba(&current[0], w, h, &half[0]);
+		current.swap(half);
+		w = cMax(1, w / 2);
+		h = cMax(1, h / 2);
+	}
+	image.reset();
+
+	texture->width = w;
+	texture->height = h;
+	texture->levelCount = mipLevelCount(w, h);
+	texture->storage.resize(mipChainBytes(w, h, texture->levelCount));
+	memcpy(&texture->storage[0], &current[0], current.size());
+	unsigned char* level = &texture->storage[0];
+	for (int i = 1; i < texture->levelCount; i++) {
+		int pw = mipDimension(w, i - 1), ph = mipDimension(h, i - 1);
+		unsigned char* next = level + (size_t)pw * ph * 4;
+		halveRgba(level, pw, ph, next);
+		level = next;
+	}
+	texture->pixels = &texture->storage[0];
+	return true;
+}
+
+bool writeTextureCache(const MipChainTexture* texture, const string& cachePath, const TextureCacheHeader& stamp) {
+	TextureCacheHeader header = stamp;
+	header.magic = TEXTURE_CACHE_MAGIC;
+	header.version = TEXTURE_CACHE_VERSION;
+	header.levelCount = texture->levelCount;
+	header.width = texture->width;
+	header.height = texture->height;
+
+	string tempPath = cachePath + ".tmp";
+	FILE* f = fopen(tempPath.c_str(), "wb");
+	if (f == nullptr) return false;
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+		&& fwrite(texture->pixels, 1, texture->gpuBytes(), f) == texture->gpuBytes();
+	ok = (fclose(f) == 0) && ok;
+	if (ok) {
+		remove(cachePath.c_str());
+		ok = rename(tempPath.c_str(), cachePath.c_str()) == 0;
+	}
+	if (!ok) {
+		remove(tempPath.c_str());
+	}
+	return ok;
+}
+
+// Loads an image as a mip-chained texture through its cache, which is reused
+// while the source is unchanged (same rules as loadMeshCached) and was built
+// with the same size limit. Returns nullptr if the image cannot be loaded.
+MipChainTexturePtr loadTextureCached(const string& path, int maxSize) {
+	long long start = monotonicNs();
+	TextureLoadStats stats;
+	stats.name = path.substr(path.find_last_of("/\\") + 1);
+	stats.fromCache = false;
+
+	TextureCacheHeader stamp;
+	memset(&stamp, 0, sizeof(stamp));
+	if (!getFileStamp(path, stamp.sourceSize, stamp.sourceMtime)) {
+		return nullptr;
+	}
+	stamp.maxSize = (uint32_t)maxSize;
+
+	MipChainTexturePtr texture = std::make_shared<MipChainTexture>();
+	string cachePath = path + ".texcache";
+	std::shared_ptr<MappedFile> cache = std::make_shared<MappedFile>();
+	if (cache->open(cachePath) && cache->size() >= sizeof(TextureCacheHeader)) {
+		const TextureCacheHeader* header = (const TextureCacheHeader*)cache->data();
+		bool usable = header->magic == TEXTURE_CACHE_MAGIC && header->version == TEXTURE_CACHE_VERSION
+			&& header->sourceSize == stamp.sourceSize && header->maxSize == stamp.maxSize
+			&& header->levelCount == (uint32_t)mipLevelCount(header->width, header->height)
+			&& cache->size() >= sizeof(TextureCacheHeader) + mipChainBytes(header->width, header->height, header->levelCount);
+		if (usable && header->sourceMtime != stamp.sourceMtime) {
+			stamp.sourceHash = hashFile(path);
+			usable = stamp.sourceHash == header->sourceHash;
+		}
+		if (usable) {
+			texture->width = header->width;
+			texture->height = header->height;
+			texture->levelCount = header->levelCount;
+			texture->pixels = cache->data() + sizeof(TextureCacheHeader);
+			texture->mapping = cache;
+			stats.fromCache = true;
+		}
+	}
+
+	if (!stats.fromCache) {
+		cache.reset();
+		if (!buildMipChain(texture.get(), path, maxSize, stats.sourceWidth, stats.sourceHeight)) {
+			return nullptr;
+		}
+		if (stamp.sourceHash == 0) {
+			stamp.sourceHash = hashFile(path);
+		}
+		if (!writeTextureCache(texture.get(), cachePath, stamp)) {
+			cout << "Warning - could not write texture cache " << cachePath << endl;
+		}
+	}
+	texture->attachBaseImage();
+
+	stats.width = texture->width;
+	stats.height = texture->height;
+	stats.levels = texture->levelCount;
+	stats.gpuBytes = texture->gpuBytes();
+	stats.ms = (monotonicNs() - start) / 1e6;
+	std::lock_guard<std::mutex> lock(textureStatsMutex);
+	textureStats.push_back(stats);
+	return texture;
+}
+
+void printTextureReport() {
+	size_t total = 0;
+	cout << "Textures (max size " << maxTextureSize << ")" << endl;
+	for (size_t i = 0; i < textureStats.size(); i++) {
+		const TextureLoadStats& t = textureStats[i];
+		total += t.gpuBytes;
+		printf("  %-20s %5dx%-5d %2d levels %8.1f KB GPU %8.1f ms  ", t.name.c_str(), t.width, t.height,
+			t.levels, t.gpuBytes / 1024.0, t.ms);
+		if (t.fromCache) {
+			printf("cache\n");
+		}
+		else {
+			printf("decoded from %dx%d\n", t.sourceWidth, t.sourceHeight);
+		}
+	}
+	printf("  total %.1f KB GPU\n", total / 1024.0);
+}
+
+//------------------------------------------------------------------------------
+// TARGET MESH BVH
+//------------------------------------------------------------------------------
+
+enum HitRegion { REGION_NONE, REGION_HEAD, REGION_TORSO, REGION_LEGS };
+
+// Region boundaries as a fraction of the target's height, feet at 0
+const double HEAD_REGION_START = 0.87;
+const double TORSO_REGION_START = 0.48;
+
+inline const char* hitRegionName(int region) {
+	switch (region) {
+	case REGION_HEAD: return "head";
+	case REGION_TORSO: return "torso";
+	case REGION_LEGS: return "legs";
+	default: return "none";
+	}
+}
+
+// Bounding volume hierarchy over the triangles of a multi-mesh, in the
+// mesh's own (model) frame, so it stays valid however the target moves
+class TriangleBvh {
+private:
+	struct Node {
+		float min[3], max[3];
+		int first;  // left child (right is first + 1), or first triangle of a leaf
+		int count;  // triangles in a leaf, 0 for inner nodes
+	};
+
+	struct BuildTriangle {
+		float v[9];
+		float centroid[3];
+		int id;
+	};
+
+	static const int LEAF_SIZE = 4;
+	static const int STACK_SIZE = 64;
+
+	std::vector<Node> nodes;
+	std::vector<float> vertices;  // 9 floats per triangle, in leaf order
+	std::vector<int> triangleIds; // original triangle index per slot
+
+	void buildNode(int nodeIndex, std::vector<BuildTriangle>& tris, int begin, int end) {
+		Node& node = nodes[nodeIndex];
+		float cmin[3] = { 1e30f, 1e30f, 1e30f }, cmax[3] = { -1e30f, -1e30f, -1e30f };
+		for (int k = 0; k < 3; k++) { node.min[k] = 1e30f; node.max[k] = -1e30f; }
+		for (int i = begin; i < end; i++) {
+			for (int k = 0; k < 3; k++) {
+				for (int v = 0; v < 3; v++) {
+					node.min[k] = std::min(node.min[k], tris[i].v[3 * v + k]);
+					node.max[k] = std::max(node.max[k], tris[i].v[3 * v + k]);
+				}
+				cmin[k] = std::min(cmin[k], tris[i].centroid[k]);
+				cmax[k] = std::max(cmax[k], tris[i].centroid[k]);
+			}
+		}
+
+		if (end - begin <= LEAF_SIZE) {
+			node.first = begin;
+			node.count = end - begin;
+			return;
+		}
+
+		// Median split along the widest centroid axis keeps the tree balanced,
+		// so its depth stays well inside the traversal stack
+		int axis = 0;
+		for (int k = 1; k < 3; k++) {
+			if (cmax[k] - cmin[k] > cmax[axis] - cmin[axis]) axis = k;
+		}
+		int mid = (begin + end) / 2;
+		std::nth_element(tris.begin() + begin, tris.begin() + mid, tris.begin() + end,
+			[axis](const BuildTriangle& a, const BuildTriangle& b) { return a.centroid[axis] < b.centroid[axis]; });
+
+		int left = (int)nodes.size();
+		nodes[nodeIndex].first = left;
+		nodes[nodeIndex].count = 0;
+		nodes.resize(nodes.size() + 2);
+		buildNode(left, tris, begin, mid);
+		buildNode(left + 1, tris, mid, end);
+	}
+
+	static bool slab(const Node& node, const float o[3], const float inv[3], float tMax, float& tEntry) {
+		float tmin = 0.0f, tmax = tMax;
+		for (int k = 0; k < 3; k++) {
+			float t1 = (node.min[k] - o[k]) * inv[k];
+			float t2 = (node.max[k] - o[k]) * inv[k];
+			tmin = std::max(tmin, std::min(t1, t2));
+			tmax = std::min(tmax, std::max(t1, t2));
+		}
+		tEntry = tmin;
+		return tmin <= tmax;
+	}
+
+	// Moller-Trumbore, double sided
+	static bool triangle(const float* v, const float o[3], const float d[3], float& t) {
+		float e1[3] = { v[3] - v[0], v[4] - v[1], v[5] - v[2] };
+		float e2[3] = { v[6] - v[0], v[7] - v[1], v[8] - v[2] };
+		float p[3] = { d[1] * e2[2] - d[2] * e2[1], d[2] * e2[0] - d[0] * e2[2], d[0] * e2[1] - d[1] * e2[0] };
+		float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+		if (fabs(det) < 1e-12f) return false;
+		float invDet = 1.0f / det;
+		float s[3] = { o[0] - v[0], o[1] - v[1], o[2] - v[2] };
+		float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * invDet;
+		if (u < 0.0f || u > 1.0f) return false;
+		float q[3] = { s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0] };
+		float w = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * invDet;
+		if (w < 0.0f || u + w > 1.0f) return false;
+		t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * invDet;
+		return t >= 0.0f;
+	}
+
+public:
+	cVector3d boundsMin, boundsMax;
+
+	int size() const { return (int)triangleIds.size(); }
+
+	// Collects every triangle of the model, including each sub-mesh's local
+	// transform, and builds the tree
+	void build(cMultiMesh* model) {
+		std::vector<BuildTriangle> tris;
+		for (int m = 0; m < model->getNumMeshes(); m++) {
+			cMesh* mesh = model->getMesh(m);
+			cVector3d meshPos = mesh->getLocalPos();
+			cMatrix3d meshRot = mesh->getLocalRot();
+			for (unsigned int i = 0; i < mesh->getNumTriangles(); i++) {
+				unsigned int index[3] = { mesh->m_triangles->getVertexIndex0(i),
+					mesh->m_triangles->getVertexIndex1(i), mesh->m_triangles->getVertexIndex2(i) };
+				BuildTriangle tri;
+				for (int v = 0; v < 3; v++) {
+					cVector3d p = meshPos + meshRot * mesh->m_vertices->getLocalPos(index[v]);
+					for (int k = 0; k < 3; k++) tri.v[3 * v + k] = (float)p(k);
+				}
+				for (int k = 0; k < 3; k++) tri.centroid[k] = (tri.v[k] + tri.v[3 + k] + tri.v[6 + k]) / 3.0f;
+				tri.id = (int)tris.size();
+				tris.push_back(tri);
+			}
+		}
+
+		nodes.clear();
+		vertices.clear();
+		triangleIds.clear();
+		boundsMin.zero();
+		boundsMax.zero();
+		if (tris.empty()) return;
+
+		nodes.reserve(2 * tris.size() / LEAF_SIZE + 1);
+		nodes.resize(1);
+		buildNode(0, tris, 0, (int)tris.size());
+
+		vertices.resize(tris.size() * 9);
+		triangleIds.resize(tris.size());
+		for (size_t i = 0; i < tris.size(); i++) {
+			std::copy(tris[i].v, tris[i].v + 9, &vertices[i * 9]);
+			triangleIds[i] = tris[i].id;
+		}
+		boundsMin.set(nodes[0].min[0], nodes[0].min[1], nodes[0].min[2]);
+		boundsMax.set(nodes[0].max[0], nodes[0].max[1], nodes[0].max[2]);
+	}
+
+	// Nearest triangle hit by origin + t * direction in model space, with
+	// direction normalized. Visits nearer children first and skips any node
+	// that starts behind the best hit so far.
+	bool intersect(const cVector3d& origin, const cVector3d& direction, float& tHit, int& triangleId) const {
+		if (nodes.empty()) return false;
+
+		float o[3], d[3], inv[3];
+		for (int k = 0; k < 3; k++) {
+			o[k] = (float)origin(k);
+			d[k] = (float)direction(k);
+			inv[k] = (fabs(d[k]) > 1e-12f) ? 1.0f / d[k] : (d[k] < 0 ? -1e30f : 1e30f);
+		}
+
+		float best = 1e30f;
+		int bestSlot = -1;
+		int stack[STACK_SIZE];
+		int top = 0;
+		float entry;
+		if (!slab(nodes[0], o, inv, best, entry)) return false;
+		stack[top++] = 0;
+
+		while (top > 0) {
+			const Node& node = nodes[stack[--top]];
+			if (node.count > 0) {
+				for (int i = node.first; i < node.first + node.count; i++) {
+					float t;
+					if (triangle(&vertices[i * 9], o, d, t) && t < best) {
+						best = t;
+						bestSlot = i;
+					}
+				}
+				continue;
+			}
+
+			float tLeft, tRight;
+			bool hitLeft = slab(nodes[node.first], o, inv, best, tLeft);
+			bool hitRight = slab(nodes[node.first + 1], o, inv, best, tRight);
+			if (hitLeft && hitRight && top + 2 <= STACK_SIZE) {
+				// push the farther child first so the nearer one is popped next
+				bool leftFirst = tLeft <= tRight;
+				stack[top++] = leftFirst ? node.first + 1 : node.first;
+				stack[top++] = leftFirst ? node.first : node.first + 1;
+			}
+			else if (hitLeft && top < STACK_SIZE) {
+				stack[top++] = node.first;
+			}
+			else if (hitRight && top < STACK_SIZE) {
+				stack[top++] = node.first + 1;
+			}
+		}
+
+		if (bestSlot < 0) return false;
+		tHit = best;
+		triangleId = triangleIds[bestSlot];
+		return true;
+	}
+};
+
+// One BVH per model file; every target built from the same file shares it
+std::map<std::string, std::shared_ptr<TriangleBvh> > targetBvhCache;
+
+std::shared_ptr<TriangleBvh> getTargetBvh(const std::string& path, cMultiMesh* model) {
+	std::map<std::string, std::shared_ptr<TriangleBvh> >::iterator it = targetBvhCache.find(path);
+	if (it != targetBvhCache.end()) {
+		return it->second;
+	}
+	std::shared_ptr<TriangleBvh> bvh = std::make_shared<TriangleBvh>();
+	bvh->build(model);
+	targetBvhCache[path] = bvh;
+	return bvh;
+}
+
+struct TargetHit {
+	int target;
+	int triangle;
+	int region;
+	float distance;
+};
+
+//------------------------------------------------------------------------------
+// ASSET LOADING
+//------------------------------------------------------------------------------
+
+// Thread pool for startup assets. Jobs only decode (mesh cache or OBJ,
+// images) into objects nobody else sees yet; finished jobs are collected by
+// poll() on the GLUT thread, which does all scene graph and GL work.
+class AssetLoader {
+private:
+	struct Job {
+		string name;
+		std::function<bool()> work;
+		bool ok;
+		double ms;
+	};
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::deque<Job*> pending;
+	std::deque<Job*> finished;
+	std::vector<Job*> jobs;
+	int completed;
+	bool stopping;
+	long long startNs;
+	double totalMs;
+
+	void workerLoop() {
+		for (;;) {
+			Job* job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this] { return stopping || !pending.empty(); });
+				if (stopping) return;
+				job = pending.front();
+				pending.pop_front();
+			}
+			long long start = monotonicNs();
+			job->ok = job->work();
+			job->ms = (monotonicNs() - start) / 1e6;
+
+			std::lock_guard<std::mutex> lock(mutex);
+			finished.push_back(job);
+		}
+	}
+
+public:
+	AssetLoader() : completed(0), stopping(false), startNs(0), totalMs(0.0) {}
+
+	~AssetLoader() {
+		stop();
+		for (size_t i = 0; i < jobs.size(); i++) delete jobs[i];
+	}
+
+	// Queue a job before start(); work returns false if the asset failed
+	void add(const string& name, std::function<bool()> work) {
+		Job* job = new Job();
+		job->name = name;
+		job->work = work;
+		job->ok = false;
+		job->ms = 0.0;
+		jobs.push_back(job);
+		pending.push_back(job);
+	}
+
+	void start() {
+		startNs = monotonicNs();
+		int threads = cMax(1, cMin((int)std::thread::hardware_concurrency(), (int)jobs.size()));
+		for (int i = 0; i < threads; i++) {
+			workers.push_back(std::thread(&AssetLoader::workerLoop, this));
+		}
+	}
+
+	// Collects finished jobs and prints their times; true once all are done
+	bool poll() {
+		std::deque<Job*> ready;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			ready.swap(finished);
+		}
+		for (size_t i = 0; i < ready.size(); i++) {
+			completed++;
+			printf("[%d/%d] %-28s %8.1f ms%s\n", completed, total(), ready[i]->name.c_str(), ready[i]->ms,
+				ready[i]->ok ? "" : "  FAILED");
+		}
+		if (completed == total() && !workers.empty()) {
+			totalMs = (monotonicNs() - startNs) / 1e6;
+			stop();
+		}
+		return completed == total();
+	}
+
+	int total() const { return (int)jobs.size(); }
+	int done() const { return completed; }
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (size_t i = 0; i < workers.size(); i++) {
+			if (workers[i].joinable()) workers[i].join();
+		}
+		workers.clear();
+	}
+
+	void printReport() const {
+		double sum = 0.0, largest = 0.0;
+		for (size_t i = 0; i < jobs.size(); i++) {
+			sum += jobs[i]->ms;
+			largest = std::max(largest, jobs[i]->ms);
+		}
+		printf("Assets loaded in %.1f ms (largest asset %.1f ms, sum of assets %.1f ms)\n", totalMs, largest, sum);
+	}
+};
+
+AssetLoader assetLoader;
+bool assetsReady = false;
+
+// Decoded on the loader threads, attached to the scene by finishStartup()
+cMultiMesh* targetModel = nullptr;
+std::shared_ptr<TriangleBvh> targetModelBvh;
+MipChainTexturePtr pistolTexture, dragunovTexture, rifleTexture;
+cImagePtr backgroundImage;
+
+class DynamicTarget {
+private:
+	cMultiMesh* targetMesh;
+	std::shared_ptr<TriangleBvh> bvh;
+	int upAxis;       // model axis that points up in the world
+	double upSign;
+	cWorld* world;
+	double moveInterval;
+	double lastMoveTime;
+	double initialY;
+
+public:
+	// mesh may be shared with other targets; nullptr if the model failed to load
+	DynamicTarget(cWorld* w, double startY, cMultiMesh* mesh, std::shared_ptr<TriangleBvh> meshBvh)
+		: bvh(meshBvh), upAxis(2), upSign(1.0), world(w), moveInterval(3.0), lastMoveTime(0.0), initialY(startY) {
+		createTargetShape(mesh);
+		moveTarget(); // Initial position
+	}
+
+	void createTargetShape(cMultiMesh* mesh) {
+		targetMesh = mesh;
+		if (targetMesh == nullptr) {
+			return;
+		}
+		world->addChild(targetMesh);
+		targetMesh->setGhostEnabled(true);  // moved by the first station's scene task
+
+		// Scaled on the loader thread; orient and colour it here
+		cMatrix3d rotMat;
+		rotMat.identity();
+		rotMat.rotateAboutGlobalAxisDeg(1, 0, 0, 90);
+		rotMat.rotateAboutGlobalAxisDeg(0, 0, 1, 90);
+		targetMesh->setLocalRot(rotMat);
+		cMaterial material;
+		material.setBlack();
+		targetMesh->setMaterial(material);
+
+		// Create a bounding box for the entire mesh
+		targetMesh->computeBoundaryBox(true);
+
+		targetMesh->setShowBoundaryBox(false);
+
+		// Find which model axis the rotation above turns into world up
+		cVector3d up = rotMat.getTranspose() * cVector3d(0, 0, 1);
+		for (int k = 0; k < 3; k++) {
+			if (fabs(up(k)) > fabs(up(upAxis))) upAxis = k;
+		}
+		upSign = (up(upAxis) < 0) ? -1.0 : 1.0;
+	}
+
+	// Returns true when the target moved
+	bool update(double currentTime) {
+		if (currentTime - lastMoveTime >= moveInterval) {
+			moveTarget();
+			lastMoveTime = currentTime;
+			return true;
+		}
+		return false;
+	}
+
+	void moveTarget() {
+		if (targetMesh == nullptr) return;
+
+		// Generate random position within the specified bounds
+		double x = -4; // Fixed X position
+		double y = initialY + ((targetRng.nextInt(601) - 300) / 100.0);  // Range: initialY - 5 to initialY + 5
+		double z = -0.5 + targetRng.nextInt(100) / 100.0; // Range: -0.5 to 0.5
+		targetMesh->setLocalPos(x, y, z);
+		sceneTransforms.markDirty(targetMesh);
+	}
+
+
+	cVector3d getPosition() const {
+		return (targetMesh != nullptr) ? targetMesh->getLocalPos() : cVector3d(0, 0, 0);
+	}
+
+	// World-space AABB of the target, built from all 8 corners of its rotated
+	// local box. Empty (min > max) if the mesh failed to load.
+	void getWorldBounds(cVector3d& minBound, cVector3d& maxBound) const {
+		minBound.set(1e30, 1e30, 1e30);
+		maxBound.set(-1e30, -1e30, -1e30);
+		if (targetMesh == nullptr) return;
+
+		cVector3d localMin = targetMesh->getBoundaryMin();
+		cVector3d localMax = targetMesh->getBoundaryMax();
+		cVector3d pos = targetMesh->getLocalPos();
+		cMatrix3d rot = targetMesh->getLocalRot();
+		for (int i = 0; i < 8; i++) {
+			cVector3d corner((i & 1) ? localMax.x() : localMin.x(),
+				(i & 2) ? localMax.y() : localMin.y(),
+				(i & 4) ? localMax.z() : localMin.z());
+			cVector3d p = pos + rot * corner;
+			for (int k = 0; k < 3; k++) {
+				minBound(k) = cMin(minBound(k), p(k));
+				maxBound(k) = cMax(maxBound(k), p(k));
+			}
+		}
+	}
+
+	// Exact hit test against the target's triangles. The ray is moved into the
+	// target's local frame instead of transforming the mesh; direction must be
+	// normalized so the distance matches the world-space box test.
+	bool raycast(const cVector3d& origin, const cVector3d& direction, TargetHit& hit) const {
+		if (targetMesh == nullptr || !bvh) return false;
+
+		cMatrix3d toLocal = targetMesh->getLocalRot().getTranspose();
+		cVector3d localOrigin = toLocal * (origin - targetMesh->getLocalPos());
+		cVector3d localDirection = toLocal * direction;
+
+		float t;
+		int triangle;
+		if (!bvh->intersect(localOrigin, localDirection, t, triangle)) return false;
+
+		hit.triangle = triangle;
+		hit.distance = t;
+		hit.region = classifyHeight(localOrigin + localDirection * t);
+		return true;
+	}
+
+	// Head, torso or legs from the hit point's height within the model bounds
+	int classifyHeight(const cVector3d& localPoint) const {
+		double low = (upSign > 0) ? bvh->boundsMin(upAxis) : -bvh->boundsMax(upAxis);
+		double high = (upSign > 0) ? bvh->boundsMax(upAxis) : -bvh->boundsMin(upAxis);
+		if (high <= low) return REGION_TORSO;
+		double f = (upSign * localPoint(upAxis) - low) / (high - low);
+		if (f >= HEAD_REGION_START) return REGION_HEAD;
+		if (f >= TORSO_REGION_START) return REGION_TORSO;
+		return REGION_LEGS;
+	}
+
+	void moveOnHit(double currentTime) {
+		moveTarget();
+		lastMoveTime = currentTime;
+	}
+};
+
+std::vector<DynamicTarget*> dynamicTargets;
+int targetCount = 1;  // see --targets
+
+//------------------------------------------------------------------------------
+// TARGET HIT TESTING
+//------------------------------------------------------------------------------
+
+// World-space target bounds stored as structure-of-arrays, so one shot ray is
+// slab-tested against many targets per call (four per SSE instruction)
+class TargetHitTester {
+private:
+	std::vector<float> minX, minY, minZ, maxX, maxY, maxZ;  // padded to a multiple of 4
+	std::vector<float> enabled;  // 1 for live targets, 0 for padding lanes and empty boxes
+	int count;
+
+public:
+	TargetHitTester() : count(0) {}
+
+	void resize(int n) {
+		count = n;
+		size_t padded = (n + 3) & ~3;
+		minX.assign(padded, 0.0f); minY.assign(padded, 0.0f); minZ.assign(padded, 0.0f);
+		maxX.assign(padded, 0.0f); maxY.assign(padded, 0.0f); maxZ.assign(padded, 0.0f);
+		enabled.assign(padded, 0.0f);
+	}
+
+	int size() const { return count; }
+
+	void setBounds(int i, const cVector3d& minBound, const cVector3d& maxBound) {
+		minX[i] = (float)minBound.x(); minY[i] = (float)minBound.y(); minZ[i] = (float)minBound.z();
+		maxX[i] = (float)maxBound.x(); maxY[i] = (float)maxBound.y(); maxZ[i] = (float)maxBound.z();
+		bool empty = minBound.x() > maxBound.x() || minBound.y() > maxBound.y() || minBound.z() > maxBound.z();
+		enabled[i] = empty ? 0.0f : 1.0f;
+	}
+
+	// Targets whose box is hit by the ray origin + t * direction (t >= 0),
+	// nearest first by entry distance along the normalized direction. Keeps
+	// at most maxHits of them and returns how many were stored.
+	int intersectSorted(const cVector3d& origin, const cVector3d& direction, int* targets, float* entries, int maxHits) const {
+		cVector3d dir = direction;
+		dir.normalize();
+		float inv[3];
+		for (int k = 0; k < 3; k++) {
+			inv[k] = (fabs(dir(k)) > 1e-12) ? (float)(1.0 / dir(k)) : (dir(k) < 0 ? -1e30f : 1e30f);
+		}
+		float ox = (float)origin.x(), oy = (float)origin.y(), oz = (float)origin.z();
+
+		int found = 0;
+		int padded = (int)minX.size();
+
+#ifdef USE_SSE_HIT_TEST
+		const __m128 vox = _mm_set1_ps(ox), voy = _mm_set1_ps(oy), voz = _mm_set1_ps(oz);
+		const __m128 vix = _mm_set1_ps(inv[0]), viy = _mm_set1_ps(inv[1]), viz = _mm_set1_ps(inv[2]);
+		const __m128 zero = _mm_setzero_ps();
+		for (int i = 0; i < padded; i += 4) {
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&minX[i]), vox), vix);
+			__m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&maxX[i]), vox), vix);
+			__m128 tmin = _mm_max_ps(zero, _mm_min_ps(t1, t2));
+			__m128 tmax = _mm_max_ps(t1, t2);
+
+			t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&minY[i]), voy), viy);
+			t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&maxY[i]), voy), viy);
+			tmin = _mm_max_ps(tmin, _mm_min_ps(t1, t2));
+			tmax = _mm_min_ps(tmax, _mm_max_ps(t1, t2));
+
+			t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&minZ[i]), voz), viz);
+			t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&maxZ[i]), voz), viz);
+			tmin = _mm_max_ps(tmin, _mm_min_ps(t1, t2));
+			tmax = _mm_min_ps(tmax, _mm_max_ps(t1, t2));
+
+			__m128 live = _mm_cmpgt_ps(_mm_loadu_ps(&enabled[i]), zero);
+			int hits = _mm_movemask_ps(_mm_and_ps(live, _mm_cmple_ps(tmin, tmax)));
+			if (hits == 0) continue;
+
+			float entry[4];
+			_mm_storeu_ps(entry, tmin);
+			for (int lane = 0; lane < 4; lane++) {
+				if (hits & (1 << lane)) {
+					insertSorted(i + lane, entry[lane], targets, entries, found, maxHits);
+				}
+			}
+		}
+#else
+		for (int i = 0; i < padded; i++) {
+			if (enabled[i] == 0.0f) continue;
+			float t1 = (minX[i] - ox) * inv[0], t2 = (maxX[i] - ox) * inv[0];
+			float tmin = std::max(0.0f, std::min(t1, t2)), tmax = std::max(t1, t2);
+			t1 = (minY[i] - oy) * inv[1]; t2 = (maxY[i] - oy) * inv[1];
+			tmin = std::max(tmin, std::min(t1, t2)); tmax = std::min(tmax, std::max(t1, t2));
+			t1 = (minZ[i] - oz) * inv[2]; t2 = (maxZ[i] - oz) * inv[2];
+			tmin = std::max(tmin, std::min(t1, t2)); tmax = std::min(tmax, std::max(t1, t2));
+			if (tmin <= tmax) {
+				insertSorted(i, tmin, targets, entries, found, maxHits);
+			}
+		}
+#endif
+
+		return found;
+	}
+
+private:
+	static void insertSorted(int target, float entry, int* targets, float* entries, int& found, int maxHits) {
+		int pos = found;
+		while (pos > 0 && entries[pos - 1] > entry) pos--;
+		if (pos >= maxHits) return;
+		int last = std::min(found, maxHits - 1);
+		for (int j = last; j > pos; j--) {
+			targets[j] = targets[j - 1];
+			entries[j] = entries[j - 1];
+		}
+		targets[pos] = target;
+		entries[pos] = entry;
+		if (found < maxHits) found++;
+	}
+};
+
+TargetHitTester targetHitTester;
+
+void refreshTargetBounds(int index) {
+	cVector3d minBound, maxBound;
+	dynamicTargets[index]->getWorldBounds(minBound, maxBound);
+	targetHitTester.setBounds(index, minBound, maxBound);
+}
+
+// Boxes the shot ray may pass through; further ones are not confirmed
+const int MAX_SHOT_CANDIDATES = 16;
+
+// Two-level shot test: the box pass rejects most targets, then candidates are
+// checked against their triangles in entry order until no remaining box
+// starts before the nearest triangle hit
+bool findShotHit(const cVector3d& origin, const cVector3d& direction, TargetHit& hit) {
+	cVector3d dir = direction;
+	dir.normalize();
+
+	int candidates[MAX_SHOT_CANDIDATES];
+	float entries[MAX_SHOT_CANDIDATES];
+	int found = targetHitTester.intersectSorted(origin, dir, candidates, entries, MAX_SHOT_CANDIDATES);
+
+	hit.target = -1;
+	hit.distance = 1e30f;
+	for (int i = 0; i < found; i++) {
+		if (entries[i] > hit.distance) break;
+		TargetHit candidate;
+		if (dynamicTargets[candidates[i]]->raycast(origin, dir, candidate) && candidate.distance < hit.distance) {
+			hit = candidate;
+			hit.target = candidates[i];
+		}
+	}
+	return hit.target >= 0;
+}
+
+
+bool timeTrialActive = false;
+int timeTrialDuration = 30; // 30 seconds
+long long timeTrialStartNs = 0;  // on the haptic clock
+unsigned int timeTrialsFinished = 0;
+
+cLabel* scoreTimeLabel;
+
+void updateBlockTransparency(const cVector3d& toolPos)
+{
+	const double MIN_DISTANCE = 0.5; // Minimum distance before transparency starts
+	const double MAX_DISTANCE = 1.5; // Distance at which block becomes fully opaque
+	const double MIN_ALPHA = 0.1; // Minimum alpha (maximum transparency)
+
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		BlockInstance& block = blocks[i];
+		cVector3d blockPos(block.pos[0], block.pos[1], block.pos[2]);
+		double distance = cDistance(blockPos, toolPos);
+
+		if (distance < MIN_DISTANCE)
+		{
+			block.color[3] = (float)MIN_ALPHA;
+		}
+		else if (distance < MAX_DISTANCE)
+		{
+			double alpha = MIN_ALPHA + (1.0 - MIN_ALPHA) * ((distance - MIN_DISTANCE) / (MAX_DISTANCE - MIN_DISTANCE));
+			block.color[3] = (float)alpha;
+		}
+		else
+		{
+			block.color[3] = 1.0f; // Fully opaque
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+// SHOOTER SESSIONS
+//------------------------------------------------------------------------------
+
+// A shot fired at a further station, handed to the first station's thread,
+// which owns the targets
+struct ShotRequest {
+	cVector3d origin;
+	cVector3d direction;
+};
+
+const int MAX_STATIONS = 4;
+const double STATION_SPACING = 0.5;  // sideways distance between the stations' weapons
+
+// Shots of each station for the first station's thread. Kept out of the
+// sessions, which are heap allocated, so the ring keeps its cache line alignment.
+SpscRing<ShotRequest> stationShots[MAX_STATIONS];
+
+// One shooter: a device with its own tool, weapons, crosshair, trigger and
+// recoil state, ticked by a haptic thread of its own. The world, the targets
+// and the renderer are shared. The first station also owns the game: its
+// thread runs the scene task and the time trial and resolves the shots of
+// the others, and it is the station that is recorded, replayed, benchmarked
+// and served by the force thread.
+class ShooterSession {
+public:
+	int index;
+	int cpu;  // core the haptic thread is pinned to, -1 for none
+	cGenericHapticDevicePtr hapticDevice;
+	cToolCursor* tool;
+	CrosshairTarget* crosshair;
+	cShapeLine* bulletTraj;
+	cMultiMesh* weapon_pistol;
+	cMultiMesh* weapon_dragunov;
+	cMultiMesh* weapon_rifle;
+	WeaponLods lods[3];
+
+	// haptic thread
+	HapticScheduler hapticScheduler;
+	TaskScheduler hapticTasks;
+	TransformTracker transforms;
+	long long clockNs;           // this tick on the haptic clock
+	HapticInput hapticInput;
+	HapticSnapshot hapticState;  // working copy
+	HapticSnapshot lastPublished;
+	bool isPistolLoaded;
+	bool isDragunovLoaded;
+	bool isRifleLoaded;
+	bool is_pressed;
+	long long time_start_us;     // trigger pull, on the haptic clock
+	long long elapsed_us;        // since the trigger pull
+	bool sniperFiring;
+	bool pistolFiring;
+	cVector3d commandedForce;    // last force and torque sent to the device, see sendForce()
+	cVector3d commandedTorque;
+	cVector3d currentToolP;
+	cVector3d lastToolP;
+	double currentRotationAngle;
+	double cachedRotationAngle;  // rotZ and rotZR are built for this angle
+	bool rotationCached;
+	cMatrix3d rotZ, rotZR;
+	CyclicFire rifleFire;
+	FastRng recoilRng;
+	RecoilShot currentShot;
+	std::atomic<int> score;      // written by the first station's thread only
+	std::atomic<unsigned int> hits;
+	std::atomic<int> lastHitRegion;
+	std::atomic<int> trialScore; // score of the last finished time trial
+
+	// between the haptic and render threads
+	TripleBuffer<HapticSnapshot> hapticSnapshots;
+	TripleBuffer<CameraPose> cameraPoses;
+
+	// render thread
+	int displayedWeapon;
+	int shownWeapon;  // weapon and level applied by updateWeaponLod
+	int shownLevel;
+	unsigned int hitsReported;
+
+	explicit ShooterSession(int a_index) : index(a_index), cpu(-1), tool(nullptr), crosshair(nullptr), bulletTraj(nullptr),
+		weapon_pistol(nullptr), weapon_dragunov(nullptr), weapon_rifle(nullptr), clockNs(0),
+		isPistolLoaded(true), isDragunovLoaded(false), isRifleLoaded(false), is_pressed(false),
+		time_start_us(0), elapsed_us(0), sniperFiring(false), pistolFiring(false), currentRotationAngle(0.0),
+		cachedRotationAngle(0.0), rotationCached(false), score(0), hits(0), lastHitRegion(0), trialScore(0),
+		displayedWeapon(WEAPON_PISTOL), shownWeapon(-1), shownLevel(-1), hitsReported(0) {
+		stationShots[index].reserve(64);
+	}
+
+	long long hapticClockUs() const { return clockNs / 1000; }
+
+	void beginRecoilShot() {
+		currentShot.direction.set(1 + (recoilRng.nextInt(20) - 10) / 100.0,
+			(recoilRng.nextInt(20) - 10) / 100.0,
+			0.3 + (recoilRng.nextInt(20) - 10) / 100.0);
+		currentShot.direction.normalize();
+		currentShot.horizontalSign = (recoilRng.nextInt(2) == 0) ? 1 : -1;
+	}
+
+	// The force thread serves the first station only
+	void postRecoil(const RecoilEnvelope* envelope, long long startUs) {
+		if (index == 0) {
+			::postRecoil(envelope, startUs, currentShot.direction);
+		}
+	}
+
+	void open(cGenericHapticDevicePtr device);
+	void copyWeapons(const ShooterSession& source);
+	void setupWeapons(void);
+	void run(void);
+	void hapticTick(double currentTime);
+	bool resolveShot(const ShotRequest& shot, double currentTime, TargetHit& hit);
+	void updateWeaponPositionAndOrientation(void);
+	void apply_pistol_force(void);
+	void apply_sniper_force(void);
+	void apply_rifle_force(void);
+	void sendForce(const cVector3d& force, const cVector3d& torque);
+	void recordSessionTick(unsigned int switches, unsigned int inputFlags, bool triggerEdge, const TargetHit* hit);
+	void publishHapticSnapshot(void);
+	void applyHapticSnapshot(const HapticSnapshot& snapshot);
+	void reportHits(const HapticSnapshot& snapshot);
+	void updateWeaponLod(int weapon);
+	cMultiMesh* getWeaponMesh(int weapon);
+};
+
+std::vector<ShooterSession*> sessions;  // the first one is the station described above
+int stationCount = 0;  // see --stations; 0 opens one per connected device
+std::atomic<int> hapticThreadsRunning(0);
+
+// Haptic thread entry, one per station
+void updateHaptics(void* session) {
+	static_cast<ShooterSession*>(session)->run();
+}
+
+// Called by each haptic thread on the way out; the last one marks the
+// simulation finished
+void leaveHapticThread(void) {
+	if (--hapticThreadsRunning == 0) {
+		simulationFinished = true;
+	}
+}
+
+// First station's scene task: starts and ends the time trial, which scores
+// every station. The render thread reports both ends, see reportTimeTrial()
+void updateTimeTrial() {
+	HapticInput& hapticInput = sessions[0]->hapticInput;
+	if (hapticInput.timeTrialRequest && !timeTrialActive) {
+		timeTrialActive = true;
+		timeTrialStartNs = hapticClockNs;
+		for (size_t i = 0; i < sessions.size(); i++) {
+			sessions[i]->score = 0;
+		}
+	}
+	hapticInput.timeTrialRequest = false;
+	if (timeTrialActive) {
+		int elapsedSeconds = (int)((hapticClockNs - timeTrialStartNs) / 1000000000LL);
+		if (elapsedSeconds >= timeTrialDuration) {
+			timeTrialActive = false;
+			for (size_t i = 0; i < sessions.size(); i++) {
+				sessions[i]->trialScore = sessions[i]->score.load();
+				sessions[i]->score = 0;  // Reset score for the next trial
+			}
+			timeTrialsFinished++;
+		}
+	}
+}
+
+// DECLARED FUNCTIONS
+void resizeWindow(int w, int h);
 void keySelect(unsigned char key, int x, int y);
 void keyRelease(unsigned char key, int x, int y);
 void updateGraphics(void);
 void updateCameraPosition(void);
 void graphicsTimer(int data);
 void close(void);
-void updateHaptics(void);
-__int64 currentTimeMillis();
-void applyTextureToWeapon(cMultiMesh* weapon, const std::string& texturePath);
+void sceneTick(double currentTime);
+void effectsTick(double currentTime);
+void updateStageOverlay(void);
+void reportTimeTrial(const HapticSnapshot& snapshot);
+void applyTextureToWeapon(cMultiMesh* weapon, MipChainTexturePtr texture, const std::string& name);
+bool loadModelFile(cMultiMesh* model, const string& file, string* loadedPath = nullptr, uint32_t variant = 0,
+	const std::function<void(cMultiMesh*)>& prepare = nullptr);
+bool loadImageFile(cImagePtr& image, const string& file);
+bool loadTextureFile(MipChainTexturePtr& texture, const string& file);
+bool loadWeaponModel(int type, cMultiMesh*& weapon);
+void runContactBench(void);
+void attachWeaponLods(cMultiMesh* weapon, WeaponLods& lods, const string& name);
+void startAssetLoading(void);
+void finishStartup(void);
+void startHapticThread(void);
+void stopHapticThread(void);
+void stopForceThread(void);
+void runHeadless(void);
+int benchStep(void);
+void benchTimer(int data);
 void setInitialWeaponOrientations();
-void updateWeaponLabel();
-void apply_pistol_force();
-void apply_sniper_force();
-void apply_rifle_force();
+void updateWeaponLabel(int weapon);
+void publishCameraPose(void);
+void latencyTestTimer(int data);
+void parseCommandLine(int argc, char* argv[]);
+void replayHaptics(void);
 void createBlocks(cWorld* world);
-void updateWeaponPositionAndOrientation(cGenericHapticDevicePtr hapticDevice, cToolCursor* tool);
-bool checkCollision(const cVector3d& position);
+Aabb getBlockBounds(int index);
 
 int main(int argc, char* argv[])
 {
-	srand(static_cast<unsigned int>(time(nullptr)));
+	sessionSeed = static_cast<uint64_t>(time(nullptr));
 
 	cout << endl;
 	cout << "-----------------------------------" << endl;
@@ -466,34 +4672,80 @@ int main(int argc, char* argv[])
 	cout << "[s] - right" << endl;
 	cout << "[d] - back" << endl;
 	cout << "[t] - time trial" << endl;
+	cout << "[h] - haptic stage timings" << endl;
 	cout << endl << endl;
 
+	parseCommandLine(argc, argv);
+	if (meshCacheReport) {
+		printMeshCacheReport();
+		return (0);
+	}
+	if (contactBenchTicks > 0) {
+		runContactBench();
+		return (0);
+	}
+	if (!replayPath.empty()) {
+		// the recorded session's seed, rate and scene, so the replay computes the same ticks
+		if (!readSession(replayPath, replayHeader, replayRecords)) {
+			cout << "Error - could not read session " << replayPath << endl;
+			return (1);
+		}
+		sessionSeed = replayHeader.seed;
+		hapticRateHz = (int)replayHeader.hapticRateHz;
+		targetCount = replayHeader.targetCount;
+		blockGridSize = replayHeader.blockGridSize;
+		replayDevice = std::make_shared<ReplayHapticDevice>(replayHeader);
+		cout << "Replaying " << replayRecords.size() << " ticks from " << replayPath << endl;
+	}
+	targetRng.setSeed(sessionSeed ^ 0x5DEECE66DULL);
+	bakeRecoilEnvelopes(hapticRateHz);
+	if (forceRateHz > 0) {
+		forceScheduler.setRate(forceRateHz);
+	}
+
 	// OPENGL - WINDOW DISPLAY
-	glutInit(&argc, argv);
-	screenW = glutGet(GLUT_SCREEN_WIDTH);
-	screenH = glutGet(GLUT_SCREEN_HEIGHT);
-	windowW = (int)(0.8 * screenH);
-	windowH = (int)(0.5 * screenH);
-	windowPosY = (screenH - windowH) / 2;
-	windowPosX = windowPosY;
-
-	glutInitWindowPosition(windowPosX, windowPosY);
-	glutInitWindowSize(windowW, windowH);
-	glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GLUT_DOUBLE);
-	glutCreateWindow(argv[0]);
+	// skipped entirely with --no-render, so this also runs without a display
+	if (!headless) {
+		glutInit(&argc, argv);
+		screenW = glutGet(GLUT_SCREEN_WIDTH);
+		screenH = glutGet(GLUT_SCREEN_HEIGHT);
+		windowW = (int)(0.8 * screenH);
+		windowH = (int)(0.5 * screenH);
+		windowPosY = (screenH - windowH) / 2;
+		windowPosX = windowPosY;
+
+		glutInitWindowPosition(windowPosX, windowPosY);
+		glutInitWindowSize(windowW, windowH);
+		glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GLUT_DOUBLE);
+		glutCreateWindow(argv[0]);
 
 #ifdef GLEW_VERSION
-	glewInit();
+		glewInit();
 #endif
 
-	glutDisplayFunc(updateGraphics);
-	glutKeyboardFunc(keySelect);
-	glutKeyboardUpFunc(keyRelease);
-	glutReshapeFunc(resizeWindow);
-	glutSetWindowTitle("CHAI3D");
+		glutDisplayFunc(updateGraphics);
+		glutKeyboardFunc(keySelect);
+		glutKeyboardUpFunc(keyRelease);
+		glutReshapeFunc(resizeWindow);
+		glutSetWindowTitle("CHAI3D");
+
+		if (fullscreen) {
+			glutFullScreen();
+		}
 
-	if (fullscreen) {
-		glutFullScreen();
+		// FRAME PACING
+		framePacer.setRate(frameRateHz > 0 ? frameRateHz : displayRefreshHz());
+		if (framePacer.vsync && !setSwapInterval(1)) {
+			cout << "Vsync not available, pacing frames with the timer only" << endl;
+			framePacer.vsync = false;
+		}
+		else if (!framePacer.vsync) {
+			setSwapInterval(0);
+		}
+	}
+	else {
+		windowW = 1024;
+		windowH = 768;
 	}
 
 	// WORLD - CAMERA - LIGHTING
@@ -506,30 +4758,64 @@ int main(int argc, char* argv[])
 		cVector3d(0.0, 0.0, 1.0));   // direction of the (up) vector
 	camera->setClippingPlanes(0.01, 100);
 	camera->setUseMultipassTransparency(true);
+	camera->setGhostEnabled(true);
 
 	setupLights(world);
-	// initForceVisualization(world);
-
-	// HAPTIC DEVICES / TOOLS
-	handler = new cHapticDeviceHandler();
-	handler->getDevice(hapticDevice, 0);
-	cHapticDeviceInfo hapticDeviceInfo = hapticDevice->getSpecifications();
-
-	tool = new cToolCursor(world);
-	world->addChild(tool);
-	tool->setHapticDevice(hapticDevice);
-	double toolRadius = 0.001;
-	tool->setRadius(toolRadius);
-	tool->setWorkspaceRadius(1.0);
-	tool->setWaitForSmallForce(true);
-	tool->start();
-	tool->setUseTransparency(true);
+	if (forceHistorySamples > 0) {
+		initForceVisualization(world);
+	}
+
+	// HAPTIC DEVICES / TOOLS
+	// one shooter station per device
+	handler = new cHapticDeviceHandler();
+	if (stationCount == 0) {
+		stationCount = (replayDevice || simulatedDevice) ? 1 : cClamp((int)handler->getNumDevices(), 1, MAX_STATIONS);
+	}
+	if (stationCount > 1 && (replayDevice || benchSeconds > 0 || !sessionRecordPath.empty())) {
+		cout << "Recording, replay and the benchmark run a single station" << endl;
+		stationCount = 1;
+	}
+	for (int i = 0; i < stationCount; i++) {
+		cGenericHapticDevicePtr hapticDevice;
+		if (replayDevice) {
+			hapticDevice = replayDevice;
+		}
+		else if (simulatedDevice) {
+			std::shared_ptr<SimulatedHapticDevice> simulated = std::make_shared<SimulatedHapticDevice>(simulatedDeviceRateHz);
+			if (!simulatedDeviceScript.empty() && !simulated->loadScript(simulatedDeviceScript)) {
+				cout << "Error - could not read device script " << simulatedDeviceScript << ", using the built-in sweep" << endl;
+			}
+			hapticDevice = simulated;
+			cout << "Using simulated haptic device at " << simulatedDeviceRateHz << " Hz" << endl;
+		}
+		else if (!handler->getDevice(hapticDevice, i) && i > 0) {
+			cout << "Error - haptic device " << i << " not found, running " << i << " stations" << endl;
+			stationCount = i;
+			break;
+		}
+		// the tap goes outside, so it records what the haptic thread read
+		if (i == 0 && forceRateHz > 0 && !replayDevice) {
+			forceDevice = std::make_shared<ForceThreadDevice>(hapticDevice);
+			hapticDevice = forceDevice;
+		}
+		if (i == 0 && !sessionRecordPath.empty() && !replayDevice) {
+			sessionTap = std::make_shared<SessionTapDevice>(hapticDevice);
+			hapticDevice = sessionTap;
+		}
+		ShooterSession* station = new ShooterSession(i);
+		station->open(hapticDevice);
+		sessions.push_back(station);
+	}
+	if (stationCount > 1) {
+		cout << stationCount << " shooter stations" << endl;
+	}
+	cHapticDeviceInfo hapticDeviceInfo = sessions[0]->hapticDevice->getSpecifications();
 
 	// read the scale factor between the physical workspace of the haptic device and the virtual workspace defined for the tool
-	double workspaceScaleFactor = tool->getWorkspaceScaleFactor();
+	double workspaceScaleFactor = sessions[0]->tool->getWorkspaceScaleFactor();
 
 	// properties
-	double maxStiffness = hapticDeviceInfo.m_maxLinearStiffness / workspaceScaleFactor;
+	maxStiffness = hapticDeviceInfo.m_maxLinearStiffness / workspaceScaleFactor;
 
 	// WIDGETS
 	cFont *font = NEW_CFONTCALIBRI32();
@@ -539,18 +4825,89 @@ int main(int argc, char* argv[])
 	camera->m_frontLayer->addChild(scoreTimeLabel);
 	scoreTimeLabel->setLocalPos(10, windowH + 350);
 
-	// Declare the background pointer
-	cBackground* background = new cBackground();
+	createBlocks(world);
 
-	// Attempt to load the background image
-	bool fload = background->loadFromFile(RESOURCE_PATH("../resources/b1.jpg")); // change accordingly
-	if (!fload) {
-#if defined(_MSVC)
-		fload = background->loadFromFile("../../../bin/resources/b1.jpg"); // change accordingly
-#endif
+	weaponNameLabel = new cLabel(font);
+	weaponNameLabel->m_fontColor.setGreenDarkOlive();
+	weaponNameLabel->setText("Current Weapon: M1911 PISTOL");
+	camera->m_frontLayer->addChild(weaponNameLabel);
+	weaponNameLabel->setLocalPos(10, 10);
+
+	cFont *overlayFont = NEW_CFONTCALIBRI20();
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		stageLabels[i] = new cLabel(overlayFont);
+		stageLabels[i]->m_fontColor.setBlack();
+		stageLabels[i]->setShowEnabled(false);
+		camera->m_frontLayer->addChild(stageLabels[i]);
+		stageLabels[i]->setLocalPos(10, 40 + 20 * (STAGE_COUNT - 1 - i));
+	}
+	frameLabel = new cLabel(overlayFont);
+	frameLabel->m_fontColor.setBlack();
+	frameLabel->setShowEnabled(false);
+	camera->m_frontLayer->addChild(frameLabel);
+	frameLabel->setLocalPos(10, 40 + 20 * STAGE_COUNT);
+
+	// LOAD ASSETS
+	// Meshes and images decode in parallel while the window is already up;
+	// finishStartup() builds the rest of the scene once they are all in
+	startAssetLoading();
+
+	atexit(close);
+
+	if (headless) {
+		runHeadless();
+		return (replayMismatches > 0) ? 1 : 0;
 	}
 
+	glutTimerFunc(10, graphicsTimer, 0);
+	glutMainLoop();
+
+	return (0);
+}
+
+//------------------------------------------------------------------------------
+
+// Queues every startup asset on the loader threads
+void startAssetLoading(void)
+{
+	// the first station's weapons; the others get copies in finishStartup
+	ShooterSession* first = sessions[0];
+	first->weapon_pistol = new cMultiMesh();
+	first->weapon_dragunov = new cMultiMesh();
+	first->weapon_rifle = new cMultiMesh();
+
+	assetLoader.add("1911.obj", [first] { return loadWeaponModel(WEAPON_PISTOL, first->weapon_pistol); });
+	assetLoader.add("dragunov.obj", [first] { return loadWeaponModel(WEAPON_DRAGUNOV, first->weapon_dragunov); });
+	assetLoader.add("ak47.obj", [first] { return loadWeaponModel(WEAPON_RIFLE, first->weapon_rifle); });
+	assetLoader.add("FinalBaseMesh.obj", [] {
+		targetModel = new cMultiMesh();
+		if (!loadModelFile(targetModel, "FinalBaseMesh.obj")) {
+			delete targetModel;
+			targetModel = nullptr;
+			return false;
+		}
+		targetModel->scale(0.07);  // Adjust scale as needed
+		targetModelBvh = getTargetBvh("FinalBaseMesh.obj", targetModel);
+		return true;
+	});
+	assetLoader.add("textures/pistol.png", [] { return loadTextureFile(pistolTexture, "textures/pistol.png"); });
+	assetLoader.add("textures/Texture.png", [] { return loadTextureFile(dragunovTexture, "textures/Texture.png"); });
+	assetLoader.add("textures/ak47.jpg", [] { return loadTextureFile(rifleTexture, "textures/ak47.jpg"); });
+	assetLoader.add("b1.jpg", [] { return loadImageFile(backgroundImage, "b1.jpg"); });
+	assetLoader.start();
+}
+
+//------------------------------------------------------------------------------
+
+// Rest of the scene, built on the GLUT thread once every asset has loaded;
+// ends by starting the haptic thread
+void finishStartup(void)
+{
+	// Declare the background pointer
+	cBackground* background = new cBackground();
+
 	// Check if the background loaded successfully
+	bool fload = backgroundImage && background->loadFromImage(backgroundImage);
 	if (!fload) {
 		cout << "Error - Background image failed to load correctly." << endl;
 		delete background;
@@ -561,90 +4918,176 @@ int main(int argc, char* argv[])
 		// camera->m_backLayer->addChild(background);
 	}
 
-	createBlocks(world);
-	// Create the targets with different initial Y positions
-	dynamicTarget1 = new DynamicTarget(world, 0.0);  // Starts at Y = 3.0
-	//dynamicTarget2 = new DynamicTarget(world, 5.0);  // Starts at Y = 5.0
-	//dynamicTarget3 = new DynamicTarget(world, 7.0);  // Starts at Y = 7.0
-
-	weaponNameLabel = new cLabel(font);
-	weaponNameLabel->m_fontColor.setGreenDarkOlive();
-	weaponNameLabel->setText("Current Weapon: M1911 PISTOL");
-	camera->m_frontLayer->addChild(weaponNameLabel);
-	weaponNameLabel->setLocalPos(10, 10);
+	if (targetModel == nullptr) {
+		cout << "Error - Target model failed to load correctly." << endl;
+	}
 
-	crosshair = new CrosshairTarget(world);
+	// Create the targets with different initial Y positions
+	// first target starts at Y = 0, the others alternate to either side of it.
+	// The first one takes the loaded model, the others share its mesh data.
+	for (int i = 0; i < targetCount; i++) {
+		double startY = ((i + 1) / 2) * 5.0 * ((i % 2) ? 1.0 : -1.0);
+		cMultiMesh* mesh = nullptr;
+		if (targetModel != nullptr) {
+			mesh = (i == 0) ? targetModel : targetModel->copy(false, false, false, false);
+		}
+		dynamicTargets.push_back(new DynamicTarget(world, startY, mesh, targetModelBvh));
+	}
+	targetHitTester.resize(targetCount);
+	for (int i = 0; i < targetCount; i++) {
+		refreshTargetBounds(i);
+	}
 
 	// CREATE WEAPONS
-	weapon_pistol = new cMultiMesh();
-	weapon_dragunov = new cMultiMesh();
-	weapon_rifle = new cMultiMesh();
-
-	bool fileload;
-	fileload = weapon_pistol->loadFromFile(RESOURCE_PATH("../resources/1911.obj")); // change accordingly
-	if (!fileload) {
-#if defined(_MSVC)
-		fileload = weapon_pistol->loadFromFile("../../../bin/resources/1911.obj"); // change accordingly
-#endif
-	}
-	if (!fileload) {
+	ShooterSession& first = *sessions[0];
+	if (first.weapon_pistol == nullptr) {
 		cout << "Error - Pistol model failed to load correctly." << endl;
-		delete weapon_pistol;
-		weapon_pistol = nullptr;
 		close();
-		return (-1);
+		exit(-1);
 	}
 
-	fileload = weapon_dragunov->loadFromFile(RESOURCE_PATH("../resources/dragunov.obj")); // change accordingly
-	if (!fileload) {
-#if defined(_MSVC)
-		fileload = weapon_dragunov->loadFromFile("../../../bin/resources/dragunov.obj"); // change accordingly
-#endif
-	}
-	if (!fileload) {
+	if (first.weapon_dragunov == nullptr) {
 		cout << "Error - Dragunov model failed to load correctly." << endl;
-		delete weapon_dragunov;
-		weapon_dragunov = nullptr;
 		close();
-		return (-1);
+		exit(-1);
 	}
 
-	fileload = weapon_rifle->loadFromFile(RESOURCE_PATH("../resources/ak47.obj")); // change accordingly
-	if (!fileload) {
-#if defined(_MSVC)
-		fileload = weapon_rifle->loadFromFile("../../../bin/resources/ak47.obj"); // change accordingly
-#endif
-	}
-	if (!fileload) {
-		cout << "Error - Dragunov model failed to load correctly." << endl;
-		delete weapon_rifle;
-		weapon_rifle = nullptr;
+	if (first.weapon_rifle == nullptr) {
+		cout << "Error - Rifle model failed to load correctly." << endl;
 		close();
-		return (-1);
+		exit(-1);
+	}
+
+	// Textures upload on first use, from this thread
+	applyTextureToWeapon(first.weapon_pistol, pistolTexture, "pistol.png");
+	applyTextureToWeapon(first.weapon_dragunov, dragunovTexture, "Texture.png");
+	applyTextureToWeapon(first.weapon_rifle, rifleTexture, "ak47.jpg");
+	printTextureReport();
+
+	printMeshOptimizeReport("1911.obj", weaponMeshStats[WEAPON_PISTOL]);
+	printMeshOptimizeReport("dragunov.obj", weaponMeshStats[WEAPON_DRAGUNOV]);
+	printMeshOptimizeReport("ak47.obj", weaponMeshStats[WEAPON_RIFLE]);
+
+	// further stations draw copies that share the first station's mesh data
+	for (int w = 0; w < 3; w++) {
+		first.lods[w] = weaponLods[w];
+	}
+	for (size_t i = 1; i < sessions.size(); i++) {
+		sessions[i]->copyWeapons(first);
+	}
+
+	for (size_t i = 0; i < sessions.size(); i++) {
+		sessions[i]->setupWeapons();
+	}
+
+	// Full pass once; from here on only moved subtrees are recomputed
+	setInitialWeaponOrientations();
+	world->computeGlobalPositions(true);
+
+	// START SIMULATION
+	// Only device read, recoil and force output run at the haptic rate; the
+	// scene runs on the first station's thread
+	for (size_t i = 0; i < sessions.size(); i++) {
+		ShooterSession* station = sessions[i];
+		station->hapticTasks.addTask("haptics", 0, 1000000 / hapticRateHz, [station](double t) { station->hapticTick(t); });
+	}
+	first.hapticTasks.addTask("scene", 120, 2000, sceneTick);
+	frameTasks.addTask("effects", 0, 2000, effectsTick);
+	publishCameraPose();
+
+	// The benchmark starts and stops the haptic thread once per scenario
+	if (benchSeconds > 0) {
+		if (!headless) {
+			glutTimerFunc(0, benchTimer, 0);
+		}
+		return;
+	}
+
+	if (!sessionRecordPath.empty() && !replayDevice) {
+		// two seconds of slack for the writer thread
+		sessionRecorder.start(sessionRecordPath, hapticRateHz, sessionSeed, targetCount, blockGridSize, first.hapticDevice->getSpecifications(), 2 * hapticRateHz);
 	}
+	startHapticThread();
 
-	weapon_pistol->scale(0.01);
-	weapon_dragunov->scale(0.007);
-	weapon_rifle->scale(0.3);
+	if (latencyTestSeconds > 0 && !headless) {
+		if (renderLoad == 0) {
+			renderLoad = 4;
+		}
+		glutTimerFunc(latencyTestSeconds * 1000, latencyTestTimer, 0);
+	}
+}
+
+//------------------------------------------------------------------------------
+
+// Tool and crosshair of a station on its device. Each haptic thread gets a
+// core of its own: --cpu names the first one, otherwise several stations
+// take the cores after core 0.
+void ShooterSession::open(cGenericHapticDevicePtr device)
+{
+	hapticDevice = device;
+	hapticScheduler.setRate(hapticRateHz);
+	recoilRng.setSeed(sessionSeed + index);
+	if (hapticCpu >= 0) {
+		cpu = hapticCpu + index;
+	}
+	else if (stationCount > 1 && index + 1 < (int)std::thread::hardware_concurrency()) {
+		cpu = index + 1;
+	}
+
+	tool = new cToolCursor(world);
+	world->addChild(tool);
+	tool->setHapticDevice(hapticDevice);
+	tool->setRadius(toolRadius);
+	tool->setWorkspaceRadius(1.0);
+	tool->setWaitForSmallForce(true);
+	tool->start();
+	tool->setUseTransparency(true);
+	tool->setGhostEnabled(true);  // out of the other stations' contact, see TRANSFORM UPDATES
+
+	crosshair = new CrosshairTarget(world);
+}
 
-	applyTextureToWeapon(weapon_pistol, "../resources/textures/pistol.png");
-	applyTextureToWeapon(weapon_dragunov, "../resources/textures/Texture.png");
-	applyTextureToWeapon(weapon_rifle, "../resources/textures/ak47.jpg");
+// Weapons of a further station: copies of the source station's models and
+// LOD levels that share their vertex, triangle and texture data
+void ShooterSession::copyWeapons(const ShooterSession& source)
+{
+	for (int w = 0; w < 3; w++) {
+		lods[w] = source.lods[w];
+		for (int level = 0; level < WEAPON_LOD_COUNT; level++) {
+			lods[w].levels[level] = source.lods[w].levels[level]->copy(false, false, false, false);
+		}
+	}
+	weapon_pistol = lods[WEAPON_PISTOL].levels[0];
+	weapon_dragunov = lods[WEAPON_DRAGUNOV].levels[0];
+	weapon_rifle = lods[WEAPON_RIFLE].levels[0];
+}
 
-	tool->m_image = weapon_pistol;
+// Adds the station's weapons and bullet trajectory to the world
+void ShooterSession::setupWeapons(void)
+{
+	// reduced levels take every setting below from their weapon
+	attachWeaponLods(weapon_pistol, lods[WEAPON_PISTOL], "1911.obj");
+	attachWeaponLods(weapon_dragunov, lods[WEAPON_DRAGUNOV], "dragunov.obj");
+	attachWeaponLods(weapon_rifle, lods[WEAPON_RIFLE], "ak47.obj");
+
+	// Weapons are drawn by the render thread from the published haptic state,
+	// so they live in the world as display-only nodes rather than as the tool image
+	world->addChild(weapon_pistol);
+	world->addChild(weapon_dragunov);
+	world->addChild(weapon_rifle);
+	weapon_pistol->setHapticEnabled(false);
+	weapon_dragunov->setHapticEnabled(false);
+	weapon_rifle->setHapticEnabled(false);
+	weapon_pistol->setGhostEnabled(true);
+	weapon_dragunov->setGhostEnabled(true);
+	weapon_rifle->setGhostEnabled(true);
+	weapon_dragunov->setShowEnabled(false);
+	weapon_rifle->setShowEnabled(false);
 
 	weapon_pistol->setUseCulling(false);
 	weapon_dragunov->setUseCulling(false);
 	weapon_rifle->setUseCulling(false);
 
-	weapon_pistol->createAABBCollisionDetector(toolRadius);
-	weapon_dragunov->createAABBCollisionDetector(toolRadius);
-	weapon_rifle->createAABBCollisionDetector(toolRadius);
-
-	weapon_pistol->setStiffness(0.1 * maxStiffness, true);
-	weapon_dragunov->setStiffness(0.7 * maxStiffness, true);
-	weapon_rifle->setStiffness(0.4 * maxStiffness, true);
-
 	weapon_pistol->setUseDisplayList(true);
 	weapon_dragunov->setUseDisplayList(true);
 	weapon_rifle->setUseDisplayList(true);
@@ -668,20 +5111,233 @@ int main(int argc, char* argv[])
 	bulletTraj->m_colorPointA.set(0.5, 0.0, 0.0);
 	bulletTraj->m_colorPointB.set(1.0, 0.0, 0.0);
 	bulletTraj->setShowEnabled(false);
+	bulletTraj->setGhostEnabled(true);
 	world->addChild(bulletTraj);
+}
 
-	// START SIMULATION
+//------------------------------------------------------------------------------
+
+void startHapticThread(void)
+{
+	// set here rather than by the thread, so a stop issued right after this
+	// cannot be overwritten by the thread starting up
+	simulationRunning = true;
 	simulationFinished = false;
+	if (hapticClockStartNs == 0) {
+		hapticClockStartNs = monotonicNs();
+	}
+	if (forceRateHz > 0 && !replayDevice) {
+		forceThreadRunning = true;
+		forceThreadFinished = false;
+		postedRecoil = RecoilCommand();
+		cThread* forceThread = new cThread();
+		forceThread->start(updateForces, CTHREAD_PRIORITY_HAPTICS);
+	}
+	if (replayDevice) {
+		hapticThreadsRunning = 1;
+		cThread* hapticsThread = new cThread();
+		hapticsThread->start(replayHaptics, CTHREAD_PRIORITY_HAPTICS);
+		return;
+	}
+	hapticThreadsRunning = (int)sessions.size();
+	for (size_t i = 0; i < sessions.size(); i++) {
+		cThread* hapticsThread = new cThread();
+		hapticsThread->start(updateHaptics, CTHREAD_PRIORITY_HAPTICS, sessions[i]);
+	}
+}
 
-	cThread* hapticsThread = new cThread();
-	hapticsThread->start(updateHaptics, CTHREAD_PRIORITY_HAPTICS);
+// Stops the haptic threads and waits until they have left their loops
+void stopHapticThread(void)
+{
+	simulationRunning = false;
+	while (!simulationFinished) { cSleepMs(1); }
+	stopForceThread();
+}
 
-	atexit(close);
+void stopForceThread(void)
+{
+	forceThreadRunning = false;
+	while (!forceThreadFinished) { cSleepMs(1); }
+}
 
-	glutTimerFunc(50, graphicsTimer, 0);
-	glutMainLoop();
+//------------------------------------------------------------------------------
 
-	return (0);
+// Without a window: finish loading, then run the benchmark, the latency test
+// or the simulation until the process is stopped
+void runHeadless(void)
+{
+	while (!assetLoader.poll()) { cSleepMs(10); }
+	assetLoader.printReport();
+	assetsReady = true;
+	finishStartup();
+
+	if (benchSeconds > 0) {
+		int delayMs;
+		while ((delayMs = benchStep()) >= 0) {
+			cSleepMs(delayMs);
+		}
+	}
+	else if (latencyTestSeconds > 0) {
+		cSleepMs(latencyTestSeconds * 1000);
+		latencyTestTimer(0);
+	}
+	else {
+		while (simulationRunning) { cSleepMs(100); }
+	}
+}
+
+//------------------------------------------------------------------------------
+
+// Scripted device for one scenario: select the scenario's weapon, then drive
+// the trigger in its pattern while the grip follows the usual sweep
+std::shared_ptr<SimulatedHapticDevice> makeBenchDevice(const BenchScenario& scenario, double seconds)
+{
+	std::shared_ptr<SimulatedHapticDevice> device = std::make_shared<SimulatedHapticDevice>(simulatedDeviceRateHz);
+	const double step = 0.005;
+	for (int i = 0; i * step <= seconds + 1.0; i++) {
+		double t = i * step;
+		cVector3d pos(0.01 * sin(0.5 * t), 0.03 * sin(0.7 * t), 0.02 * sin(1.4 * t));
+		unsigned int buttons = 0;
+		double firing = t - 0.2;  // trigger work starts after the weapon switch
+		if (t < 0.1) {
+			buttons = 1u << (scenario.weapon + 1);
+		}
+		else if (firing >= 0.0) {
+			switch (scenario.pattern) {
+			case BENCH_TAP_TRIGGER:
+				buttons = (fmod(firing, 0.25) < 0.06) ? 1u : 0u;
+				break;
+			case BENCH_HOLD_TRIGGER:
+				buttons = 1u;
+				break;
+			case BENCH_SLOW_TRIGGER:
+				buttons = (fmod(firing, 1.0) < 0.15) ? 1u : 0u;
+				break;
+			case BENCH_SWITCHING:
+				// trigger held, a different weapon button tapped every 100 ms
+				buttons = 1u;
+				if (fmod(firing, 0.1) < 0.03) {
+					buttons |= 1u << ((int)(firing / 0.1) % 3 + 1);
+				}
+				break;
+			}
+		}
+		device->addScriptPoint(t, pos, buttons);
+	}
+	return device;
+}
+
+int benchIndex = -1;
+long long benchWallStartNs = 0;
+clock_t benchProcessCpuStart = 0;
+StageHistogram::Snapshot benchStageStart[STAGE_COUNT];
+std::vector<string> benchResults;
+
+void startBenchScenario(const BenchScenario& scenario)
+{
+	cout << "Benchmark scenario " << scenario.name << " (" << benchSeconds << " s)" << endl;
+	renderEnabled = scenario.render;
+
+	// fresh device and trigger state for every run
+	ShooterSession& station = *sessions[0];
+	station.tool->stop();
+	station.hapticDevice = makeBenchDevice(scenario, benchSeconds);
+	station.tool->setHapticDevice(station.hapticDevice);
+	station.tool->start();
+	station.is_pressed = false;
+
+	tickRecorder.reset((size_t)(benchSeconds + 1) * hapticRateHz);
+	tickRecorder.enabled = true;
+	station.hapticScheduler.resetStats();
+	benchWallStartNs = monotonicNs();
+	benchProcessCpuStart = std::clock();
+	readStageHistograms(benchStageStart);
+	startHapticThread();
+}
+
+void recordBenchResult(const BenchScenario& scenario)
+{
+	tickRecorder.enabled = false;
+	double wallS = (monotonicNs() - benchWallStartNs) / 1e9;
+	double processCpuPct = 100.0 * ((double)(std::clock() - benchProcessCpuStart) / CLOCKS_PER_SEC) / wallS;
+	long long threadCpu = hapticThreadCpuNs.load();
+	string threadCpuPct = (threadCpu >= 0) ? cStr(100.0 * threadCpu / 1e9 / wallS, 1) : string("null");
+
+	// haptic thread stages over this scenario only
+	static StageHistogram::Snapshot stageEnd[STAGE_COUNT];
+	readStageHistograms(stageEnd);
+	string stages;
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		StageHistogram::Snapshot window = stageEnd[i].since(benchStageStart[i]);
+		if (i == STAGE_BLOCK_FADE || window.total == 0) continue;
+		char stage[160];
+		snprintf(stage, sizeof(stage), "%s\"%s\": {\"p50\": %.2f, \"p99\": %.2f, \"max\": %.2f}", stages.empty() ? "" : ", ",
+			STAGE_NAMES[i], window.percentileUs(0.5), window.percentileUs(0.99), window.maxUs());
+		stages += stage;
+	}
+
+	char text[512];
+	snprintf(text, sizeof(text), "{\"name\": \"%s\", \"render\": %s, \"ticks\": %llu, \"overruns\": %llu, "
+		"\"period_us\": %s, \"work_us\": %s, \"haptic_thread_cpu_pct\": %s, \"process_cpu_pct\": %.1f, ",
+		scenario.name, scenario.render ? "true" : "false", sessions[0]->hapticScheduler.ticks, sessions[0]->hapticScheduler.overruns,
+		tickRecorder.summaryJson(true).c_str(), tickRecorder.summaryJson(false).c_str(),
+		threadCpuPct.c_str(), processCpuPct);
+	benchResults.push_back(string(text) + "\"stages_us\": {" + stages + "}}");
+}
+
+void writeBenchReport(void)
+{
+	string json = "{\n  \"haptic_rate_hz\": " + cStr(hapticRateHz) + ",\n  \"device_rate_hz\": " + cStr(simulatedDeviceRateHz)
+		+ ",\n  \"scenario_seconds\": " + cStr(benchSeconds) + ",\n  \"scenarios\": [\n";
+	for (size_t i = 0; i < benchResults.size(); i++) {
+		json += "    " + benchResults[i] + (i + 1 < benchResults.size() ? ",\n" : "\n");
+	}
+	json += "  ]\n}\n";
+
+	cout << json;
+	if (!benchOutputPath.empty()) {
+		FILE* f = fopen(benchOutputPath.c_str(), "w");
+		if (f == nullptr) {
+			cout << "Error - could not write " << benchOutputPath << endl;
+			return;
+		}
+		fputs(json.c_str(), f);
+		fclose(f);
+	}
+}
+
+// Ends the running scenario, if any, and starts the next one. Returns the
+// milliseconds until it should be called again, or -1 once all have run.
+int benchStep(void)
+{
+	if (benchIndex >= 0) {
+		stopHapticThread();
+		recordBenchResult(BENCH_SCENARIOS[benchIndex]);
+	}
+
+	while (++benchIndex < BENCH_SCENARIO_COUNT) {
+		const BenchScenario& scenario = BENCH_SCENARIOS[benchIndex];
+		if (scenario.render && headless) {
+			benchResults.push_back("{\"name\": \"" + string(scenario.name) + "\", \"render\": true, \"skipped\": \"no window (--no-render)\"}");
+			continue;
+		}
+		startBenchScenario(scenario);
+		return benchSeconds * 1000;
+	}
+
+	writeBenchReport();
+	return -1;
+}
+
+// GLUT driver for benchStep
+void benchTimer(int data)
+{
+	int delayMs = benchStep();
+	if (delayMs < 0) {
+		close();
+		exit(0);
+	}
+	glutTimerFunc(delayMs, benchTimer, 0);
 }
 
 //------------------------------------------------------------------------------
@@ -690,11 +5346,16 @@ void resizeWindow(int w, int h)
 {
 	windowW = w;
 	windowH = h;
+	framePacer.requestRedraw();
 }
 
 //------------------------------------------------------------------------------
 
 void keySelect(unsigned char key, int x, int y) {
+	// a replay takes its input from the recording
+	if (replayDevice && key != 27 && key != 'x' && key != 'h') {
+		return;
+	}
 	switch (key) {
 	case 27:
 	case 'x':
@@ -720,17 +5381,24 @@ void keySelect(unsigned char key, int x, int y) {
 		rotateRight = true;
 		break;
 	case 't':
-		if (!timeTrialActive) {
-			timeTrialActive = true;
-			timeTrialStart = std::chrono::steady_clock::now();
-			score = 0;
-			cout << "Time trial started!" << endl;
+		// started on the haptic thread, which owns the score
+		timeTrialRequested = true;
+		break;
+	case 'h':
+		stageOverlayVisible = !stageOverlayVisible;
+		for (int i = 0; i < STAGE_COUNT; i++) {
+			stageLabels[i]->setShowEnabled(stageOverlayVisible);
 		}
+		frameLabel->setShowEnabled(stageOverlayVisible);
 		break;
 	}
+	framePacer.requestRedraw();
 }
 
 void keyRelease(unsigned char key, int x, int y) {
+	if (replayDevice) {
+		return;
+	}
 	switch (key) {
 	case 'w':
 		moveForward = false;
@@ -755,61 +5423,271 @@ void keyRelease(unsigned char key, int x, int y) {
 
 //------------------------------------------------------------------------------
 
+void parseCommandLine(int argc, char* argv[]) {
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "--render-load" && i + 1 < argc) {
+			renderLoad = atoi(argv[++i]);
+		}
+		else if (arg == "--contact-bench") {
+			// optional ticks per model
+			contactBenchTicks = (i + 1 < argc && argv[i + 1][0] != '-') ? cMax(1, atoi(argv[++i])) : 20000;
+		}
+		else if (arg == "--lod-scale" && i + 1 < argc) {
+			lodScale = cMax(atof(argv[++i]), 0.0);
+		}
+		else if (arg == "--fps" && i + 1 < argc) {
+			frameRateHz = atoi(argv[++i]);
+		}
+		else if (arg == "--no-vsync") {
+			framePacer.vsync = false;
+		}
+		else if (arg == "--latency-test" && i + 1 < argc) {
+			latencyTestSeconds = atoi(argv[++i]);
+		}
+		else if (arg == "--haptic-rate" && i + 1 < argc) {
+			hapticRateHz = atoi(argv[++i]);
+			if (hapticRateHz != 1000 && hapticRateHz != 2000 && hapticRateHz != 4000) {
+				cout << "Unsupported haptic rate " << hapticRateHz << " Hz, using " << HAPTIC_RATE_HZ << " Hz" << endl;
+				hapticRateHz = HAPTIC_RATE_HZ;
+			}
+		}
+		else if (arg == "--force-rate" && i + 1 < argc) {
+			forceRateHz = atoi(argv[++i]);
+			if (forceRateHz != 0 && (forceRateHz < 4000 || forceRateHz > 10000)) {
+				cout << "Force thread rate must be 4000 to 10000 Hz, using 4000 Hz" << endl;
+				forceRateHz = 4000;
+			}
+		}
+		else if (arg == "--force-history" && i + 1 < argc) {
+			forceHistorySamples = cMax(0, atoi(argv[++i]));
+		}
+		else if (arg == "--rt-fifo") {
+			hapticRealtime = true;
+		}
+		else if (arg == "--cpu" && i + 1 < argc) {
+			hapticCpu = atoi(argv[++i]);
+		}
+		else if (arg == "--stations" && i + 1 < argc) {
+			stationCount = cClamp(atoi(argv[++i]), 1, MAX_STATIONS);
+		}
+		else if (arg == "--mlock") {
+			hapticLockMemory = true;
+		}
+		else if (arg == "--blocks" && i + 1 < argc) {
+			blockGridSize = cMax(1, atoi(argv[++i]));
+		}
+		else if (arg == "--targets" && i + 1 < argc) {
+			targetCount = cMax(1, atoi(argv[++i]));
+		}
+		else if (arg == "--mesh-cache-report") {
+			meshCacheReport = true;
+		}
+		else if (arg == "--max-texture-size" && i + 1 < argc) {
+			maxTextureSize = cMax(1, atoi(argv[++i]));
+		}
+		else if (arg == "--sim-device") {
+			simulatedDevice = true;
+		}
+		else if (arg == "--sim-rate" && i + 1 < argc) {
+			simulatedDevice = true;
+			simulatedDeviceRateHz = cMax(1, atoi(argv[++i]));
+		}
+		else if (arg == "--sim-script" && i + 1 < argc) {
+			simulatedDevice = true;
+			simulatedDeviceScript = argv[++i];
+		}
+		else if (arg == "--record" && i + 1 < argc) {
+			sessionRecordPath = argv[++i];
+		}
+		else if (arg == "--replay" && i + 1 < argc) {
+			replayPath = argv[++i];
+		}
+		else if (arg == "--replay-realtime") {
+			replayRealtime = true;
+		}
+		else if (arg == "--no-stage-timing") {
+			stageTimingEnabled = false;
+		}
+		else if (arg == "--no-render") {
+			headless = true;
+			renderEnabled = false;
+		}
+		else if (arg == "--bench") {
+			// optional seconds per scenario
+			benchSeconds = (i + 1 < argc && argv[i + 1][0] != '-') ? cMax(1, atoi(argv[++i])) : 10;
+			simulatedDevice = true;
+		}
+		else if (arg == "--bench-out" && i + 1 < argc) {
+			benchOutputPath = argv[++i];
+		}
+		else {
+			cout << "Unknown option: " << arg << endl;
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+
 void close(void)
 {
 	simulationRunning = false;
 	while (!simulationFinished) { cSleepMs(100); }
+	stopForceThread();
+	sessionRecorder.stop();
+
+	static bool reported = false;
+	if (!reported && !sessions.empty() && sessions[0]->hapticScheduler.ticks > 0) {
+		reported = true;
+		sessions[0]->hapticScheduler.printReport();
+		for (size_t i = 1; i < sessions.size(); i++) {
+			cout << "Station " << i + 1 << " (CPU " << sessions[i]->cpu << ") - ";
+			sessions[i]->hapticScheduler.printReport();
+		}
+		if (forceRateHz > 0) {
+			cout << "Force thread - ";
+			forceScheduler.printReport();
+		}
+		sessions[0]->hapticTasks.printReport("Haptic");
+		for (size_t i = 1; i < sessions.size(); i++) {
+			sessions[i]->hapticTasks.printReport("Station " + cStr((int)i + 1) + " haptic");
+		}
+		frameTasks.printReport("Frame");
+		printStageReport();
+		if (framePacer.framesDrawn > 0) {
+			framePacer.printReport();
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+
+void graphicsTimer(int data)
+{
+	// Assets are polled quickly so a finished load is picked up promptly
+	if (!assetsReady && assetLoader.poll()) {
+		assetLoader.printReport();
+		assetsReady = true;
+		finishStartup();
+	}
+
+	// a finished replay exits, non-zero if it diverged from the recording
+	if (replayDevice && assetsReady && simulationFinished) {
+		close();
+		exit((replayMismatches > 0) ? 1 : 0);
+	}
+
+	if (!assetsReady) {
+		glutPostRedisplay();
+		glutTimerFunc(10, graphicsTimer, 0);
+		return;
+	}
+
+	// redraw only when there is something new: a haptic tick, input, or a
+	// camera that is still moving
+	bool cameraMoving = moveForward || moveBackward || moveLeft || moveRight;
+	if (cameraMoving) {
+		framePacer.requestRedraw();
+	}
+	if (simulationRunning && renderEnabled && framePacer.frameDue(publishedGeneration.load(std::memory_order_acquire))) {
+		glutPostRedisplay();
+	}
+	glutTimerFunc(framePacer.delayMs(monotonicNs()), graphicsTimer, 0);
 }
 
 //------------------------------------------------------------------------------
 
-void graphicsTimer(int data)
+// Ends the latency test: stops the haptic thread and reports the worst tick
+// seen while the renderer was running with extra load
+void latencyTestTimer(int data)
 {
-	if (simulationRunning)
-	{
-		glutPostRedisplay();
-	}
-	glutTimerFunc(50, graphicsTimer, 0);
+	close();
+
+	long long worstUs = hapticTickWorstUs.load();
+	long long budgetUs = 1000000 / hapticRateHz;
+	cout << "Haptic latency test: " << hapticTickCount.load() << " ticks, render load " << renderLoad
+		<< ", worst tick " << worstUs << " us (budget " << budgetUs << " us)" << endl;
+
+	exit(worstUs <= budgetUs ? 0 : 1);
 }
 
 //------------------------------------------------------------------------------
 
 void updateGraphics(void)
 {
-	// Lock mutexes to ensure consistent state
-	std::lock_guard<std::mutex> deviceLock(deviceMutex);
-	std::lock_guard<std::mutex> weaponLock(weaponMutex);
+	// Loading progress until the scene is complete
+	if (!assetsReady) {
+		scoreTimeLabel->setText("Loading assets " + cStr(assetLoader.done()) + "/" + cStr(assetLoader.total()));
+		camera->renderView(windowW, windowH);
+		glutSwapBuffers();
+		return;
+	}
 
-	// Check if update is needed
-	if (!graphicsUpdateFlag) {
+	// Benchmark scenarios without rendering leave the window as it is
+	if (!renderEnabled) {
 		return;
 	}
 
-	updateCameraPosition();
+	// Pick up the latest state published by the haptic threads
+	unsigned long long generation = publishedGeneration.load(std::memory_order_acquire);
+	for (size_t i = 0; i < sessions.size(); i++) {
+		sessions[i]->hapticSnapshots.update();
+	}
+	const HapticSnapshot& snapshot = sessions[0]->hapticSnapshots.readBuffer();
 
-	if (timeTrialActive) {
-		auto currentTime = std::chrono::steady_clock::now();
-		int elapsedSeconds = std::chrono::duration_cast<std::chrono::seconds>(currentTime - timeTrialStart).count();
-		int remainingTime = timeTrialDuration - elapsedSeconds;
-		scoreTimeLabel->setText("Score: " + cStr(score) + " | Time: " + cStr(remainingTime) + "s");
+	// Nothing to draw until the first haptic tick
+	if (snapshot.generation == 0) {
+		return;
+	}
+
+	// during a replay the recorded camera pose drives the haptic thread
+	if (!replayDevice) {
+		updateCameraPosition();
+		publishCameraPose();
+	}
+	for (size_t i = 0; i < sessions.size(); i++) {
+		const HapticSnapshot& station = sessions[i]->hapticSnapshots.readBuffer();
+		if (station.generation == 0) continue;
+		sessions[i]->applyHapticSnapshot(station);
+		sessions[i]->updateWeaponLod(station.activeWeapon);
+		sessions[i]->reportHits(station);
+	}
+	reportTimeTrial(snapshot);
+
+	double currentTime = std::chrono::duration_cast<std::chrono::duration<double>>(
+		std::chrono::high_resolution_clock::now().time_since_epoch()
+		).count();
+	frameTasks.run(monotonicNs(), currentTime);
+
+	if (snapshot.timeTrialActive) {
+		string scores = cStr(snapshot.score);
+		for (size_t i = 1; i < sessions.size(); i++) {
+			scores += " / " + cStr(sessions[i]->hapticSnapshots.readBuffer().score);
+		}
+		scoreTimeLabel->setText("Score: " + scores + " | Time: " + cStr(snapshot.remainingTime) + "s");
 	}
 	else {
 		scoreTimeLabel->setText("Press 'T' to start time trial");
 	}
 
+	updateStageOverlay();
+
 	// update shadow maps (if any)
 	world->updateShadowMaps(false, mirroredDisplay);
 
+	// optional synthetic load used by the latency test
+	for (int i = 0; i < renderLoad; i++) {
+		camera->renderView(windowW, windowH);
+	}
+
 	// render world
 	camera->renderView(windowW, windowH);
 
-	drawForceHistory(camera);
+	drawForceHistory(snapshot.toolPos);
 
-	// swap buffers
+	// swap buffers; no glFinish, the driver queues the frame and vsync paces it
 	glutSwapBuffers();
-
-	// wait until all GL commands are completed
-	glFinish();
+	framePacer.presented(generation, snapshot.publishNs);
 
 	// check for any OpenGL errors
 	GLenum err;
@@ -817,13 +5695,51 @@ void updateGraphics(void)
 	if (err != GL_NO_ERROR) cout << "Error:  %s\n" << gluErrorString(err);
 }
 
+// Refreshes the stage overlay a few times a second from the histograms; the
+// haptic thread is never stopped or signalled for this
+void updateStageOverlay(void) {
+	static StageHistogram::Snapshot previous[STAGE_COUNT];
+	static StageHistogram::Snapshot current[STAGE_COUNT];
+	static long long lastRefreshNs = 0;
+
+	long long nowNs = monotonicNs();
+	if (!stageOverlayVisible || nowNs - lastRefreshNs < STAGE_OVERLAY_REFRESH_NS) {
+		return;
+	}
+	lastRefreshNs = nowNs;
+
+	readStageHistograms(current);
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		StageHistogram::Snapshot window = current[i].since(previous[i]);
+		char text[128];
+		snprintf(text, sizeof(text), "%s: p50 %.1f us  p99 %.1f us  max %.1f us  (%llu)",
+			STAGE_NAMES[i], window.percentileUs(0.5), window.percentileUs(0.99), window.maxUs(),
+			(unsigned long long)window.total);
+		stageLabels[i]->setText(text);
+		previous[i] = current[i];
+	}
+
+	static StageHistogram::Snapshot previousFrames, currentFrames;
+	static StageHistogram::Snapshot previousLatency, currentLatency;
+	framePacer.frameTime.read(currentFrames);
+	framePacer.presentLatency.read(currentLatency);
+	StageHistogram::Snapshot frames = currentFrames.since(previousFrames);
+	StageHistogram::Snapshot latency = currentLatency.since(previousLatency);
+	char text[128];
+	snprintf(text, sizeof(text), "frame: p50 %.1f ms  p99 %.1f ms  present latency p50 %.1f ms  p99 %.1f ms",
+		frames.percentileUs(0.5) / 1000.0, frames.percentileUs(0.99) / 1000.0,
+		latency.percentileUs(0.5) / 1000.0, latency.percentileUs(0.99) / 1000.0);
+	frameLabel->setText(text);
+	previousFrames = currentFrames;
+	previousLatency = currentLatency;
+}
+
 // Update the updateCameraPosition function
 void updateCameraPosition() {
 	cVector3d pos = camera->getLocalPos();
 	cVector3d dir = camera->getLookVector();
 	cVector3d right = camera->getRightVector();
 	cVector3d newPos = pos;
-	cVector3d weaponPos = tool->getLocalPos();
 
 	if (moveForward)
 		newPos += dir * CAMERA_SPEED;
@@ -834,219 +5750,692 @@ void updateCameraPosition() {
 	if (moveRight)
 		newPos += right * CAMERA_SPEED;
 
-	// Check for collision before updating position
-	if (!checkCollision(newPos)) {
-		camera->setLocalPos(newPos);
+	// Sweep the camera against the obstacles and slide along any it hits
+	camera->setLocalPos(blockGrid.sweepSphere(pos, newPos, CAMERA_COLLISION_RADIUS));
+	updateGlobalTransform(camera);
+}
+
+void publishCameraPose(void) {
+	for (size_t i = 0; i < sessions.size(); i++) {
+		CameraPose& pose = sessions[i]->cameraPoses.writeBuffer();
+		pose.pos = camera->getLocalPos();
+		pose.look = camera->getLookVector();
+		sessions[i]->cameraPoses.publish();
+	}
+}
+
+// Moves the render-side scene nodes to the state of the last haptic tick
+void ShooterSession::applyHapticSnapshot(const HapticSnapshot& snapshot) {
+	if (snapshot.activeWeapon != displayedWeapon) {
+		getWeaponMesh(displayedWeapon)->setShowEnabled(false);
+		getWeaponMesh(snapshot.activeWeapon)->setShowEnabled(true);
+		displayedWeapon = snapshot.activeWeapon;
+		if (index == 0) {
+			updateWeaponLabel(displayedWeapon);
+		}
 	}
 
-	updateBlockTransparency(world, tool);
+	cMultiMesh* weapon = getWeaponMesh(snapshot.activeWeapon);
+	weapon->setLocalPos(snapshot.toolPos);
+	weapon->setLocalRot(snapshot.toolRot * snapshot.weaponRot);
+	updateGlobalTransform(weapon);
+
+	crosshair->setPosition(snapshot.crosshairPos);
+
+	bulletTraj->m_pointA = snapshot.trajectoryA;
+	bulletTraj->m_pointB = snapshot.trajectoryB;
+	bulletTraj->setShowEnabled(snapshot.showTrajectory);
+}
+
+// Console line for the hits since the last frame; several hits between two
+// frames are printed once with their count
+void ShooterSession::reportHits(const HapticSnapshot& snapshot) {
+	if (snapshot.hits == hitsReported) return;
+	unsigned int count = snapshot.hits - hitsReported;
+	hitsReported = snapshot.hits;
+	cout << "Hit! (" << hitRegionName(snapshot.lastHitRegion);
+	if (index > 0) cout << ", station " << index + 1;
+	if (count > 1) cout << ", " << count << " hits";
+	cout << ")" << endl;
+}
+
+// Console lines for the start and end of a time trial, from the first
+// station's snapshot
+void reportTimeTrial(const HapticSnapshot& snapshot) {
+	static bool activeReported = false;
+	static unsigned int finishedReported = 0;
+	if (snapshot.timeTrialsFinished != finishedReported) {
+		finishedReported = snapshot.timeTrialsFinished;
+		cout << "Time's up! Final score: " << sessions[0]->trialScore.load();
+		for (size_t i = 1; i < sessions.size(); i++) {
+			cout << " / " << sessions[i]->trialScore.load();
+		}
+		cout << endl;
+	}
+	if (snapshot.timeTrialActive && !activeReported) {
+		cout << "Time trial started!" << endl;
+	}
+	activeReported = snapshot.timeTrialActive;
 }
 
 //------------------------------------------------------------------------------
 
-void updateHaptics(void)
-{
-	simulationRunning = true;
-	simulationFinished = false;
+// Hands the state of the finished tick to the render thread; never blocks.
+// A tick that changed nothing on screen is not published, so the frame
+// pacer can skip the frame.
+void ShooterSession::publishHapticSnapshot(void) {
+	hapticState.toolPos = tool->getDeviceGlobalPos();
+	hapticState.toolRot = tool->getGlobalRot();
+	hapticState.score = score;
+	hapticState.hits = hits.load(std::memory_order_acquire);
+	hapticState.lastHitRegion = lastHitRegion.load(std::memory_order_relaxed);
+	// the time trial belongs to the first station's thread
+	if (index == 0) {
+		hapticState.timeTrialActive = timeTrialActive;
+		hapticState.timeTrialsFinished = timeTrialsFinished;
+		if (timeTrialActive) {
+			int elapsedSeconds = (int)((hapticClockNs - timeTrialStartNs) / 1000000000LL);
+			hapticState.remainingTime = timeTrialDuration - elapsedSeconds;
+		}
+	}
 
-	auto lastUpdate = std::chrono::high_resolution_clock::now();
-	const std::chrono::milliseconds updatePeriod(1);
+	if (hapticState.generation != 0 && sameDrawnState(hapticState, lastPublished)) {
+		return;
+	}
+	hapticState.generation++;
+	hapticState.publishNs = monotonicNs();
 
-	while (simulationRunning)
-	{
-		auto now = std::chrono::high_resolution_clock::now();
-		if (now - lastUpdate >= updatePeriod)
-		{
-			{
-				std::lock_guard<std::mutex> deviceLock(deviceMutex);
-				std::lock_guard<std::mutex> weaponLock(weaponMutex);
+	hapticSnapshots.writeBuffer() = hapticState;
+	hapticSnapshots.publish();
+	lastPublished = hapticState;
+	publishedGeneration.fetch_add(1, std::memory_order_release);
+}
 
-				// Get current time in seconds
-				double currentTime = std::chrono::duration_cast<std::chrono::duration<double>>(
-					std::chrono::high_resolution_clock::now().time_since_epoch()
-					).count();
+//------------------------------------------------------------------------------
 
-				world->computeGlobalPositions(true);
-				tool->updateFromDevice();
+// Every force sent to the device goes through here, so the session recorder
+// sees what was actually commanded. With the force thread running, the first
+// station's device belongs to that thread; a zero force stops the posted shot
+// instead.
+void ShooterSession::sendForce(const cVector3d& force, const cVector3d& torque) {
+	commandedForce = force;
+	commandedTorque = torque;
+	if (index == 0 && forceThreadRunning) {
+		if (force.equals(zero_vector) && torque.equals(zero_vector)) {
+			postRecoil(nullptr, 0);
+		}
+		return;
+	}
+	hapticDevice->setForceAndTorque(force, torque);
+}
 
-				updateWeaponPositionAndOrientation(hapticDevice, tool);
+// Haptic thread: copies this tick's inputs and outputs into the recorder's
+// ring, or hands them to the replay to compare
+void ShooterSession::recordSessionTick(unsigned int switches, unsigned int inputFlags, bool triggerEdge, const TargetHit* hit) {
+	SessionTickRecord r;
+	memset(&r, 0, sizeof(r));
+	r.timeNs = hapticClockNs;
+	if (sessionTap) {
+		storeVector(r.devicePos, sessionTap->lastPosition);
+	}
+	const CameraPose& cameraPose = cameraPoses.readBuffer();
+	storeVector(r.cameraPos, cameraPose.pos);
+	storeVector(r.cameraLook, cameraPose.look);
+	storeVector(r.force, commandedForce);
+	storeVector(r.torque, commandedTorque);
+	storeVector(r.crosshairPos, hapticState.crosshairPos);
+	r.buttons = (uint8_t)switches;
+	r.weapon = (uint8_t)hapticState.activeWeapon;
+	r.flags = (uint8_t)(inputFlags | (triggerEdge ? SESSION_TRIGGER_EDGE : 0) | (hit != nullptr ? SESSION_HIT : 0));
+	r.hitRegion = (hit != nullptr) ? (uint8_t)hit->region : 0;
+	r.hitTarget = (hit != nullptr) ? (int16_t)hit->target : -1;
+	r.score = (int16_t)score.load();
+	if (replayDevice) {
+		replayOutput = r;
+		return;
+	}
+	sessionRecorder.record(r);
+}
 
-				cVector3d toolP;
-				currentToolP = tool->getDeviceGlobalPos();
-				cVector3d toolMovement = currentToolP - lastToolP;
-				cVector3d toolMovementDirection;
-				toolMovement.normalizer(toolMovementDirection);
+//------------------------------------------------------------------------------
 
-				if (toolMovement.y() > 0){
-					currentToolP.add(cVector3d(0, toolMovement.y()*toolMovementDirection.y(), 0));
-				}
+// Force-critical work, runs on every haptic tick: device read, recoil, force write
+void ShooterSession::hapticTick(double currentTime)
+{
+	// Latest camera pose and keys from the render thread
+	cameraPoses.update();
+	hapticInput.rotateLeft = rotateLeft;
+	hapticInput.rotateRight = rotateRight;
+	bool timeTrialRequest = (index == 0) && timeTrialRequested.exchange(false);
+	hapticInput.timeTrialRequest = hapticInput.timeTrialRequest || timeTrialRequest;
+
+	// Only subtrees that moved since the last tick: the tool when the camera
+	// moved it, targets the scene task relocated
+	{
+		ScopedStageTimer timer(STAGE_GLOBAL_POSITIONS);
+		transforms.update();
+		if (index == 0) {
+			sceneTransforms.update();
+		}
+	}
+	{
+		ScopedStageTimer timer(STAGE_DEVICE_READ);
+		tool->updateFromDevice();
+	}
+	{
+		ScopedStageTimer timer(STAGE_WEAPON_POSE);
+		updateWeaponPositionAndOrientation();
+	}
 
-				if (isPistolLoaded){
-					cVector3d targetPos = currentToolP + cVector3d(-2.0, 0, 0.1);
-					crosshair->setPosition(targetPos);
-				}
-				else if (isRifleLoaded){
-					cVector3d targetPos = currentToolP + cVector3d(-2.0, 0, 0.5);
-					crosshair->setPosition(targetPos);
-				}
-				else {
-					cVector3d targetPos = currentToolP + cVector3d(-2.0, 0, 0.0);
-					crosshair->setPosition(targetPos);
-				}
+	cVector3d toolP;
+	currentToolP = tool->getDeviceGlobalPos();
+	cVector3d toolMovement = currentToolP - lastToolP;
+	cVector3d toolMovementDirection;
+	toolMovement.normalizer(toolMovementDirection);
 
-				dynamicTarget1->update(currentTime);
-				//dynamicTarget2->update(currentTime);
-				//dynamicTarget3->update(currentTime);
+	if (toolMovement.y() > 0){
+		currentToolP.add(cVector3d(0, toolMovement.y()*toolMovementDirection.y(), 0));
+	}
 
-				updateLights(currentTime);
-				updateBlockTransparency(world, tool);
-			}
+	if (isPistolLoaded){
+		hapticState.crosshairPos = currentToolP + cVector3d(-2.0, 0, 0.1);
+	}
+	else if (isRifleLoaded){
+		hapticState.crosshairPos = currentToolP + cVector3d(-2.0, 0, 0.5);
+	}
+	else {
+		hapticState.crosshairPos = currentToolP + cVector3d(-2.0, 0, 0.0);
+	}
 
-			if (is_pressed) {
-				elapsed_time = currentTimeMillis() - time_start;
-			}
-			else {
-				elapsed_time = 0;
-			}
+	if (is_pressed) {
+		elapsed_us = hapticClockUs() - time_start_us;
+	}
+	else {
+		elapsed_us = 0;
+	}
 
-			bool button0, button1, button2, button3;
-			hapticDevice->getUserSwitch(0, button0);
-			hapticDevice->getUserSwitch(1, button1);
-			hapticDevice->getUserSwitch(2, button2);
-			hapticDevice->getUserSwitch(3, button3);
+	bool button0, button1, button2, button3;
+	hapticDevice->getUserSwitch(0, button0);
+	hapticDevice->getUserSwitch(1, button1);
+	hapticDevice->getUserSwitch(2, button2);
+	hapticDevice->getUserSwitch(3, button3);
+	unsigned int switches = (button0 ? 1u : 0u) | (button1 ? 2u : 0u) | (button2 ? 4u : 0u) | (button3 ? 8u : 0u);
 
-			if (sniperFiring) {
-				is_pressed = true;
-				button0 = true;
-			}
+	if (sniperFiring) {
+		is_pressed = true;
+		button0 = true;
+	}
 
-			if (pistolFiring) {
-				is_pressed = true;
-				button0 = true;
-			}
+	if (pistolFiring) {
+		is_pressed = true;
+		button0 = true;
+	}
 
-			if (!is_pressed && button0) {
-				is_pressed = true;
-				time_start = currentTimeMillis();
-			}
+	bool triggerEdge = false;
+	if (!is_pressed && button0) {
+		is_pressed = true;
+		time_start_us = hapticClockUs();
+		beginRecoilShot();
+		rifleFire.begin(RIFLE_RECOIL.cyclic_rpm);
+		triggerEdge = true;
+	}
 
-			cVector3d weaponPosition = tool->getDeviceGlobalPos();
-			cVector3d crosshairPosition = crosshair->getPosition();
+	cVector3d weaponPosition = tool->getDeviceGlobalPos();
+	cVector3d crosshairPosition = hapticState.crosshairPos;
+	TargetHit hit;
+	bool targetHit = false;
 
-			// Get current time
-			double currentTime = std::chrono::duration_cast<std::chrono::duration<double>>(
-				std::chrono::high_resolution_clock::now().time_since_epoch()
-				).count();
+	if (is_pressed && button0) {
+		{
+			ScopedStageTimer timer(STAGE_RECOIL);
+			if (isPistolLoaded) {
+				apply_pistol_force();
+			}
+			else if (isRifleLoaded) {
+				apply_rifle_force();
+			}
+			else if (isDragunovLoaded) {
+				apply_sniper_force();
+			}
+		}
 
-			if (is_pressed && button0) {
-				if (isPistolLoaded) {
-					apply_pistol_force();
-				}
-				else if (isRifleLoaded) {
-					apply_rifle_force();
-				}
-				else if (isDragunovLoaded) {
-					apply_sniper_force();
-				}
-				if (dynamicTarget1->checkHit(weaponPosition, crosshairPosition)) {
-					// Handle hit on target 1
-					dynamicTarget1->moveOnHit(currentTime);
-					std::cout << "Hit!" << std::endl;
+		// The targets belong to the first station's thread; the others hand it their shots
+		ShotRequest shot;
+		shot.origin = weaponPosition;
+		shot.direction = crosshairPosition - weaponPosition;
+		if (index == 0) {
+			targetHit = resolveShot(shot, currentTime, hit);
+		}
+		else {
+			stationShots[index].push(shot);  // dropped if the first station has fallen 64 ticks behind
+		}
+	}
 
-					if (timeTrialActive) {
-						score++;
-					}
+	// Shots of the other stations since the last tick
+	if (index == 0) {
+		for (size_t i = 1; i < sessions.size(); i++) {
+			ShotRequest pending[8];
+			size_t count;
+			while ((count = stationShots[i].pop(pending, 8)) > 0) {
+				for (size_t k = 0; k < count; k++) {
+					TargetHit stationHit;
+					sessions[i]->resolveShot(pending[k], currentTime, stationHit);
 				}
-				//if (dynamicTarget2->checkHit(weaponPosition, crosshairPosition)) {
-				//	// Handle hit on target 2
-				//	dynamicTarget2->moveOnHit(currentTime);
-				//	if (timeTrialActive) {
-				//		std::cout << "Hit detected!" << std::endl;
-				//		score++;
-				//		cout << "Hit! Current score: " << score << endl;
-				//	}
-				//}
-				//if (dynamicTarget3->checkHit(weaponPosition, crosshairPosition)) {
-				//	// Handle hit on target 3
-				//	dynamicTarget3->moveOnHit(currentTime);
-				//	if (timeTrialActive) {
-				//		std::cout << "Hit detected!" << std::endl;
-				//		score++;
-				//		cout << "Hit! Current score: " << score << endl;
-				//	}
-				//}
 			}
+		}
+	}
 
-			if (!(is_pressed && button0)) {
-				hapticDevice->setForce(zero_vector);
-				bulletTraj->setShowEnabled(false);
-			}
+	if (!(is_pressed && button0)) {
+		sendForce(zero_vector, zero_vector);
+		hapticState.showTrajectory = false;
+	}
 
-			if (is_pressed && !button0) {
-				hapticDevice->setForce(zero_vector);
-				is_pressed = false;
-			}
+	if (is_pressed && !button0) {
+		sendForce(zero_vector, zero_vector);
+		is_pressed = false;
+	}
 
-			if (button1 && !isPistolLoaded) {
-				tool->m_image = weapon_pistol;
-				isPistolLoaded = true;
-				isDragunovLoaded = false;
-				isRifleLoaded = false;
-				updateWeaponLabel();
-			}
-			else if (button2 && !isRifleLoaded) {
-				tool->m_image = weapon_rifle;
-				isPistolLoaded = false;
-				isDragunovLoaded = false;
-				isRifleLoaded = true;
-				updateWeaponLabel();
-			}
-			else if (button3 && !isDragunovLoaded) {
-				tool->m_image = weapon_dragunov;
-				isPistolLoaded = false;
-				isDragunovLoaded = true;
-				isRifleLoaded = false;
-				updateWeaponLabel();
-			}
+	if (button1 && !isPistolLoaded) {
+		hapticState.activeWeapon = WEAPON_PISTOL;
+		isPistolLoaded = true;
+		isDragunovLoaded = false;
+		isRifleLoaded = false;
+	}
+	else if (button2 && !isRifleLoaded) {
+		hapticState.activeWeapon = WEAPON_RIFLE;
+		isPistolLoaded = false;
+		isDragunovLoaded = false;
+		isRifleLoaded = true;
+	}
+	else if (button3 && !isDragunovLoaded) {
+		hapticState.activeWeapon = WEAPON_DRAGUNOV;
+		isPistolLoaded = false;
+		isDragunovLoaded = true;
+		isRifleLoaded = false;
+	}
 
-			updateTimeTrial();
+	{
+		ScopedStageTimer timer(STAGE_INTERACTION);
+		tool->computeInteractionForces();
+	}
+	lastToolP = currentToolP;
 
-			{
-				std::lock_guard<std::mutex> deviceLock(deviceMutex);
-				std::lock_guard<std::mutex> weaponLock(weaponMutex);
+	// the force plot, the recorder and the replay follow the first station
+	if (index != 0) {
+		return;
+	}
 
-				tool->computeInteractionForces();
-				lastToolP = currentToolP;
-			}
+	if (forceHistorySamples > 0) {
+		forceHistory.push(commandedForce * FORCE_SCALE);
+	}
 
-			graphicsUpdateFlag = true;
-			lastUpdate = now;
+	if (sessionRecorder.isRecording() || replayDevice) {
+		unsigned int inputFlags = (hapticInput.rotateLeft ? SESSION_ROTATE_LEFT : 0)
+			| (hapticInput.rotateRight ? SESSION_ROTATE_RIGHT : 0)
+			| (timeTrialRequest ? SESSION_TIME_TRIAL_REQUEST : 0);
+		recordSessionTick(switches, inputFlags, triggerEdge, targetHit ? &hit : nullptr);
+	}
+}
+
+// First station's thread: tests a shot of this station against the targets
+// and scores it
+bool ShooterSession::resolveShot(const ShotRequest& shot, double currentTime, TargetHit& hit)
+{
+	// Nearest target triangle along the shot ray
+	bool targetHit;
+	{
+		ScopedStageTimer timer(STAGE_HIT_TEST);
+		targetHit = findShotHit(shot.origin, shot.direction, hit);
+	}
+	if (targetHit) {
+		dynamicTargets[hit.target]->moveOnHit(currentTime);
+		refreshTargetBounds(hit.target);
+		// the render thread prints hits, see reportHits()
+		lastHitRegion.store(hit.region, std::memory_order_relaxed);
+		hits.fetch_add(1, std::memory_order_release);
+
+		if (timeTrialActive) {
+			score++;
+		}
+	}
+	return targetHit;
+}
+
+// Scene logic that does not need the haptic rate
+void sceneTick(double currentTime)
+{
+	ScopedStageTimer timer(STAGE_SCENE);
+
+	for (size_t i = 0; i < dynamicTargets.size(); i++) {
+		if (dynamicTargets[i]->update(currentTime)) {
+			refreshTargetBounds((int)i);
 		}
 	}
-	simulationFinished = true;
+
+	updateTimeTrial();
+}
+
+// Cosmetic effects, run once per rendered frame
+void effectsTick(double currentTime)
+{
+	updateLights(currentTime);
+
+	ScopedStageTimer timer(STAGE_BLOCK_FADE);
+	updateBlockTransparency(sessions[0]->hapticSnapshots.readBuffer().toolPos);
 }
+
 //------------------------------------------------------------------------------
 
-__int64 currentTimeMillis() {
-	FILETIME f;
-	GetSystemTimeAsFileTime(&f);
-	(long long)f.dwHighDateTime;
-	__int64 nano = ((__int64)f.dwHighDateTime << 32LL) + (__int64)f.dwLowDateTime;
-	return (nano - 116444736000000000LL) / 10000;
+// Haptic loop of one station. The first station's clock is the game clock,
+// and only its ticks go into the stage, worst-tick and benchmark statistics.
+void ShooterSession::run(void)
+{
+	stageTimingThread = (index == 0);
+	hapticScheduler.configureThread(hapticRealtime, cpu, hapticLockMemory);
+	hapticScheduler.start();
+	long long cpuStartNs = threadCpuNs();
+
+	while (simulationRunning)
+	{
+		long long tickDueNs = hapticScheduler.waitForNextTick();
+		long long tickStartNs = monotonicNs();
+		auto now = std::chrono::high_resolution_clock::now();
+		clockNs = tickDueNs - hapticClockStartNs;
+		if (index == 0) {
+			hapticClockNs = clockNs;
+		}
+
+		{
+			ScopedStageTimer timer(STAGE_TICK);
+			hapticTasks.run(clockNs, clockNs / 1e9);
+
+			ScopedStageTimer publishTimer(STAGE_PUBLISH);
+			publishHapticSnapshot();
+		}
+
+		if (index != 0) {
+			continue;
+		}
+
+		long long tickUs = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::high_resolution_clock::now() - now).count();
+		if (tickUs > hapticTickWorstUs.load(std::memory_order_relaxed)) {
+			hapticTickWorstUs.store(tickUs, std::memory_order_relaxed);
+		}
+		hapticTickCount.fetch_add(1, std::memory_order_relaxed);
+
+		if (tickRecorder.enabled) {
+			tickRecorder.record(tickStartNs, monotonicNs());
+		}
+	}
+
+	long long cpuEndNs = threadCpuNs();
+	if (index == 0) {
+		hapticThreadCpuNs = (cpuStartNs >= 0 && cpuEndNs >= 0) ? cpuEndNs - cpuStartNs : -1;
+	}
+	leaveHapticThread();
 }
 
+// Haptic thread for --replay: runs the recorded ticks through the same tick
+// code, as fast as possible or at the recorded times, and compares every
+// tick's output with the recording
+void replayHaptics(void)
+{
+	ShooterSession& station = *sessions[0];
+	long long startNs = monotonicNs();
+	size_t replayed = 0;
+	unsigned long long hits = 0;
+
+	for (size_t i = 0; i < replayRecords.size() && simulationRunning; i++) {
+		const SessionTickRecord& recorded = replayRecords[i];
+		if (replayRealtime) {
+			sleepUntilNs(startNs + recorded.timeNs - replayRecords[0].timeNs);
+		}
+
+		// inputs of the recorded tick
+		replayDevice->setSample(recorded);
+		CameraPose& pose = station.cameraPoses.writeBuffer();
+		pose.pos.set(recorded.cameraPos[0], recorded.cameraPos[1], recorded.cameraPos[2]);
+		pose.look.set(recorded.cameraLook[0], recorded.cameraLook[1], recorded.cameraLook[2]);
+		station.cameraPoses.publish();
+		rotateLeft = (recorded.flags & SESSION_ROTATE_LEFT) != 0;
+		rotateRight = (recorded.flags & SESSION_ROTATE_RIGHT) != 0;
+		if (recorded.flags & SESSION_TIME_TRIAL_REQUEST) {
+			timeTrialRequested = true;
+		}
+		hapticClockNs = recorded.timeNs;
+		station.clockNs = hapticClockNs;
+
+		station.hapticTasks.run(hapticClockNs, hapticClockNs / 1e9);
+		station.publishHapticSnapshot();
+		replayed++;
+
+		if (replayOutput.flags & SESSION_HIT) hits++;
+		if (!sameTickOutput(replayOutput, recorded)) {
+			if (replayMismatches == 0) {
+				printf("Replay diverged at tick %llu (%.3f s): force %.6f %.6f %.6f, recorded %.6f %.6f %.6f\n",
+					(unsigned long long)recorded.tick, recorded.timeNs / 1e9,
+					replayOutput.force[0], replayOutput.force[1], replayOutput.force[2],
+					recorded.force[0], recorded.force[1], recorded.force[2]);
+			}
+			replayMismatches++;
+		}
+	}
+
+	double wallS = (monotonicNs() - startNs) / 1e9;
+	double sessionS = (replayRecords.back().timeNs - replayRecords[0].timeNs) / 1e9;
+	printf("Replayed %zu of %zu ticks (%.1f s of session) in %.2f s, %.1fx real time: %llu hits, final score %d, %llu mismatching ticks\n",
+		replayed, replayRecords.size(), sessionS, wallS, wallS > 0.0 ? sessionS / wallS : 0.0,
+		hits, (int)replayOutput.score, replayMismatches);
+
+	simulationRunning = false;
+	leaveHapticThread();
+}
 //------------------------------------------------------------------------------
 
-void applyTextureToWeapon(cMultiMesh* weapon, const std::string& texturePath) {
-	cTexture2dPtr weaponTexture = cTexture2d::create();
-	bool fileload = weaponTexture->loadFromFile(RESOURCE_PATH(texturePath.c_str())); // change accordingly
+// Resource files are looked up in ../resources, then in the MSVC build's copy
+bool loadModelFile(cMultiMesh* model, const string& file, string* loadedPath, uint32_t variant,
+	const std::function<void(cMultiMesh*)>& prepare) {
+	string path = RESOURCE_PATH(("../resources/" + file).c_str()); // change accordingly
+	bool fileload = loadMeshCached(model, path, variant, prepare) != MESH_LOAD_FAILED;
 	if (!fileload) {
 #if defined(_MSVC)
-		fileload = weaponTexture->loadFromFile((std::string("../../../bin/resources/") + texturePath).c_str()); // change accordingly
+		path = "../../../bin/resources/" + file; // change accordingly
+		fileload = loadMeshCached(model, path, variant, prepare) != MESH_LOAD_FAILED;
+#endif
+	}
+	if (fileload && loadedPath != nullptr) {
+		*loadedPath = path;
+	}
+	return fileload;
+}
+
+bool loadImageFile(cImagePtr& image, const string& file) {
+	image = cImage::create();
+	bool fileload = image->loadFromFile(RESOURCE_PATH(("../resources/" + file).c_str())); // change accordingly
+	if (!fileload) {
+#if defined(_MSVC)
+		fileload = image->loadFromFile("../../../bin/resources/" + file); // change accordingly
 #endif
 	}
 	if (!fileload) {
-		cout << "Error - Texture file failed to load correctly: " << texturePath << endl;
+		image = nullptr;
+	}
+	return fileload;
+}
+
+bool loadTextureFile(MipChainTexturePtr& texture, const string& file) {
+	texture = loadTextureCached(RESOURCE_PATH(("../resources/" + file).c_str()), maxTextureSize); // change accordingly
+	if (!texture) {
+#if defined(_MSVC)
+		texture = loadTextureCached("../../../bin/resources/" + file, maxTextureSize); // change accordingly
+#endif
+	}
+	return texture != nullptr;
+}
+
+// Loader thread: parse and scale one weapon; leaves the pointer null on failure
+// Loads one of WEAPON_MODELS with its LOD levels and collision proxy
+bool loadWeaponModel(int type, cMultiMesh*& weapon) {
+	const string file = WEAPON_MODELS[type].file;
+	const double scale = WEAPON_MODELS[type].scale;
+	WeaponLods& lods = weaponLods[type];
+
+	// the weapon gets one texture and material in finishStartup, so all of
+	// its submeshes can share a buffer; the merged model is what gets cached,
+	// so this only runs when the OBJ changes
+	auto optimize = [type](cMultiMesh* model) { weaponMeshStats[type] = optimizeModel(model, true); };
+	string path;
+	if (!loadModelFile(weapon, file, &path, MESH_CACHE_OPTIMIZED, optimize)) {
+		delete weapon;
+		weapon = nullptr;
+		return false;
+	}
+
+	// reduced levels are built from (and cached for) the unscaled model
+	lods.levels[0] = weapon;
+	for (int level = 1; level < WEAPON_LOD_COUNT; level++) {
+		lods.levels[level] = new cMultiMesh();
+		loadLodCached(lods.levels[level], weapon, path, level);
+	}
+	for (int level = 0; level < WEAPON_LOD_COUNT; level++) {
+		lods.levels[level]->scale(scale);
+	}
+
+	weapon->computeBoundaryBox(true);
+	lods.radius = 0.5 * (weapon->getBoundaryMax() - weapon->getBoundaryMin()).length();
+
+	if (contactBenchTicks > 0) {
+		weaponProxies[type] = buildCollisionProxy(weapon, WEAPON_PROXY_BOXES);
+	}
+	return true;
+}
+
+// Runs the tool's contact computation against one model placed at the
+// origin of a world of its own, along a fixed sweep from a stand-in device
+// that passes through the model, and returns the time of each call
+void benchContact(cMultiMesh* model, const cVector3d& center, double radius, int ticks,
+	StageHistogram::Snapshot& timing, double& contactShare) {
+	SessionFileHeader header;
+	memset(&header, 0, sizeof(header));
+	header.workspaceRadius = 0.04;  // Falcon
+	header.maxLinearStiffness = 2000.0;
+	std::shared_ptr<ReplayHapticDevice> device = std::make_shared<ReplayHapticDevice>(header);
+
+	cWorld* benchWorld = new cWorld();
+	cToolCursor* probe = new cToolCursor(benchWorld);
+	benchWorld->addChild(probe);
+	probe->setHapticDevice(device);
+	probe->setRadius(toolRadius);
+	probe->setWorkspaceRadius(1.2 * radius);
+	probe->start();
+
+	benchWorld->addChild(model);
+	model->setLocalPos(-center);
+	model->setHapticEnabled(true);
+	model->createAABBCollisionDetector(toolRadius);
+	model->setStiffness(0.5 * header.maxLinearStiffness / probe->getWorkspaceScaleFactor(), true);
+	benchWorld->computeGlobalPositions(true);
+
+	StageHistogram histogram;
+	SessionTickRecord sample;
+	memset(&sample, 0, sizeof(sample));
+	int contacts = 0;
+	for (int i = 0; i < ticks; i++) {
+		double t = i / 1000.0;
+		cVector3d p(0.9 * sin(1.1 * t), 0.9 * sin(1.7 * t), 0.9 * sin(2.3 * t));
+		storeVector(sample.devicePos, p * header.workspaceRadius);
+		device->setSample(sample);
+		probe->updateFromDevice();
+
+		long long startNs = monotonicNs();
+		probe->computeInteractionForces();
+		histogram.record(monotonicNs() - startNs);
+
+		if (probe->getDeviceGlobalForce().lengthsq() > 0.0) contacts++;
+	}
+	histogram.read(timing);
+	contactShare = (double)contacts / ticks;
+
+	// the process exits after the bench, so the world is left as it is
+	probe->stop();
+	benchWorld->removeChild(model);
+}
+
+// --contact-bench: computeInteractionForces against each weapon's full mesh
+// and against its collision proxy, on the same path
+void runContactBench(void) {
+	cout << "Contact bench, " << contactBenchTicks << " ticks per model" << endl;
+	cout << "  model                  triangles  contact %     p50 us     p99 us     max us" << endl;
+	for (int w = 0; w < 3; w++) {
+		cMultiMesh* model = new cMultiMesh();
+		if (!loadWeaponModel(w, model)) {
+			printf("  %-22s not found\n", WEAPON_MODELS[w].file);
+			continue;
+		}
+		cVector3d center = 0.5 * (model->getBoundaryMin() + model->getBoundaryMax());
+		double radius = weaponLods[w].radius;
+
+		cMultiMesh* variants[2] = { model, weaponProxies[w] };
+		const char* labels[2] = { "full", "proxy" };
+		for (int v = 0; v < 2; v++) {
+			StageHistogram::Snapshot timing;
+			double contactShare;
+			benchContact(variants[v], center, radius, contactBenchTicks, timing, contactShare);
+			string name = string(WEAPON_MODELS[w].file) + " " + labels[v];
+			printf("  %-22s %9u %10.1f %10.2f %10.2f %10.2f\n", name.c_str(), variants[v]->getNumTriangles(),
+				100.0 * contactShare, timing.percentileUs(0.5), timing.percentileUs(0.99), timing.maxUs());
+		}
+	}
+}
+
+// Hangs the reduced levels under the weapon so they follow its pose and take
+// the settings applied to it afterwards; each mesh gets the texture of the
+// mesh it was reduced from. Only level 0 is shown until updateWeaponLod runs.
+void attachWeaponLods(cMultiMesh* weapon, WeaponLods& lods, const string& name) {
+	cout << "Weapon LODs " << name << ":";
+	for (int level = 0; level < WEAPON_LOD_COUNT; level++) {
+		cMultiMesh* lod = lods.levels[level];
+		cout << (level == 0 ? " " : " / ") << lod->getNumTriangles();
+		if (level == 0) continue;
+		for (int m = 0; m < lod->getNumMeshes() && m < weapon->getNumMeshes(); m++) {
+			lod->getMesh(m)->setTexture(weapon->getMesh(m)->m_texture);
+			lod->getMesh(m)->setUseTexture(weapon->getMesh(m)->getUseTexture());
+		}
+		weapon->addChild(lod);
+		lod->setShowEnabled(false);
+	}
+	cout << " triangles" << endl;
+	lods.current = 0;
+}
+
+// Picks the level of the displayed weapon from its projected height on
+// screen and shows only that level's meshes
+void ShooterSession::updateWeaponLod(int weapon) {
+	WeaponLods& active = lods[weapon];
+	cMultiMesh* model = active.levels[0];
+	double distance = cMax(cDistance(model->getGlobalPos(), camera->getGlobalPos()), 1e-6);
+	double halfFov = 0.5 * cDegToRad(camera->getFieldViewAngleDeg());
+	double pixels = lodScale * windowH * active.radius / (distance * tan(halfFov));
+	int level = active.select(pixels);
+
+	// showing or hiding a weapon resets its children, so reapply on a switch
+	if (weapon == shownWeapon && level == shownLevel) {
+		return;
+	}
+	shownWeapon = weapon;
+	shownLevel = level;
+	for (int m = 0; m < model->getNumMeshes(); m++) {
+		model->getMesh(m)->setShowEnabled(level == 0, false);
+	}
+	for (int k = 1; k < WEAPON_LOD_COUNT; k++) {
+		active.levels[k]->setShowEnabled(level == k, true);
+	}
+}
+
+void applyTextureToWeapon(cMultiMesh* weapon, MipChainTexturePtr weaponTexture, const std::string& name) {
+	if (!weaponTexture) {
+		cout << "Error - Texture file failed to load correctly: " << name << endl;
 		return;
 	}
 
@@ -1062,72 +6451,71 @@ void applyTextureToWeapon(cMultiMesh* weapon, const std::string& texturePath) {
 //------------------------------------------------------------------------------
 
 void createBlocks(cWorld* world) {
-	for (int i = 0; i < 5; i++) {
-		for (int j = 0; j < 5; j++) {
-			cMesh* block = new cMesh();
-			world->addChild(block);
-			cCreateBox(block, 0.0, 0.0, 0.0);//  +(rand() % 100) / 100.0);
-			block->setLocalPos(i * 1.0 - 2.0, j * 1.0 - 2.0, 0.0);
-			cMaterial material;
-			material.setBlueDeepSky();
-			block->setMaterial(material);
-			block->setUseTransparency(true);
+	double offset = (blockGridSize - 1) / 2.0;
+	cColorf color;
+	color.setBlueDeepSky();
+	blocks.reserve(blockGridSize * blockGridSize);
+	for (int i = 0; i < blockGridSize; i++) {
+		for (int j = 0; j < blockGridSize; j++) {
+			BlockInstance block;
+			storeVector(block.pos, cVector3d(i * 1.0 - offset, j * 1.0 - offset, 0.0));
+			storeVector(block.size, cVector3d(BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE));
+			block.color[0] = color.getR();
+			block.color[1] = color.getG();
+			block.color[2] = color.getB();
+			block.color[3] = 1.0f;
 			blocks.push_back(block);
+			blockGrid.add(getBlockBounds((int)blocks.size() - 1));
 		}
 	}
-}
 
-bool checkCollision(const cVector3d& position) {
-	for (const auto& block : blocks) {
-		cVector3d blockPos = block->getLocalPos();
-		cVector3d blockSize(0.5, 0.5, 0.5);  // Assuming blocks are 0.5 units in each dimension
+	blockRenderer = new InstancedBlockRenderer();
+	world->addChild(blockRenderer);
+}
 
-		// Check if position is within the block's bounds
-		if (position.x() >= blockPos.x() - blockSize.x() / 2 && position.x() <= blockPos.x() + blockSize.x() / 2 &&
-			position.y() >= blockPos.y() - blockSize.y() / 2 && position.y() <= blockPos.y() + blockSize.y() / 2 &&
-			position.z() >= blockPos.z() - blockSize.z() / 2 && position.z() <= blockPos.z() + blockSize.z() / 2) {
-			return true;  // Collision detected
-		}
-	}
-	return false;  // No collision
+// World-space bounds of a block
+Aabb getBlockBounds(int index) {
+	const BlockInstance& block = blocks[index];
+	Aabb box;
+	box.min.set(block.pos[0] - 0.5 * block.size[0], block.pos[1] - 0.5 * block.size[1], block.pos[2] - 0.5 * block.size[2]);
+	box.max.set(block.pos[0] + 0.5 * block.size[0], block.pos[1] + 0.5 * block.size[1], block.pos[2] + 0.5 * block.size[2]);
+	return box;
 }
 
 
 //------------------------------------------------------------------------------
 
+// Base orientation of each model, computed once at startup
 void setInitialWeaponOrientations(void) {
 	// Pistol orientation
 	pistolOrientation.identity();
 	pistolOrientation.rotateAboutGlobalAxisDeg(1, 0, 0, 90); // - up + down
 	pistolOrientation.rotateAboutGlobalAxisDeg(0, 1, 0, 0);
 	pistolOrientation.rotateAboutGlobalAxisDeg(0, 0, 1, -90); // was -90
-	weapon_pistol->setLocalRot(pistolOrientation);
 
 	// Dragunov orientation
 	dragunovOrientation.identity();
 	dragunovOrientation.rotateAboutGlobalAxisDeg(1, 0, 0, 90); // lean right left (- right + left)
 	dragunovOrientation.rotateAboutGlobalAxisDeg(0, 1, 0, 0); // + up - down 
 	dragunovOrientation.rotateAboutGlobalAxisDeg(0, 0, 1, 0); // was 0 
-	weapon_dragunov->setLocalRot(dragunovOrientation);
 
 	// Rifle orientation
 	rifleOrientation.identity();
 	rifleOrientation.rotateAboutGlobalAxisDeg(1, 0, 0, 180); 
 	rifleOrientation.rotateAboutGlobalAxisDeg(0, 1, 0, 180); // + up - down
 	rifleOrientation.rotateAboutGlobalAxisDeg(0, 0, 1, 0); // was 0
-	weapon_rifle->setLocalRot(rifleOrientation);
 }
 
 //------------------------------------------------------------------------------
 
-void updateWeaponPositionAndOrientation(cGenericHapticDevicePtr hapticDevice, cToolCursor* tool) {
-	setInitialWeaponOrientations();
+void ShooterSession::updateWeaponPositionAndOrientation(void) {
 
-	// Get camera position and orientation
-	cVector3d camPosition = camera->getLocalPos();
+	// Get camera position and orientation, as last published by the render thread
+	const CameraPose& cameraPose = cameraPoses.readBuffer();
+	cVector3d camPosition = cameraPose.pos;
 
 	// Get the camera's direction
-	cVector3d cameraDir = camera->getLookVector();
+	cVector3d cameraDir = cameraPose.look;
 	cameraDir.normalize();
 
 	// Define a fixed offset for the weapon in camera space
@@ -1138,119 +6526,102 @@ void updateWeaponPositionAndOrientation(cGenericHapticDevicePtr hapticDevice, cT
 
 	cVector3d offsetPos = weaponPosition + cameraDir * 0.1;  // Adjust 0.1 as needed
 
-	tool->setLocalPos(offsetPos);
+	// Further stations stand to the right of the first
+	if (index > 0) {
+		cVector3d right = cCross(cameraDir, cVector3d(0, 0, 1));
+		right.normalize();
+		offsetPos += right * (STATION_SPACING * index);
+	}
+
+	if (!offsetPos.equals(tool->getLocalPos(), 0.0)) {
+		tool->setLocalPos(offsetPos);
+		transforms.markDirty(tool);
+	}
 
 	// Apply weapon rotation
-	if (rotateLeft && currentRotationAngle > -MAX_ROTATION_ANGLE) {
-		currentRotationAngle -= WEAPON_ROTATION_SPEED;
+	if (hapticInput.rotateLeft && currentRotationAngle > -MAX_ROTATION_ANGLE) {
+		currentRotationAngle -= WEAPON_ROTATION_SPEED * HAPTIC_RATE_HZ / hapticRateHz;
 		currentRotationAngle = cMax(currentRotationAngle, -MAX_ROTATION_ANGLE);
 	}
-	if (rotateRight && currentRotationAngle < MAX_ROTATION_ANGLE) {
-		currentRotationAngle += WEAPON_ROTATION_SPEED;
+	if (hapticInput.rotateRight && currentRotationAngle < MAX_ROTATION_ANGLE) {
+		currentRotationAngle += WEAPON_ROTATION_SPEED * HAPTIC_RATE_HZ / hapticRateHz;
 		currentRotationAngle = cMin(currentRotationAngle, MAX_ROTATION_ANGLE);
 	}
 
-	// Create rotation matrix based on the current rotation angle
-	cMatrix3d rotZ;
-	rotZ.identity();
-	rotZ.rotateAboutLocalAxisRad(cVector3d(0, 1, 0), currentRotationAngle);
-	cMatrix3d rotZR;
-	rotZR.identity();
-	rotZR.rotateAboutLocalAxisRad(cVector3d(0, 0, 1), currentRotationAngle);
+	// Rotation matrices for the current rotation angle, rebuilt only when it changes
+	if (!rotationCached || currentRotationAngle != cachedRotationAngle) {
+		rotZ.identity();
+		rotZ.rotateAboutLocalAxisRad(cVector3d(0, 1, 0), currentRotationAngle);
+		rotZR.identity();
+		rotZR.rotateAboutLocalAxisRad(cVector3d(0, 0, 1), currentRotationAngle);
+		cachedRotationAngle = currentRotationAngle;
+		rotationCached = true;
+	}
 
 	// Apply the rotation to the current weapon
-	cMatrix3d currentWeaponRot;
 	if (isPistolLoaded) {
-		currentWeaponRot = pistolOrientation * rotZ;
-		weapon_pistol->setLocalRot(currentWeaponRot);
+		hapticState.weaponRot = pistolOrientation * rotZ;
 	}
 	else if (isDragunovLoaded) {
-		currentWeaponRot = dragunovOrientation * rotZ;
-		weapon_dragunov->setLocalRot(currentWeaponRot);
+		hapticState.weaponRot = dragunovOrientation * rotZ;
 	}
 	else if (isRifleLoaded) {
-		currentWeaponRot = rifleOrientation * rotZR;
-		weapon_rifle->setLocalRot(currentWeaponRot);
+		hapticState.weaponRot = rifleOrientation * rotZR;
 	}
 
 	// Update crosshair position based on weapon rotation
 	cVector3d crosshairOffset = cVector3d(-2.0, 0, 0); // Adjust as needed
 	crosshairOffset = rotZ * crosshairOffset;
 	cVector3d newCrosshairPos = offsetPos + crosshairOffset;
-	crosshair->setPosition(newCrosshairPos);
+	hapticState.crosshairPos = newCrosshairPos;
 }
 
 //------------------------------------------------------------------------------
 
-void updateWeaponLabel() {
-	if (isPistolLoaded) {
+void updateWeaponLabel(int weapon) {
+	if (weapon == WEAPON_PISTOL) {
 		weaponNameLabel->setText("M1911");
 	}
-	else if (isDragunovLoaded) {
+	else if (weapon == WEAPON_DRAGUNOV) {
 		weaponNameLabel->setText("DRAGUNOV");
 	}
-	else if (isRifleLoaded) {
+	else if (weapon == WEAPON_RIFLE) {
 		weaponNameLabel->setText("AK47");
 	}
 }
 
-//------------------------------------------------------------------------------
-
-void apply_pistol_force(void) {
-	std::lock_guard<std::mutex> deviceLock(deviceMutex);
-	std::lock_guard<std::mutex> weaponLock(weaponMutex);
+cMultiMesh* ShooterSession::getWeaponMesh(int weapon) {
+	if (weapon == WEAPON_DRAGUNOV) {
+		return weapon_dragunov;
+	}
+	else if (weapon == WEAPON_RIFLE) {
+		return weapon_rifle;
+	}
+	return weapon_pistol;
+}
 
-	float mf = 1.1;  // mass of firearm
-	float vf = 3.978;  // velocity of firearm
-	float mb = 0.015;  // mass of bullet 
-	float barrel_length = 0.127;  // barrel length
-	float tr = 0.003;  // recoil time
-	float force = 0.2 * (vf / tr);  // Increased force multiplier from 0.15 to 0.2
+//------------------------------------------------------------------------------
 
-	cVector3d direction(1 + ((rand() % 20) - 10) / 100.0,
-		((rand() % 20) - 10) / 100.0,
-		0.3 + ((rand() % 20) - 10) / 100.0);
-	direction.normalize();
-	cVector3d initial_force = force * direction;
+void ShooterSession::apply_pistol_force(void) {
 
-	float h_axis = 0.0678;
-	cVector3d initial_torque = h_axis * initial_force;
-	float moment_of_inertia = (h_axis * h_axis) * mf;
-	float deviation_angle = (h_axis * mb * barrel_length) / moment_of_inertia;
+	const RecoilEnvelope& envelope = pistolEnvelope;
+	int tick = recoilTick(envelope, elapsed_us);
+	float elapsed_time = elapsed_us / 1000.0f;  // ms
 
-	const int recoil_duration = 50;  // ms
-	const int recovery_duration = 100; // ms
-	const int total_duration = recoil_duration + recovery_duration;
-	
-	if (elapsed_time < total_duration) {
+	if (tick < envelope.totalTicks()) {
 		pistolFiring = true;
-		cVector3d current_force;
-		cVector3d current_torque;
-
-		if (elapsed_time < recoil_duration) {
-			// Recoil phase
-			float recoil_progress = (float)elapsed_time / recoil_duration;
-			float decay_factor = exp(-5.0 * recoil_progress);  // Faster decay
-			current_force = initial_force * decay_factor;
-			current_torque = initial_torque * decay_factor * deviation_angle;
-		}
-		else {
-			// Recovery phase
-			float recovery_progress = (float)(elapsed_time - recoil_duration) / recovery_duration;
-			float recovery_factor = exp(-5.0 * recovery_progress) * 0.3;  // Faster recovery
-			current_force = -initial_force * recovery_factor;
-			current_torque = -initial_torque * recovery_factor * deviation_angle;
-		}
+		cVector3d current_force = currentShot.direction * envelope.force[tick];
+		cVector3d current_torque = currentShot.direction * envelope.torque[tick];
 
 		// Apply the calculated force and torque
-		hapticDevice->setForceAndTorque(current_force, current_torque);
-		// updateForceVisualization(current_force, tool->getDeviceGlobalPos());
+		postRecoil(&pistolEnvelope, time_start_us);
+		sendForce(current_force, current_torque);
 
 		cVector3d weaponPosi = tool->getDeviceGlobalPos();
 		weaponPosi.add(cVector3d(0.0, 0, 0.1));
-		bulletTraj->m_pointA = weaponPosi;
-		bulletTraj->m_pointB = crosshair->getPosition() + cVector3d(-10,0,0);
-		bulletTraj->setShowEnabled(true);
+		hapticState.trajectoryA = weaponPosi;
+		hapticState.trajectoryB = hapticState.crosshairPos + cVector3d(-10,0,0);
+		hapticState.showTrajectory = true;
 
 		// Visual feedback: upward and slight sideways rotation
 		float max_vertical_recoil_angle = 15.0; // Maximum vertical recoil angle in degrees
@@ -1266,13 +6637,13 @@ void apply_pistol_force(void) {
 			// Fast, linear upward and sideways rotation during recoil
 			float progress = (float)elapsed_time / visual_recoil_duration;
 			current_vertical_angle = max_vertical_recoil_angle * progress;
-			current_horizontal_angle = max_horizontal_recoil_angle * progress * (rand() % 2 == 0 ? 1 : -1); // Random left or right
+			current_horizontal_angle = max_horizontal_recoil_angle * progress * currentShot.horizontalSign; // Random left or right
 		}
 		else if (elapsed_time < visual_total_duration) {
 			// Fast, linear return to original position during recovery
 			float progress = (float)(elapsed_time - visual_recoil_duration) / visual_recovery_duration;
 			current_vertical_angle = max_vertical_recoil_angle * (1.0 - progress);
-			current_horizontal_angle = max_horizontal_recoil_angle * (1.0 - progress) * (rand() % 2 == 0 ? 1 : -1); // Random left or right
+			current_horizontal_angle = max_horizontal_recoil_angle * (1.0 - progress) * currentShot.horizontalSign; // Random left or right
 		}
 		else {
 			// Hold at original position for the remainder of the haptic feedback
@@ -1286,57 +6657,51 @@ void apply_pistol_force(void) {
 		pistolRecoil.rotateAboutLocalAxisDeg(cVector3d(0, 1, 0), current_horizontal_angle); // Horizontal recoil
 
 		// Apply the rotation to the weapon's current orientation
-		cMatrix3d currentRot = weapon_pistol->getLocalRot();
-		weapon_pistol->setLocalRot(currentRot * pistolRecoil);
+		hapticState.weaponRot = hapticState.weaponRot * pistolRecoil;
 	}
 	else {
 		pistolFiring = false;
-		hapticDevice->setForce(zero_vector);
-		// Reset weapon rotation
-		weapon_pistol->setLocalRot(weapon_pistol->getLocalRot());
-		bulletTraj->setShowEnabled(false);
+		sendForce(zero_vector, zero_vector);
+		hapticState.showTrajectory = false;
 	}
 }
 
 //------------------------------------------------------------------------------
 
-void apply_rifle_force(void) {
-	float mf = 3.9;  // mass of firearm
-	float vf = 2.2688;  // velocity of firearm
-	float mb = 0.0079;  // mass of bullet 
-	float barrel_length = 0.415;  // barrel length
-	float tr = 0.06;  // recoil time
-	float force = 0.15 * (vf / tr);
+void ShooterSession::apply_rifle_force(void) {
+	const RecoilEnvelope& envelope = rifleEnvelope;
 
-	cVector3d direction(1 + ((rand() % 20) - 10) / 100.0,
-		((rand() % 20) - 10) / 100.0,
-		0.3 + ((rand() % 20) - 10) / 100.0);
-	direction.normalize();
-	cVector3d current_force = force * direction * 100;
+	// Next round of the burst gets its own direction
+	long long roundUs;
+	if (rifleFire.advance(elapsed_us, roundUs)) {
+		beginRecoilShot();
+	}
+	int tick = recoilTick(envelope, roundUs);
+	float elapsed_time = roundUs / 1000.0f;  // ms into the round
+	const int recoil_duration = RIFLE_RECOIL.recoil_duration;
+	const int recovery_duration = RIFLE_RECOIL.recovery_duration;
 
-	float h_axis = 0.065;
-	cVector3d current_torque = h_axis * current_force;
-	float moment_of_inertia = (h_axis * h_axis) * mf;
-	float deviation_angle = (h_axis * mb * barrel_length) / moment_of_inertia;
+	if (tick < envelope.recoilTicks) {
+		cVector3d current_force = currentShot.direction * envelope.force[tick];
+		cVector3d current_torque = currentShot.direction * envelope.torque[tick];
 
-	if (elapsed_time < 60) {
 		// apply the calculated force and torque
-		hapticDevice->setForceAndTorque(current_force, current_torque * deviation_angle);
-		// updateForceVisualization(current_force, tool->getDeviceGlobalPos());
+		postRecoil(&rifleEnvelope, time_start_us + rifleFire.round * rifleFire.periodUs);
+		sendForce(current_force, current_torque);
 
 		cVector3d weaponPosi = tool->getDeviceGlobalPos();
 		weaponPosi.add(cVector3d(0.0, 0, 0.5));
-		bulletTraj->m_pointA = weaponPosi;
-		bulletTraj->m_pointB = crosshair->getPosition() + cVector3d(-10, 0, 0);
-		bulletTraj->setShowEnabled(true);
+		hapticState.trajectoryA = weaponPosi;
+		hapticState.trajectoryB = hapticState.crosshairPos + cVector3d(-10, 0, 0);
+		hapticState.showTrajectory = true;
 
 		// Visual feedback
 		float max_vertical_recoil_angle = 5.0; // Maximum vertical recoil angle in degrees (smaller for continuous fire)
 		float max_horizontal_recoil_angle = 1.5; // Maximum horizontal recoil angle in degrees
 
 		// Calculate current recoil angles
-		float vertical_recoil = max_vertical_recoil_angle * (1.0 - (float)elapsed_time / 60.0);
-		float horizontal_recoil = max_horizontal_recoil_angle * sin((float)elapsed_time / 60.0 * M_PI) * (rand() % 2 == 0 ? 1 : -1);
+		float vertical_recoil = max_vertical_recoil_angle * (1.0 - (float)elapsed_time / recoil_duration);
+		float horizontal_recoil = max_horizontal_recoil_angle * sin((float)elapsed_time / recoil_duration * M_PI) * currentShot.horizontalSign;
 
 		cMatrix3d rifleRecoil;
 		rifleRecoil.identity();
@@ -1344,85 +6709,45 @@ void apply_rifle_force(void) {
 		rifleRecoil.rotateAboutLocalAxisDeg(cVector3d(1, 0, 0), horizontal_recoil); // Horizontal recoil
 
 		// Apply the rotation to the weapon's current orientation
-		cMatrix3d currentRot = weapon_rifle->getLocalRot();
-		weapon_rifle->setLocalRot(currentRot * rifleRecoil);
+		hapticState.weaponRot = hapticState.weaponRot * rifleRecoil;
 	}
-	else if (elapsed_time < 120) {
-		hapticDevice->setForce(zero_vector);
-		//updateForceVisualization(current_force, tool->getDeviceGlobalPos());
+	else {
+		// recovery runs to the end of the round, so the next one starts right after
+		sendForce(zero_vector, zero_vector);
 
 		// Visual recovery
-		float recovery_progress = (float)(elapsed_time - 60) / 60.0;
+		float recovery_progress = (float)(elapsed_time - recoil_duration) / recovery_duration;
 		cMatrix3d rifleRecovery;
 		rifleRecovery.identity();
 		rifleRecovery.rotateAboutLocalAxisDeg(cVector3d(1, 0, 0), 3.0 * recovery_progress); // Vertical recovery
 
-		cMatrix3d currentRot = weapon_rifle->getLocalRot();
-		weapon_rifle->setLocalRot(currentRot * rifleRecovery);
-	}
-	else {
-		time_start = currentTimeMillis();
-		elapsed_time = 0;
-		// Reset weapon rotation
-		weapon_rifle->setLocalRot(weapon_rifle->getLocalRot());
-		bulletTraj->setShowEnabled(false);
+		hapticState.weaponRot = hapticState.weaponRot * rifleRecovery;
 	}
 }
 
 //------------------------------------------------------------------------------
 
-void apply_sniper_force(void) {
-	std::lock_guard<std::mutex> deviceLock(deviceMutex);
-	std::lock_guard<std::mutex> weaponLock(weaponMutex);
-	float mf = 4.3;	// mass of firearm
-	float vf = 3.265;	// velocity of firearm
-	float mb = 0.0113;	// mass of bullet 
-	float barrel_length = 0.62;	// barrel length
-	float tr = 0.005;	// reduced recoil time for higher initial force
-	float force = 0.15 * (vf / tr);
-
-	cVector3d direction(1 + ((rand() % 20) - 10) / 100.0, ((rand() % 20) - 10) / 100.0, 0.3 + ((rand() % 20) - 10) / 100.0);
-	direction.normalize();
+void ShooterSession::apply_sniper_force(void) {
+	const RecoilEnvelope& envelope = sniperEnvelope;
+	int tick = recoilTick(envelope, elapsed_us);
+	float elapsed_time = elapsed_us / 1000.0f;  // ms
+	const int recoil_duration = SNIPER_RECOIL.recoil_duration;
+	const int recovery_duration = SNIPER_RECOIL.recovery_duration;
 
-	cVector3d initial_force = force * direction * 5.0; // Multiplied by 5 for very high initial force
-	float h_axis = 0.045;
-	cVector3d initial_torque = h_axis * initial_force;
-	float moment_of_inertia = (h_axis*h_axis)*mf;
-	float deviation_angle = (h_axis*mb*barrel_length) / moment_of_inertia;
-
-	const int recoil_duration = 120;  // ms
-	const int recovery_duration = 300; // ms
-	const int total_duration = recoil_duration + recovery_duration;
-
-	if (elapsed_time < total_duration) {
+	if (tick < envelope.totalTicks()) {
 		sniperFiring = true;
-		cVector3d current_force;
-		cVector3d current_torque;
-
-		if (elapsed_time < recoil_duration) {
-			// Recoil phase
-			float recoil_progress = (float)elapsed_time / recoil_duration;
-			float decay_factor = exp(-3.0 * recoil_progress);
-			current_force = initial_force * decay_factor;
-			current_torque = initial_torque * decay_factor * deviation_angle;
-		}
-		else {
-			// Recovery phase
-			float recovery_progress = (float)(elapsed_time - recoil_duration) / recovery_duration;
-			float recovery_factor = exp(-3.0 * recovery_progress) * 0.2;
-			current_force = -initial_force * recovery_factor;
-			current_torque = -initial_torque * recovery_factor * deviation_angle;
-		}
+		cVector3d current_force = currentShot.direction * envelope.force[tick];
+		cVector3d current_torque = currentShot.direction * envelope.torque[tick];
 
 		// Apply the calculated force and torque
-		hapticDevice->setForceAndTorque(current_force, current_torque);
-		//updateForceVisualization(current_force, tool->getDeviceGlobalPos());
+		postRecoil(&sniperEnvelope, time_start_us);
+		sendForce(current_force, current_torque);
 
 		cVector3d weaponPosi = tool->getDeviceGlobalPos();
 		weaponPosi.add(cVector3d(0.0, 0, 0.0));
-		bulletTraj->m_pointA = weaponPosi;
-		bulletTraj->m_pointB = crosshair->getPosition() + cVector3d(-10, 0, 0);
-		bulletTraj->setShowEnabled(true);
+		hapticState.trajectoryA = weaponPosi;
+		hapticState.trajectoryB = hapticState.crosshairPos + cVector3d(-10, 0, 0);
+		hapticState.showTrajectory = true;
 
 		// Visual feedback: simple upward rotation
 		float max_recoil_angle = 25.0; // Maximum recoil angle in degrees
@@ -1442,14 +6767,11 @@ void apply_sniper_force(void) {
 		sniperRecoil.rotateAboutLocalAxisDeg(cVector3d(0, 0, 1), -current_angle); // Rotate around x-axis
 
 		// Apply the rotation to the weapon's current orientation
-		cMatrix3d currentRot = weapon_dragunov->getLocalRot();
-		weapon_dragunov->setLocalRot(currentRot * sniperRecoil);
+		hapticState.weaponRot = hapticState.weaponRot * sniperRecoil;
 	}
 	else {
 		sniperFiring = false;
-		hapticDevice->setForce(zero_vector);
-		// Reset weapon rotation
-		weapon_dragunov->setLocalRot(weapon_dragunov->getLocalRot());
-		bulletTraj->setShowEnabled(false);
+		sendForce(zero_vector, zero_vector);
+		hapticState.showTrajectory = false;
 	}
 }